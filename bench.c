@@ -0,0 +1,462 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+
+/*****************************************************************************
+
+Title: Load generator for the echo server
+Copyright: (c) 2020 Samuel Schlesinger
+Maintainer: sgschlesinger@gmail.com
+License: MIT
+
+Opens connections from several threads, keeps a fixed number of
+fixed size requests in flight on each of them and counts a request as
+answered once as many bytes as it carried have come back. Latency is
+measured from when a request is queued to when its last byte arrives,
+so time spent waiting behind earlier requests in the pipeline counts.
+
+With -k it drives the server's --kv cache instead: each request is a
+length-prefixed GET or SET of one of that many keys, drawn ahead of
+time, and is answered once its response frame has come back.
+
+*****************************************************************************/
+
+#define panic(msg) { error(1, errno, msg); }
+
+// how the benchmark was asked to run
+struct options {
+  // where the server is listening
+  struct sockaddr_in address;
+  // the number of threads generating load
+  int nthreads;
+  // the number of connections, spread across the threads
+  int nconnections;
+  // the number of bytes in each request
+  int payload_size;
+  // the number of requests kept in flight on each connection
+  int pipeline;
+  // how long to measure for, in seconds
+  int duration;
+  // how long to run before measuring, in seconds
+  int warmup;
+  // the number of keys of the kv workload, 0 to echo
+  int nkeys;
+  // the percentage of kv requests which are GETs, the rest are SETs of payload_size values
+  int get_percent;
+};
+
+// the number of kv requests drawn, sent over and over
+#define KV_REQUESTS 4096
+
+// one connection to the server and its requests in flight
+struct bench_connection {
+  int socket;
+  // when each request in flight was queued, a ring of pipeline entries
+  uint64_t* started;
+  // the oldest request in flight
+  int oldest;
+  // the number of requests in flight
+  int inflight;
+  // bytes queued but not yet written
+  uint64_t unsent;
+  // bytes written so far, picks where in the payload the next write starts
+  uint64_t sent;
+  // bytes of the oldest request that have come back
+  int received;
+  // the number of requests queued so far, picks the size of the next
+  uint64_t queued;
+  // the length prefix of the response frame being read, and how many bytes of it came
+  unsigned char head[4];
+  int head_bytes;
+  // bytes of the response frame being read still to come, once its prefix is in
+  uint32_t body_left;
+};
+
+// one thread generating load and what it measured
+struct bench_thread {
+  pthread_t thread;
+  struct options* options;
+  // the connections this thread drives
+  struct bench_connection* connections;
+  int nconnections;
+  // latencies of the requests answered while measuring, in nanoseconds
+  struct histogram latencies;
+  // requests answered while measuring
+  uint64_t requests;
+  // bytes read while measuring
+  uint64_t bytes;
+};
+
+// nonzero once the warmup is over and results count
+static _Atomic int measuring = 0;
+
+// nonzero once the benchmark is over
+static _Atomic int finished = 0;
+
+// the bytes of every request, one after another, sent over and over
+static char* payload;
+static size_t payload_length;
+
+// where each request starts in payload, and where the last one ends
+static size_t* request_offsets;
+static int nrequests;
+
+uint64_t now_nanoseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+// queue one more request on a connection
+void queue_request(struct options* options, struct bench_connection* connection) {
+  int slot = (connection->oldest + connection->inflight) % options->pipeline;
+  connection->started[slot] = now_nanoseconds();
+  connection->inflight++;
+  int request = (int) (connection->queued++ % nrequests);
+  connection->unsent += request_offsets[request + 1] - request_offsets[request];
+}
+
+// write as much of what is queued as the socket takes, false if the connection broke
+bool send_requests(struct bench_connection* connection) {
+  while (connection->unsent > 0) {
+    size_t offset = connection->sent % payload_length;
+    size_t length = payload_length - offset;
+    if (length > connection->unsent)
+      length = connection->unsent;
+    ssize_t written = send(connection->socket, payload + offset, length, MSG_NOSIGNAL);
+    if (written < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    connection->sent += written;
+    connection->unsent -= written;
+  }
+  return true;
+}
+
+// write a kv request frame for a key, with a value of value_size bytes for a SET, returning
+// its length, at most 6 + 16 + value_size
+size_t write_kv_request(char* frame, bool get, int key, int value_size) {
+  char name[17];
+  int key_length = snprintf(name, sizeof(name), "key:%d", key);
+  uint32_t body = 2 + key_length + value_size;
+  frame[0] = body >> 24;
+  frame[1] = body >> 16;
+  frame[2] = body >> 8;
+  frame[3] = body;
+  frame[4] = get ? 'G' : 'S';
+  frame[5] = key_length;
+  memcpy(frame + 6, name, key_length);
+  for (int i = 0; i < value_size; i++)
+    frame[6 + key_length + i] = 'a' + i % 26;
+  return 4 + body;
+}
+
+// the number of responses the got bytes just read complete, echoing each request
+int echoed_responses(struct options* options, struct bench_connection* connection, ssize_t got) {
+  connection->received += got;
+  int answered = connection->received / options->payload_size;
+  connection->received %= options->payload_size;
+  return answered;
+}
+
+// the number of response frames the got bytes just read complete
+int framed_responses(struct bench_connection* connection, const unsigned char* data, ssize_t got) {
+  int answered = 0;
+  ssize_t offset = 0;
+  while (offset < got) {
+    if (connection->head_bytes < 4) {
+      connection->head[connection->head_bytes++] = data[offset++];
+      if (connection->head_bytes < 4)
+        continue;
+      connection->body_left = (uint32_t) connection->head[0] << 24 | (uint32_t) connection->head[1] << 16
+        | (uint32_t) connection->head[2] << 8 | connection->head[3];
+    }
+    size_t take = (size_t) (got - offset) < connection->body_left ? (size_t) (got - offset) : connection->body_left;
+    connection->body_left -= take;
+    offset += take;
+    if (connection->body_left == 0) {
+      connection->head_bytes = 0;
+      answered++;
+    }
+  }
+  return answered;
+}
+
+// read responses, recording each one that completes and replacing it with a new request
+bool receive_responses(struct bench_thread* thread, struct bench_connection* connection) {
+  struct options* options = thread->options;
+  unsigned char discard[1 << 16];
+  while (true) {
+    ssize_t got = recv(connection->socket, discard, sizeof(discard), 0);
+    if (got == 0)
+      return false;
+    if (got < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    bool counting = atomic_load_explicit(&measuring, memory_order_relaxed);
+    if (counting)
+      thread->bytes += got;
+    uint64_t now = now_nanoseconds();
+    int answered = options->nkeys == 0
+      ? echoed_responses(options, connection, got)
+      : framed_responses(connection, discard, got);
+    while (connection->inflight > 0 && answered-- > 0) {
+      if (counting) {
+        histogram_record(&thread->latencies, now - connection->started[connection->oldest]);
+        thread->requests++;
+      }
+      connection->oldest = (connection->oldest + 1) % options->pipeline;
+      connection->inflight--;
+      queue_request(options, connection);
+    }
+  }
+}
+
+// the number of SETs the kv preload keeps in flight
+#define KV_PRELOAD_BATCH 1024
+
+// SET every key of the kv workload once, so GETs find them from the start
+void preload_keys(struct options* options) {
+  struct bench_connection connection;
+  memset(&connection, 0, sizeof(connection));
+  connection.socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (connection.socket < 0)
+    panic("failed to create socket")
+  if (connect(connection.socket, (struct sockaddr*) &options->address, sizeof(options->address)) != 0)
+    panic("failed to connect")
+  size_t frame_size = 6 + 16 + options->payload_size;
+  unsigned char* frames = (unsigned char*) malloc(KV_PRELOAD_BATCH * frame_size);
+  if (frames == NULL)
+    panic("failed to allocate preload")
+  unsigned char discard[1 << 16];
+  for (int first = 0; first < options->nkeys; first += KV_PRELOAD_BATCH) {
+    size_t length = 0;
+    int count = 0;
+    for (int key = first; key < options->nkeys && count < KV_PRELOAD_BATCH; key++, count++)
+      length += write_kv_request((char*) frames + length, false, key, options->payload_size);
+    for (size_t sent = 0; sent < length; ) {
+      ssize_t written = send(connection.socket, frames + sent, length - sent, MSG_NOSIGNAL);
+      if (written < 0)
+        panic("failed to send preload")
+      sent += written;
+    }
+    while (count > 0) {
+      ssize_t got = recv(connection.socket, discard, sizeof(discard), 0);
+      if (got <= 0)
+        panic("failed to read preload responses")
+      count -= framed_responses(&connection, discard, got);
+    }
+  }
+  free(frames);
+  close(connection.socket);
+}
+
+void* run_bench_thread(void* argument) {
+  struct bench_thread* thread = (struct bench_thread*) argument;
+  struct options* options = thread->options;
+  int epoll = epoll_create1(0);
+  if (epoll < 0)
+    panic("failed to create epoll instance")
+
+  for (int i = 0; i < thread->nconnections; i++) {
+    struct bench_connection* connection = &thread->connections[i];
+    connection->socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (connection->socket < 0)
+      panic("failed to create socket")
+    if (connect(connection->socket, (struct sockaddr*) &options->address, sizeof(options->address)) != 0)
+      panic("failed to connect")
+    int yes = 1;
+    setsockopt(connection->socket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    fcntl(connection->socket, F_SETFL, fcntl(connection->socket, F_GETFL, 0) | O_NONBLOCK);
+    connection->started = (uint64_t*) malloc(sizeof(uint64_t) * options->pipeline);
+    if (connection->started == NULL)
+      panic("failed to allocate request timestamps")
+    // connections start at different requests, so they are not all after the same keys
+    connection->queued = (uint64_t) rand() % nrequests;
+    connection->sent = request_offsets[connection->queued];
+    for (int j = 0; j < options->pipeline; j++)
+      queue_request(options, connection);
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = connection;
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, connection->socket, &event) != 0)
+      panic("failed to add connection to epoll")
+  }
+
+  struct epoll_event events[64];
+  while (!atomic_load_explicit(&finished, memory_order_relaxed)) {
+    int n = epoll_wait(epoll, events, 64, 100);
+    if (n < 0 && errno != EINTR)
+      panic("failed to wait for events")
+    for (int i = 0; i < n; i++) {
+      struct bench_connection* connection = (struct bench_connection*) events[i].data.ptr;
+      if ((events[i].events & EPOLLIN) && !receive_responses(thread, connection))
+        panic("server closed the connection")
+      if (!send_requests(connection))
+        panic("failed to send request")
+    }
+  }
+
+  for (int i = 0; i < thread->nconnections; i++) {
+    close(thread->connections[i].socket);
+    free(thread->connections[i].started);
+  }
+  close(epoll);
+  return NULL;
+}
+
+void usage(const char* name) {
+  fprintf
+    ( stderr
+    , "usage: %s [-a address] [-p port] [-t threads] [-c connections] [-s payload bytes]"
+      " [-d pipeline depth] [-D seconds] [-w warmup seconds] [-k kv keys] [-g kv GET percentage]\n"
+    , name );
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  struct options options;
+  memset(&options, 0, sizeof(options));
+  options.address.sin_family = AF_INET;
+  options.address.sin_port = htons(8080);
+  options.address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  options.nthreads = 2;
+  options.nconnections = 64;
+  options.payload_size = 64;
+  options.pipeline = 1;
+  options.duration = 10;
+  options.warmup = 1;
+  options.nkeys = 0;
+  options.get_percent = 90;
+
+  int option;
+  while ((option = getopt(argc, argv, "a:p:t:c:s:d:D:w:k:g:")) != -1) {
+    switch (option) {
+      case 'a':
+        if (inet_pton(AF_INET, optarg, &options.address.sin_addr) != 1)
+          usage(argv[0]);
+        break;
+      case 'p': options.address.sin_port = htons(atoi(optarg)); break;
+      case 't': options.nthreads = atoi(optarg); break;
+      case 'c': options.nconnections = atoi(optarg); break;
+      case 's': options.payload_size = atoi(optarg); break;
+      case 'd': options.pipeline = atoi(optarg); break;
+      case 'D': options.duration = atoi(optarg); break;
+      case 'w': options.warmup = atoi(optarg); break;
+      case 'k': options.nkeys = atoi(optarg); break;
+      case 'g': options.get_percent = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (options.nthreads < 1 || options.nconnections < options.nthreads || options.payload_size < 1
+      || options.pipeline < 1 || options.duration < 1 || options.warmup < 0
+      || options.nkeys < 0 || options.get_percent < 0 || options.get_percent > 100)
+    usage(argv[0]);
+
+  if (options.nkeys == 0) {
+    payload_length = options.payload_size;
+    payload = (char*) malloc(payload_length);
+    nrequests = 1;
+    request_offsets = (size_t*) malloc(2 * sizeof(size_t));
+    if (payload == NULL || request_offsets == NULL)
+      panic("failed to allocate payload")
+    for (int i = 0; i < options.payload_size; i++)
+      payload[i] = 'a' + i % 26;
+    request_offsets[0] = 0;
+    request_offsets[1] = payload_length;
+  } else {
+    // every frame is a 4 byte length, the operation, the key length, a key of at most 16
+    // bytes and, for a SET, the value
+    nrequests = KV_REQUESTS;
+    payload = (char*) malloc((size_t) KV_REQUESTS * (6 + 16 + options.payload_size));
+    request_offsets = (size_t*) malloc((KV_REQUESTS + 1) * sizeof(size_t));
+    if (payload == NULL || request_offsets == NULL)
+      panic("failed to allocate payload")
+    payload_length = 0;
+    for (int i = 0; i < KV_REQUESTS; i++) {
+      request_offsets[i] = payload_length;
+      bool get = rand() % 100 < options.get_percent;
+      payload_length += write_kv_request(payload + payload_length, get, rand() % options.nkeys, get ? 0 : options.payload_size);
+    }
+    request_offsets[KV_REQUESTS] = payload_length;
+    preload_keys(&options);
+  }
+
+  struct bench_thread* threads = (struct bench_thread*) calloc(options.nthreads, sizeof(struct bench_thread));
+  struct bench_connection* connections =
+    (struct bench_connection*) calloc(options.nconnections, sizeof(struct bench_connection));
+  if (threads == NULL || connections == NULL)
+    panic("failed to allocate threads")
+  int assigned = 0;
+  for (int i = 0; i < options.nthreads; i++) {
+    threads[i].options = &options;
+    threads[i].connections = &connections[assigned];
+    threads[i].nconnections = options.nconnections / options.nthreads
+      + (i < options.nconnections % options.nthreads);
+    assigned += threads[i].nconnections;
+    initialize_histogram(&threads[i].latencies);
+    if (pthread_create(&threads[i].thread, NULL, run_bench_thread, &threads[i]) != 0)
+      panic("failed to start thread")
+  }
+
+  sleep(options.warmup);
+  uint64_t start = now_nanoseconds();
+  atomic_store(&measuring, 1);
+  sleep(options.duration);
+  atomic_store(&measuring, 0);
+  uint64_t elapsed = now_nanoseconds() - start;
+  atomic_store(&finished, 1);
+
+  struct histogram* latencies = (struct histogram*) malloc(sizeof(struct histogram));
+  if (latencies == NULL)
+    panic("failed to allocate histogram")
+  initialize_histogram(latencies);
+  uint64_t requests = 0;
+  uint64_t bytes = 0;
+  for (int i = 0; i < options.nthreads; i++) {
+    pthread_join(threads[i].thread, NULL);
+    histogram_merge(latencies, &threads[i].latencies);
+    requests += threads[i].requests;
+    bytes += threads[i].bytes;
+  }
+
+  double seconds = (double) elapsed / 1e9;
+  printf
+    ( "%d threads, %d connections, %d byte payloads, pipeline depth %d, %.2fs\n"
+    , options.nthreads, options.nconnections, options.payload_size, options.pipeline, seconds );
+  if (options.nkeys > 0)
+    printf("kv: %d keys, %d%% GETs\n", options.nkeys, options.get_percent);
+  printf("requests/sec: %.0f\n", (double) requests / seconds);
+  printf("transfer/sec: %.2f MB\n", (double) bytes / seconds / (1 << 20));
+  printf
+    ( "latency (us): min %.1f mean %.1f p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n"
+    , latencies->total == 0 ? 0 : latencies->min / 1e3
+    , histogram_mean(latencies) / 1e3
+    , histogram_percentile(latencies, 0.5) / 1e3
+    , histogram_percentile(latencies, 0.99) / 1e3
+    , histogram_percentile(latencies, 0.999) / 1e3
+    , latencies->max / 1e3 );
+
+  free(latencies);
+  free(connections);
+  free(threads);
+  free(request_offsets);
+  free(payload);
+  return 0;
+}
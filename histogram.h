@@ -0,0 +1,143 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*****************************************************************************
+
+HDR style histogram: values below 2^HISTOGRAM_PRECISION_BITS are counted
+exactly, above that every power of two is split into the same number of
+linear sub buckets, so every recorded value is kept to within one part in
+2^(HISTOGRAM_PRECISION_BITS - 1), better than three significant figures.
+
+*****************************************************************************/
+
+// the number of bits of each value we keep exactly
+#define HISTOGRAM_PRECISION_BITS 11
+
+// the number of sub buckets in each power of two
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_PRECISION_BITS)
+
+// half of the sub buckets, the ones above the first power of two are shared
+#define HISTOGRAM_HALF_BUCKETS (HISTOGRAM_SUB_BUCKETS / 2)
+
+// the largest value we count, bigger ones are clamped to it
+#define HISTOGRAM_MAX_BITS 40
+
+// the number of counters it takes to cover every value up to 2^HISTOGRAM_MAX_BITS
+#define HISTOGRAM_COUNTERS ((HISTOGRAM_MAX_BITS - HISTOGRAM_PRECISION_BITS + 2) * HISTOGRAM_HALF_BUCKETS)
+
+// counts of the values recorded, bucketed by magnitude
+struct histogram {
+  // how many values landed in each bucket
+  uint64_t counts[HISTOGRAM_COUNTERS];
+  // how many values there are in total
+  uint64_t total;
+  // the smallest value recorded
+  uint64_t min;
+  // the largest value recorded
+  uint64_t max;
+  // the sum of every value recorded, for the mean
+  double sum;
+};
+
+static inline void initialize_histogram(struct histogram* histogram) {
+  memset(histogram, 0, sizeof(struct histogram));
+  histogram->min = UINT64_MAX;
+}
+
+// the counter a value is kept in
+static inline int histogram_index(uint64_t value) {
+  if (value >= (1ULL << HISTOGRAM_MAX_BITS))
+    value = (1ULL << HISTOGRAM_MAX_BITS) - 1;
+  if (value < HISTOGRAM_SUB_BUCKETS)
+    return (int) value;
+  int shift = 63 - __builtin_clzll(value) - (HISTOGRAM_PRECISION_BITS - 1);
+  return shift * HISTOGRAM_HALF_BUCKETS + (int) (value >> shift);
+}
+
+// the smallest value kept in a counter
+static inline uint64_t histogram_value(int index) {
+  if (index < HISTOGRAM_SUB_BUCKETS)
+    return (uint64_t) index;
+  int shift = index / HISTOGRAM_HALF_BUCKETS - 1;
+  return (uint64_t) (index - shift * HISTOGRAM_HALF_BUCKETS) << shift;
+}
+
+static inline void histogram_record(struct histogram* histogram, uint64_t value) {
+  histogram->counts[histogram_index(value)]++;
+  histogram->total++;
+  histogram->sum += (double) value;
+  if (value < histogram->min)
+    histogram->min = value;
+  if (value > histogram->max)
+    histogram->max = value;
+}
+
+// add everything recorded in from into into
+static inline void histogram_merge(struct histogram* into, const struct histogram* from) {
+  for (int i = 0; i < HISTOGRAM_COUNTERS; i++)
+    into->counts[i] += from->counts[i];
+  into->total += from->total;
+  into->sum += from->sum;
+  if (from->min < into->min)
+    into->min = from->min;
+  if (from->max > into->max)
+    into->max = from->max;
+}
+
+// histogram_record for a histogram which other threads may histogram_merge_shared from while
+// it is recorded into, only ever by one thread, so every update is a plain store
+static inline void histogram_record_shared(struct histogram* histogram, uint64_t value) {
+  uint64_t* count = &histogram->counts[histogram_index(value)];
+  __atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&histogram->total, histogram->total + 1, __ATOMIC_RELAXED);
+  double sum = histogram->sum + (double) value;
+  __atomic_store(&histogram->sum, &sum, __ATOMIC_RELAXED);
+  if (value < histogram->min)
+    __atomic_store_n(&histogram->min, value, __ATOMIC_RELAXED);
+  if (value > histogram->max)
+    __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+}
+
+// histogram_merge from a histogram another thread is recording into with
+// histogram_record_shared, what we get may be a moment out of date but is never torn
+static inline void histogram_merge_shared(struct histogram* into, const struct histogram* from) {
+  for (int i = 0; i < HISTOGRAM_COUNTERS; i++)
+    into->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+  into->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+  double sum;
+  __atomic_load(&from->sum, &sum, __ATOMIC_RELAXED);
+  into->sum += sum;
+  uint64_t min = __atomic_load_n(&from->min, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+  if (min < into->min)
+    into->min = min;
+  if (max > into->max)
+    into->max = max;
+}
+
+// the value below which the given fraction of the recorded values fall
+static inline uint64_t histogram_percentile(const struct histogram* histogram, double fraction) {
+  if (histogram->total == 0)
+    return 0;
+  uint64_t wanted = (uint64_t) (fraction * (double) histogram->total + 0.5);
+  if (wanted == 0)
+    wanted = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_COUNTERS; i++) {
+    seen += histogram->counts[i];
+    if (seen >= wanted) {
+      uint64_t value = histogram_value(i);
+      return value > histogram->max ? histogram->max : value;
+    }
+  }
+  return histogram->max;
+}
+
+static inline double histogram_mean(const struct histogram* histogram) {
+  return histogram->total == 0 ? 0 : histogram->sum / (double) histogram->total;
+}
+
+#endif
@@ -0,0 +1,582 @@
+// the server's own primitives, everything but its main
+#define SERVER_NO_MAIN
+#include "server.c"
+
+/*****************************************************************************
+
+Title: Microbenchmarks for the server's primitives
+Copyright: (c) 2020 Samuel Schlesinger
+Maintainer: sgschlesinger@gmail.com
+License: MIT
+
+Times the pieces the server is built from, one at a time and without
+any sockets but the ones a benchmark makes for itself: client_buffers
+from malloc and from a buffer_pool, read_available filling a buffer that
+starts small, the handoff queue with several producers and consumers,
+cutting frames, scanning for newlines, the timer wheel and the kv
+cache's GETs, one key at a time and batched, and SETs. Each
+benchmark runs for a fixed time and the results go to standard output
+as a single JSON document, so successive commits can be compared by
+machine.
+
+*****************************************************************************/
+
+// how the microbenchmarks were asked to run
+struct options {
+  // only run benchmarks whose name contains this, NULL for all of them
+  const char* filter;
+  // how long each benchmark runs for, in milliseconds
+  int milliseconds;
+  // the most producers, and the most consumers, the handoff queue is run with
+  int nthreads;
+};
+
+// what a benchmark got through
+struct result {
+  // the number of operations done
+  uint64_t operations;
+  // the number of bytes they went through, 0 where that means nothing
+  uint64_t bytes;
+  // how long they took
+  uint64_t nanoseconds;
+  // a figure of the benchmark's own, named by extra_name, NULL for none
+  const char* extra_name;
+  double extra;
+};
+
+// whether the result being printed is the first, which takes no comma
+static bool first_result = true;
+
+// whether a benchmark of that name is to run
+bool selected(struct options* options, const char* name) {
+  return options->filter == NULL || strstr(name, options->filter) != NULL;
+}
+
+// print a result as an element of the benchmarks array
+void report(const char* name, struct result result) {
+  double seconds = (double) result.nanoseconds / 1e9;
+  printf
+    ( "%s\n    { \"name\": \"%s\", \"operations\": %lu, \"seconds\": %.6f, \"ns_per_operation\": %.3f"
+      ", \"operations_per_second\": %.0f"
+    , first_result ? "" : ",", name, result.operations, seconds
+    , (double) result.nanoseconds / (double) result.operations, (double) result.operations / seconds);
+  if (result.bytes > 0)
+    printf(", \"gb_per_second\": %.3f", (double) result.bytes / seconds / 1e9);
+  if (result.extra_name != NULL)
+    printf(", \"%s\": %.3f", result.extra_name, result.extra);
+  printf(" }");
+  fflush(stdout);
+  first_result = false;
+}
+
+// the client every buffer reads from, a socket nobody looks at unless the benchmark says
+struct client bench_client(int socket) {
+  struct client client;
+  memset(&client, 0, sizeof(client));
+  client.socket = socket;
+  return client;
+}
+
+// the number of buffers held at once by the client_buffer benchmarks, as though each
+// were a connection, so neither side gets to hand back the one it just gave out
+#define LIVE_BUFFERS 256
+
+// a client_buffer for each connection that comes, from malloc or the pool, released once
+// LIVE_BUFFERS later connections came
+struct result bench_client_buffers(struct options* options, bool pooled) {
+  struct buffer_pool pool;
+  initialize_buffer_pool(&pool, true);
+  struct client_buffer* live[LIVE_BUFFERS];
+  for (int i = 0; i < LIVE_BUFFERS; i++)
+    live[i] = NULL;
+  struct result result = { 0, 0, 0, NULL, 0 };
+  uint64_t started = monotonic_nanoseconds(), deadline = started + options->milliseconds * 1000000ull;
+  uint64_t now = started;
+  while (now < deadline) {
+    for (int i = 0; i < 1024; i++) {
+      struct client_buffer** slot = &live[result.operations++ % LIVE_BUFFERS];
+      if (*slot != NULL) {
+        if (pooled)
+          pool_release_client_buffer(*slot);
+        else
+          free_client_buffer(*slot);
+      }
+      *slot = pooled
+        ? pool_acquire_client_buffer(&pool, bench_client(-1), 1 << 10)
+        : make_client_buffer(bench_client(-1), 1 << 10);
+      // a connection writes its first request in, which is when malloc's pages get touched
+      (*slot)->buffer[0] = 1;
+    }
+    now = monotonic_nanoseconds();
+  }
+  result.nanoseconds = now - started;
+  for (int i = 0; i < LIVE_BUFFERS; i++)
+    if (live[i] != NULL && !pooled)
+      free_client_buffer(live[i]);
+  return result;
+}
+
+// the most one write puts in the socket read_available is benchmarked on, well under what
+// a unix socket buffers
+#define READ_CHUNK (1 << 16)
+
+// payload bytes arriving on a fresh pooled client_buffer, READ_CHUNK at a time, each read
+// by read_available as it arrives, so the buffer grows from the smallest size class to the
+// payload; only read_available is timed, and the buffer moving counts as a resize
+struct result bench_read_available(struct options* options, int payload) {
+  int sockets[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) == -1)
+    panic("failed to create socket pair")
+  fcntl(sockets[0], F_SETFL, fcntl(sockets[0], F_GETFL, 0) | O_NONBLOCK);
+  char* data = (char*) malloc(READ_CHUNK);
+  if (data == NULL)
+    panic("failed to allocate payload")
+  memset(data, 'x', READ_CHUNK);
+  struct buffer_pool pool;
+  initialize_buffer_pool(&pool, true);
+  struct result result = { 0, 0, 0, "resizes_per_operation", 0 };
+  uint64_t resizes = 0;
+  uint64_t deadline = monotonic_nanoseconds() + options->milliseconds * 1000000ull;
+  while (monotonic_nanoseconds() < deadline) {
+    struct client_buffer* client_buffer = pool_acquire_client_buffer(&pool, bench_client(sockets[0]), 1 << 10);
+    for (int sent = 0; sent < payload;) {
+      int chunk = payload - sent < READ_CHUNK ? payload - sent : READ_CHUNK;
+      if (write(sockets[1], data, chunk) != chunk)
+        panic("failed to write payload")
+      sent += chunk;
+      char* buffer = client_buffer->buffer;
+      int count;
+      uint64_t started = monotonic_nanoseconds();
+      // with no budget to speak of, it reads until the socket is empty
+      if (read_available(client_buffer, INT_MAX, &count) != READ_DRAINED || count != chunk)
+        panic("read_available read something other than what was written")
+      result.nanoseconds += monotonic_nanoseconds() - started;
+      resizes += client_buffer->buffer != buffer;
+    }
+    result.operations++;
+    result.bytes += payload;
+    pool_release_client_buffer(client_buffer);
+  }
+  result.extra = (double) resizes / (double) result.operations;
+  close(sockets[0]);
+  close(sockets[1]);
+  free(data);
+  return result;
+}
+
+// the handoff queue under load from every side at once
+struct handoff_bench {
+  struct handoff_queue* queue;
+  // set once the producers are to stop
+  _Atomic bool stopping;
+  // the number of producers still pushing
+  _Atomic int producing;
+  // clients taken off the queue, by all the consumers
+  _Atomic uint64_t popped;
+};
+
+// push clients until told to stop, waiting out a full queue
+void* run_handoff_producer(void* argument) {
+  struct handoff_bench* bench = (struct handoff_bench*) argument;
+  struct client client = bench_client(-1);
+  while (!atomic_load_explicit(&bench->stopping, memory_order_relaxed))
+    while (!handoff_push(bench->queue, client))
+      sched_yield();
+  atomic_fetch_sub(&bench->producing, 1);
+  return NULL;
+}
+
+// pop clients until the producers are gone and the queue is empty
+void* run_handoff_consumer(void* argument) {
+  struct handoff_bench* bench = (struct handoff_bench*) argument;
+  struct client client;
+  uint64_t popped = 0;
+  while (true) {
+    if (handoff_pop(bench->queue, &client)) {
+      popped++;
+      continue;
+    }
+    if (atomic_load(&bench->producing) == 0 && handoff_empty(bench->queue))
+      break;
+    sched_yield();
+  }
+  atomic_fetch_add(&bench->popped, popped);
+  return NULL;
+}
+
+// producers pushing clients through a handoff_queue the size the server makes it to
+// consumers popping them, each client counting as an operation
+struct result bench_handoff(struct options* options, int nproducers, int nconsumers) {
+  struct handoff_bench bench;
+  bench.queue = make_handoff_queue(1024);
+  atomic_init(&bench.stopping, false);
+  atomic_init(&bench.producing, nproducers);
+  atomic_init(&bench.popped, 0);
+  pthread_t threads[nproducers + nconsumers];
+  uint64_t started = monotonic_nanoseconds();
+  for (int i = 0; i < nproducers + nconsumers; i++)
+    if (pthread_create(&threads[i], NULL, i < nproducers ? run_handoff_producer : run_handoff_consumer, &bench) != 0)
+      panic("failed to start handoff thread")
+  struct timespec duration = { options->milliseconds / 1000, (options->milliseconds % 1000) * 1000000l };
+  nanosleep(&duration, NULL);
+  atomic_store(&bench.stopping, true);
+  for (int i = 0; i < nproducers + nconsumers; i++)
+    pthread_join(threads[i], NULL);
+  struct result result = { atomic_load(&bench.popped), 0, monotonic_nanoseconds() - started, NULL, 0 };
+  close(bench.queue->eventfd);
+  free(bench.queue->cells);
+  free(bench.queue);
+  return result;
+}
+
+// the size of the buffer of frames, or of bytes to scan, gone over again and again
+#define SCAN_SIZE (1 << 20)
+
+// cutting SCAN_SIZE bytes of frames of frame_size bytes, delimiter or prefix included,
+// with frame_next, each frame counting as an operation
+struct result bench_frames(struct options* options, enum framing framing, int frame_size) {
+  char* data = (char*) malloc(SCAN_SIZE);
+  if (data == NULL)
+    panic("failed to allocate frames")
+  int length = SCAN_SIZE - SCAN_SIZE % frame_size;
+  for (int offset = 0; offset < length; offset += frame_size) {
+    memset(data + offset, 'x', frame_size);
+    if (framing == FRAMING_LINES) {
+      data[offset + frame_size - 1] = '\n';
+    } else {
+      uint32_t prefix = htonl(frame_size - FRAME_PREFIX_SIZE);
+      memcpy(data + offset, &prefix, FRAME_PREFIX_SIZE);
+    }
+  }
+  struct result result = { 0, 0, 0, NULL, 0 };
+  uint64_t started = monotonic_nanoseconds(), deadline = started + options->milliseconds * 1000000ull;
+  uint64_t now = started;
+  while (now < deadline) {
+    int offset = 0;
+    while (offset < length) {
+      struct frame frame;
+      int scanned = 0, size;
+      if (frame_next(framing, data + offset, length - offset, INT_MAX, &scanned, &frame, &size) != FRAME_READY)
+        panic("frame_next found no frame where one was")
+      offset += size;
+      result.operations++;
+    }
+    result.bytes += length;
+    now = monotonic_nanoseconds();
+  }
+  result.nanoseconds = now - started;
+  free(data);
+  return result;
+}
+
+// scanning SCAN_SIZE bytes with a newline only at the very end, each scan counting as an
+// operation
+struct result bench_scan(struct options* options, const char* (*scan)(const char* data, size_t length)) {
+  char* data = (char*) malloc(SCAN_SIZE);
+  if (data == NULL)
+    panic("failed to allocate scan buffer")
+  memset(data, 'x', SCAN_SIZE);
+  data[SCAN_SIZE - 1] = '\n';
+  struct result result = { 0, 0, 0, NULL, 0 };
+  uint64_t started = monotonic_nanoseconds(), deadline = started + options->milliseconds * 1000000ull;
+  uint64_t now = started;
+  while (now < deadline) {
+    if (scan(data, SCAN_SIZE) != data + SCAN_SIZE - 1)
+      panic("scanner missed the newline")
+    result.operations++;
+    result.bytes += SCAN_SIZE;
+    now = monotonic_nanoseconds();
+  }
+  result.nanoseconds = now - started;
+  free(data);
+  return result;
+}
+
+// the number of timers the timer benchmarks keep, as though each were a connection
+#define BENCH_TIMERS (1 << 16)
+
+// what the timer benchmarks measure
+enum timer_bench {
+  // moving armed timers to a later tick, what every event does to its connection's timer
+  TIMER_BENCH_REARM,
+  // arming a timer and cancelling it again
+  TIMER_BENCH_ARM_CANCEL,
+  // running the wheel forward until every armed timer went off, each timer an operation
+  TIMER_BENCH_EXPIRE
+};
+
+// the timer wheel with BENCH_TIMERS timers, due over the next few minutes as timeouts are
+struct result bench_timers(struct options* options, enum timer_bench which) {
+  struct timer_wheel* wheel = (struct timer_wheel*) malloc(sizeof(struct timer_wheel));
+  struct timer* timers = (struct timer*) malloc(sizeof(struct timer) * BENCH_TIMERS);
+  uint32_t* delays = (uint32_t*) malloc(sizeof(uint32_t) * BENCH_TIMERS);
+  if (wheel == NULL || timers == NULL || delays == NULL)
+    panic("failed to allocate timers")
+  initialize_timer_wheel(wheel);
+  uint32_t random = 1;
+  for (int i = 0; i < BENCH_TIMERS; i++) {
+    initialize_timer(&timers[i]);
+    random = random * 1664525 + 1013904223;
+    delays[i] = 1 + (random >> 8) % timer_ticks(120000);
+  }
+  struct result result = { 0, 0, 0, NULL, 0 };
+  uint64_t started = monotonic_nanoseconds(), deadline = started + options->milliseconds * 1000000ull;
+  uint64_t now = started;
+  while (now < deadline) {
+    if (which == TIMER_BENCH_EXPIRE) {
+      for (int i = 0; i < BENCH_TIMERS; i++)
+        timer_arm(wheel, &timers[i], wheel->now + delays[i]);
+      // only the expiring is timed
+      uint64_t last = wheel->now + timer_ticks(120000);
+      uint64_t expiring = monotonic_nanoseconds();
+      while (timer_wheel_expire(wheel, last) != NULL)
+        result.operations++;
+      result.nanoseconds += monotonic_nanoseconds() - expiring;
+    } else {
+      // each pass gives every timer another timer's delay, so no timer_arm is a no-op
+      uint64_t pass = result.operations / BENCH_TIMERS + 1;
+      for (int i = 0; i < BENCH_TIMERS; i++) {
+        timer_arm(wheel, &timers[i], wheel->now + delays[(i + pass) % BENCH_TIMERS]);
+        if (which == TIMER_BENCH_ARM_CANCEL)
+          timer_cancel(wheel, &timers[i]);
+      }
+      result.operations += BENCH_TIMERS;
+    }
+    now = monotonic_nanoseconds();
+  }
+  if (which != TIMER_BENCH_EXPIRE)
+    result.nanoseconds = now - started;
+  free(delays);
+  free(timers);
+  free(wheel);
+  return result;
+}
+
+// the number of keys the kv benchmarks look up, their table well past the last level cache
+#define BENCH_KV_KEYS (1 << 18)
+
+// the size of the values of the kv benchmarks, all in one size class
+#define BENCH_KV_VALUE 64
+
+// what the kv benchmarks measure
+enum kv_bench {
+  // kv_get of one key after another, in no particular order
+  KV_BENCH_GET,
+  // kv_each_key with KV_BATCH keys at a time, which prefetches them all first
+  KV_BENCH_GET_BATCHED,
+  // kv_set of keys already there, in no particular order
+  KV_BENCH_SET,
+  // kv_set of keys never seen, in a store so full each one evicts another
+  KV_BENCH_SET_EVICTING
+};
+
+// the keys of the kv benchmarks, as kv_valid_keys has them, and where each starts
+struct kv_bench_keys {
+  unsigned char* keys;
+  int* offsets;
+};
+
+// the kv benchmarks' deliver, copying values out as kv_respond does
+void kv_bench_deliver(void* argument, enum kv_status status, const char* value, uint32_t length) {
+  struct result* result = (struct result*) argument;
+  static char sink[BENCH_KV_VALUE];
+  if (status != KV_OK)
+    panic("kv benchmark missed a key")
+  memcpy(sink, value, length);
+  result->bytes += length;
+}
+
+// the store and keys the kv benchmarks share, every key set, made on first use
+struct kv_store* kv_bench_store(struct kv_bench_keys* keys) {
+  static struct kv_store* store = NULL;
+  static struct kv_bench_keys shared;
+  if (store != NULL) {
+    *keys = shared;
+    return store;
+  }
+  store = make_kv_store(256l << 20, true);
+  shared.keys = (unsigned char*) malloc(BENCH_KV_KEYS * 16);
+  shared.offsets = (int*) malloc((BENCH_KV_KEYS + 1) * sizeof(int));
+  int* order = (int*) malloc(BENCH_KV_KEYS * sizeof(int));
+  if (shared.keys == NULL || shared.offsets == NULL || order == NULL)
+    panic("failed to allocate kv keys")
+  int i, length = 0;
+  for (i = 0; i < BENCH_KV_KEYS; i++)
+    order[i] = i;
+  // a fixed shuffle, so successive keys land all over the table but runs compare
+  uint64_t random = 0x2545f4914f6cdd1dull;
+  for (i = BENCH_KV_KEYS - 1; i > 0; i--) {
+    random ^= random << 13;
+    random ^= random >> 7;
+    random ^= random << 17;
+    int j = (int) (random % (uint64_t) (i + 1)), swap = order[i];
+    order[i] = order[j];
+    order[j] = swap;
+  }
+  char value[BENCH_KV_VALUE];
+  memset(value, 'v', sizeof(value));
+  for (i = 0; i < BENCH_KV_KEYS; i++) {
+    shared.offsets[i] = length;
+    int key_length = snprintf((char*) shared.keys + length + 1, 15, "kv:%d", order[i]);
+    shared.keys[length] = (unsigned char) key_length;
+    const char* key = (const char*) shared.keys + length + 1;
+    kv_set(store, kv_hash(key, key_length), key, key_length, value, sizeof(value));
+    length += 1 + key_length;
+  }
+  shared.offsets[BENCH_KV_KEYS] = length;
+  free(order);
+  *keys = shared;
+  return store;
+}
+
+// the kv cache without connections, on a store holding BENCH_KV_KEYS keys
+struct result bench_kv(struct options* options, enum kv_bench which) {
+  // the evicting benchmark sets keys of its own, and needs neither the shared store nor
+  // its keys
+  struct kv_bench_keys keys = { NULL, NULL };
+  struct kv_store* store = which == KV_BENCH_SET_EVICTING ? NULL : kv_bench_store(&keys);
+  char value[BENCH_KV_VALUE];
+  memset(value, 'w', sizeof(value));
+  char name[32];
+  int name_length;
+  // the evicting store is as small as they come, and filled at least twice over before it
+  // is timed so every set of a key it has never seen evicts another
+  static struct kv_store* evicting = NULL;
+  static unsigned long fresh = 0;
+  if (which == KV_BENCH_SET_EVICTING && evicting == NULL) {
+    evicting = make_kv_store((size_t) KV_STRIPES * KV_PAGE_SIZE, true);
+    while (fresh < 2ul * KV_STRIPES * KV_PAGE_SIZE / KV_ITEM_UNIT) {
+      name_length = snprintf(name, sizeof(name), "evict:%lu", fresh++);
+      kv_set(evicting, kv_hash(name, name_length), name, name_length, value, sizeof(value));
+    }
+  }
+  struct result result = { 0, 0, 0, NULL, 0 };
+  uint64_t started = monotonic_nanoseconds(), deadline = started + options->milliseconds * 1000000ull;
+  uint64_t now = started;
+  while (now < deadline) {
+    int first = (int) (result.operations % BENCH_KV_KEYS), i;
+    for (i = first; i < first + 1024; i++) {
+      const char* key = NULL;
+      int key_length = 0;
+      if (store != NULL) {
+        key = (const char*) keys.keys + keys.offsets[i] + 1;
+        key_length = keys.keys[keys.offsets[i]];
+      }
+      switch (which) {
+        case KV_BENCH_GET:
+          kv_get(store, kv_hash(key, key_length), key, key_length, kv_bench_deliver, &result);
+          break;
+        case KV_BENCH_GET_BATCHED:
+          if ((i - first) % KV_BATCH == 0)
+            kv_each_key
+              ( store, KV_GET, keys.keys + keys.offsets[i], keys.offsets[i + KV_BATCH] - keys.offsets[i]
+              , kv_bench_deliver, &result);
+          break;
+        case KV_BENCH_SET:
+          kv_set(store, kv_hash(key, key_length), key, key_length, value, sizeof(value));
+          result.bytes += sizeof(value);
+          break;
+        case KV_BENCH_SET_EVICTING:
+          name_length = snprintf(name, sizeof(name), "evict:%lu", fresh++);
+          kv_set(evicting, kv_hash(name, name_length), name, name_length, value, sizeof(value));
+          result.bytes += sizeof(value);
+          break;
+      }
+    }
+    result.operations += 1024;
+    now = monotonic_nanoseconds();
+  }
+  result.nanoseconds = now - started;
+  return result;
+}
+
+void microbench_usage(const char* name) {
+  fprintf
+    ( stderr
+    , "usage: %s [-f name filter] [-m milliseconds per benchmark] [-t most handoff producers and consumers]\n"
+    , name );
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  struct options options;
+  options.filter = NULL;
+  options.milliseconds = 200;
+  options.nthreads = 4;
+
+  int option;
+  while ((option = getopt(argc, argv, "f:m:t:")) != -1) {
+    switch (option) {
+      case 'f': options.filter = optarg; break;
+      case 'm': options.milliseconds = atoi(optarg); break;
+      case 't': options.nthreads = atoi(optarg); break;
+      default: microbench_usage(argv[0]);
+    }
+  }
+  if (optind != argc || options.milliseconds <= 0 || options.nthreads <= 0)
+    microbench_usage(argv[0]);
+  select_newline_scanner();
+
+  char name[64];
+  printf("{\n  \"milliseconds\": %d,\n  \"benchmarks\": [", options.milliseconds);
+
+  if (selected(&options, "client_buffer/malloc"))
+    report("client_buffer/malloc", bench_client_buffers(&options, false));
+  if (selected(&options, "client_buffer/pool"))
+    report("client_buffer/pool", bench_client_buffers(&options, true));
+
+  for (int payload = 1 << 10; payload <= 1 << 20; payload <<= 2) {
+    snprintf(name, sizeof(name), "read_available/%d", payload);
+    if (selected(&options, name))
+      report(name, bench_read_available(&options, payload));
+  }
+
+  for (int producers = 1; producers <= options.nthreads; producers <<= 1) {
+    for (int consumers = 1; consumers <= options.nthreads; consumers <<= 1) {
+      snprintf(name, sizeof(name), "handoff/%dx%d", producers, consumers);
+      if (selected(&options, name))
+        report(name, bench_handoff(&options, producers, consumers));
+    }
+  }
+
+  static const int frame_sizes[] = { 64, 4096 };
+  for (size_t i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); i++) {
+    snprintf(name, sizeof(name), "frame/lines/%d", frame_sizes[i]);
+    if (selected(&options, name))
+      report(name, bench_frames(&options, FRAMING_LINES, frame_sizes[i]));
+    snprintf(name, sizeof(name), "frame/length_prefixed/%d", frame_sizes[i]);
+    if (selected(&options, name))
+      report(name, bench_frames(&options, FRAMING_LENGTH_PREFIXED, frame_sizes[i]));
+  }
+
+  if (selected(&options, "scan/bytes"))
+    report("scan/bytes", bench_scan(&options, scan_newline_bytes));
+#if defined(__x86_64__)
+  if (selected(&options, "scan/sse2"))
+    report("scan/sse2", bench_scan(&options, scan_newline_sse2));
+  if (__builtin_cpu_supports("avx2") && selected(&options, "scan/avx2"))
+    report("scan/avx2", bench_scan(&options, scan_newline_avx2));
+#elif defined(__aarch64__)
+  if (selected(&options, "scan/neon"))
+    report("scan/neon", bench_scan(&options, scan_newline_neon));
+#endif
+
+  if (selected(&options, "timer/rearm"))
+    report("timer/rearm", bench_timers(&options, TIMER_BENCH_REARM));
+  if (selected(&options, "timer/arm_cancel"))
+    report("timer/arm_cancel", bench_timers(&options, TIMER_BENCH_ARM_CANCEL));
+  if (selected(&options, "timer/expire"))
+    report("timer/expire", bench_timers(&options, TIMER_BENCH_EXPIRE));
+
+  if (selected(&options, "kv/get"))
+    report("kv/get", bench_kv(&options, KV_BENCH_GET));
+  if (selected(&options, "kv/get_batched"))
+    report("kv/get_batched", bench_kv(&options, KV_BENCH_GET_BATCHED));
+  if (selected(&options, "kv/set"))
+    report("kv/set", bench_kv(&options, KV_BENCH_SET));
+  if (selected(&options, "kv/set_evicting"))
+    report("kv/set_evicting", bench_kv(&options, KV_BENCH_SET_EVICTING));
+
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -1,16 +1,55 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
 #include <error.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/errqueue.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+#include <limits.h>
 #include <netinet/in.h>
-#include <semaphore.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ioctl.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "histogram.h"
 
 /*****************************************************************************
 
@@ -35,31 +74,288 @@ License: MIT
   exit(EXIT_FAILURE);\
 }
 
+// the size of a cache line, hot atomics get one each to avoid false sharing
+#define CACHE_LINE_SIZE 64
+
+// log levels, messages below LOG_LEVEL compile away along with their arguments
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// the longest message we keep, longer ones are cut short
+#define LOG_MESSAGE_SIZE 232
+
+// the number of records each thread's log ring holds, a power of two
+#define LOG_RING_RECORDS 1024
+
+// how many messages a single call site may log per second per thread, and in one burst
+#define LOG_RATE 100
+#define LOG_BURST 1000
+
+// one formatted message waiting for the logging thread
+struct log_record {
+  // when the message was logged
+  struct timespec time;
+  // the level it was logged at
+  int level;
+  // the message itself, NUL terminated
+  char message[LOG_MESSAGE_SIZE];
+};
+
+// single-producer/single-consumer ring of records, one for each thread that logs
+struct log_ring {
+  // the records
+  struct log_record records[LOG_RING_RECORDS];
+  // the next ring in the registry
+  struct log_ring* next;
+  // the number the thread logs under
+  unsigned int thread;
+  // the next record the logging thread reads
+  _Alignas(CACHE_LINE_SIZE) _Atomic size_t head;
+  // the next record the owning thread writes
+  _Alignas(CACHE_LINE_SIZE) _Atomic size_t tail;
+  // messages lost to a full ring, since the logging thread last reported them
+  _Atomic uint64_t dropped;
+};
+
+// per call site token bucket, so no one message can flood the log
+struct log_limit {
+  // tokens left, each message takes one
+  double tokens;
+  // when we last added tokens, in seconds
+  double refilled;
+  // messages dropped since the last one that got through
+  uint64_t suppressed;
+};
+
+// every ring ever registered, rings live as long as the process
+static _Atomic(struct log_ring*) log_rings = NULL;
+
+// the number the next thread to log gets
+static _Atomic unsigned int log_threads = 0;
+
+// nonzero while the logging thread is asleep and wants a futex wake
+static _Atomic uint32_t log_sleeping = 0;
+
+// the calling thread's ring, NULL until it first logs
+static __thread struct log_ring* log_thread_ring = NULL;
+
+// the calling thread's ring, registering a new one the first time around
+struct log_ring* log_ring(void) {
+  if (log_thread_ring != NULL)
+    return log_thread_ring;
+  struct log_ring* ring = (struct log_ring*) aligned_alloc(CACHE_LINE_SIZE, sizeof(struct log_ring));
+  if (ring == NULL)
+    panic("failed to allocate log ring")
+  ring->thread = atomic_fetch_add(&log_threads, 1);
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->dropped, 0);
+  ring->next = atomic_load(&log_rings);
+  while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring))
+    ;
+  log_thread_ring = ring;
+  return ring;
+}
+
+// whether a call site may log right now, takes a token if so
+bool log_allow(struct log_limit* limit) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  double seconds = (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+  if (limit->refilled == 0)
+    limit->tokens = LOG_BURST;
+  limit->tokens += (seconds - limit->refilled) * LOG_RATE;
+  if (limit->tokens > LOG_BURST)
+    limit->tokens = LOG_BURST;
+  limit->refilled = seconds;
+  if (limit->tokens < 1) {
+    limit->suppressed++;
+    return false;
+  }
+  limit->tokens -= 1;
+  return true;
+}
+
+// format a message into the calling thread's ring, never blocks and takes no locks
+void log_write(int level, struct log_limit* limit, const char* format, ...) __attribute__((format(printf, 3, 4)));
+void log_write(int level, struct log_limit* limit, const char* format, ...) {
+  struct log_ring* ring = log_ring();
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == LOG_RING_RECORDS) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+  struct log_record* record = &ring->records[tail & (LOG_RING_RECORDS - 1)];
+  clock_gettime(CLOCK_REALTIME, &record->time);
+  record->level = level;
+  int length = 0;
+  if (limit->suppressed > 0) {
+    length = snprintf(record->message, LOG_MESSAGE_SIZE, "(%lu like this suppressed) ", limit->suppressed);
+    limit->suppressed = 0;
+  }
+  va_list arguments;
+  va_start(arguments, format);
+  vsnprintf(record->message + length, LOG_MESSAGE_SIZE - length, format, arguments);
+  va_end(arguments);
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+  // pairs with the fence in the logging thread, either it sees the record or we see it sleep
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&log_sleeping, memory_order_relaxed)) {
+    atomic_store_explicit(&log_sleeping, 0, memory_order_relaxed);
+    syscall(SYS_futex, &log_sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+// log at a level, rate limited per call site, nothing at all is left when level is
+// below LOG_LEVEL
+#define log_at(level, ...) do {\
+  if ((level) >= LOG_LEVEL) {\
+    static __thread struct log_limit log_limit_ = { 0, 0, 0 };\
+    if (log_allow(&log_limit_))\
+      log_write((level), &log_limit_, __VA_ARGS__);\
+  }\
+} while (0)
+
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// the names the levels are printed with
+static const char* log_level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+// how long the logging thread lets records pile up before writing them out
+#define LOG_BATCH_NANOSECONDS 10000000
+
+// move every record in every ring to out, returning how many there were
+size_t log_drain(FILE* out) {
+  size_t drained = 0;
+  struct log_ring* ring;
+  for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next) {
+    uint64_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if (dropped > 0)
+      fprintf(out, "WARN [thread %u] dropped %lu log messages\n", ring->thread, dropped);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    for (; head != tail; head++) {
+      struct log_record* record = &ring->records[head & (LOG_RING_RECORDS - 1)];
+      struct tm time;
+      gmtime_r(&record->time.tv_sec, &time);
+      fprintf
+        ( out, "%04d-%02d-%02dT%02d:%02d:%02d.%06ldZ %s [thread %u] %s\n"
+        , time.tm_year + 1900, time.tm_mon + 1, time.tm_mday, time.tm_hour, time.tm_min, time.tm_sec
+        , record->time.tv_nsec / 1000, log_level_names[record->level], ring->thread, record->message);
+      drained++;
+    }
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+  }
+  return drained;
+}
+
+// the logging thread, the only one which ever writes log messages out
+void* run_logger(void* argument) {
+  FILE* out = (FILE*) argument;
+  // we are the only thread writing to it, so its lock is never contended
+  static char buffer[1 << 16];
+  setvbuf(out, buffer, _IOFBF, sizeof(buffer));
+  while (true) {
+    if (log_drain(out) > 0) {
+      fflush(out);
+      struct timespec batch = { 0, LOG_BATCH_NANOSECONDS };
+      nanosleep(&batch, NULL);
+      continue;
+    }
+    // nothing was logged, sleep until someone logs rather than polling
+    atomic_store_explicit(&log_sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (log_drain(out) > 0) {
+      atomic_store_explicit(&log_sleeping, 0, memory_order_relaxed);
+      fflush(out);
+      continue;
+    }
+    syscall(SYS_futex, &log_sleeping, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+  }
+  return NULL;
+}
+
+// start the logging thread, writing to stderr
+void start_logger(void) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, run_logger, stderr) != 0)
+    panic("failed to start logging thread")
+  pthread_detach(thread);
+}
+
+// the longest log_flush waits for the logging thread, in milliseconds
+#define LOG_FLUSH_MILLISECONDS 100
+
+// give the logging thread a moment to take everything logged so far, before we exit
+void log_flush(void) {
+  int waited;
+  for (waited = 0; waited < LOG_FLUSH_MILLISECONDS; waited++) {
+    bool empty = true;
+    struct log_ring* ring;
+    for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next)
+      if (atomic_load(&ring->head) != atomic_load(&ring->tail))
+        empty = false;
+    if (empty)
+      break;
+    struct timespec millisecond = { 0, 1000000 };
+    nanosleep(&millisecond, NULL);
+  }
+  // the logging thread writes out what it took before it looks for more
+  struct timespec batch = { 0, LOG_BATCH_NANOSECONDS * 2 };
+  nanosleep(&batch, NULL);
+}
+
+// the address of a peer, of whichever family it connected over
+union peer_address {
+  struct sockaddr any;
+  struct sockaddr_in ipv4;
+  struct sockaddr_in6 ipv6;
+};
+
 // essential information about a client
 struct client {
   int socket;
   // socket the client is connected to
-  struct sockaddr_in address;
+  union peer_address address;
   // address the client connected from
+  bool tls;
+  // whether it connected to a tls listener, and we terminate TLS for it
+  uint64_t accepted_at;
+  // the trace_clock when it was accepted, 0 when not tracing
 };
 
+struct buffer_pool;
+
 // a buffer/client pair
 struct client_buffer {  
   // a buffer containing all of the we've read from a client
   char* buffer;
   // the size of the allocated buffer
   int size;
-  // the number of bytes read into the buffer so far
+  // the number of bytes read into the buffer so far, the end of the unconsumed bytes
   int bytes_read;
+  // the number of bytes at the front of the buffer the handler is done with
+  int consumed;
+  // the high-water mark, we stop reading the client once this many bytes are unconsumed
+  int limit;
+  // whether we were told the client hung up, after which a short read proves nothing
+  bool hung_up;
   // the client we are reading from
   struct client client;
-};
-
-struct client_buffer_reference {
-  // client buffer
-  struct client_buffer* client_buffer;
-  // lock
-  sem_t* lock;
+  // the pool the buffer came from, NULL if it came from make_client_buffer
+  struct buffer_pool* pool;
+  // the pool size class of buffer, -1 if it is too large for one and was malloced
+  int size_class;
 };
 
 struct client_buffer* make_client_buffer
@@ -76,152 +372,6066 @@ struct client_buffer* make_client_buffer
   client_buffer->buffer = (char *) malloc(sizeof(char) * initial_size);
   client_buffer->size = initial_size;
   client_buffer->bytes_read = 0;
+  client_buffer->consumed = 0;
+  client_buffer->limit = INT_MAX;
+  client_buffer->hung_up = false;
   client_buffer->client = client;
+  client_buffer->pool = NULL;
+  client_buffer->size_class = -1;
   return client_buffer;
 }
 
-// caller must completely own this buffer, and have locked it
-int read_available(struct client_buffer* client_buffer) {
-  int available;
-  // how many bytes are available on the socket?
-  ioctl(client_buffer->client.socket, FIONREAD, &available);
-  if (available > 0) {
-    // make sure we have enough room
-    if (client_buffer->size - client_buffer->bytes_read > available) {
-      // resize buffer if necessary
-      client_buffer->buffer = realloc(client_buffer->buffer, 2 * client_buffer->size);
+// release a client_buffer made by make_client_buffer
+void free_client_buffer(struct client_buffer* client_buffer) {
+  free(client_buffer->buffer);
+  free(client_buffer);
+}
+
+// the number of power-of-two size classes a buffer_pool hands storage out in
+#define BUFFER_CLASSES 4
+
+// 1K, 4K, 16K and 64K
+static const int buffer_class_sizes[BUFFER_CLASSES] = { 1 << 10, 1 << 12, 1 << 14, 1 << 16 };
+
+// the amount of memory a buffer_pool carves objects out of at a time
+#define SLAB_SIZE (1 << 18)
+
+// the amount of memory a buffer_pool maps at a time and cuts slabs from, a huge page
+#define ARENA_SIZE (1 << 21)
+
+// an object sitting on one of the free lists of a buffer_pool
+struct pool_link {
+  // the next free object of the same kind
+  struct pool_link* next;
+};
+
+// per-worker allocator of client_buffers and their storage, never shared between threads
+// so it takes no locks, and never gives memory back so steady state churn never mallocs
+struct buffer_pool {
+  // free storage blocks of each size class
+  struct pool_link* free_blocks[BUFFER_CLASSES];
+  // free client_buffer structs
+  struct pool_link* free_client_buffers;
+  // the arena slabs are cut from, NULL until the first slab
+  char* arena;
+  // the number of bytes of the arena cut into slabs
+  size_t arena_used;
+  // whether arenas are mapped in huge pages, from the reserved hugetlbfs pages while
+  // there are any and as transparent huge pages once there are not
+  bool huge_pages;
+  bool hugetlb;
+  // the NUMA node arenas are placed on, that of the CPU the worker is pinned to, -1 to
+  // leave it to the kernel
+  int node;
+};
+
+// make a new, empty buffer_pool
+void initialize_buffer_pool(struct buffer_pool* pool, bool huge_pages) {
+  int i;
+  for (i = 0; i < BUFFER_CLASSES; i++)
+    pool->free_blocks[i] = NULL;
+  pool->free_client_buffers = NULL;
+  pool->arena = NULL;
+  pool->arena_used = 0;
+  pool->huge_pages = huge_pages;
+  pool->hugetlb = huge_pages;
+  pool->node = -1;
+}
+
+// the smallest size class holding size bytes, -1 if none does
+int buffer_class(int size) {
+  int i;
+  for (i = 0; i < BUFFER_CLASSES; i++)
+    if (size <= buffer_class_sizes[i])
+      return i;
+  return -1;
+}
+
+// map a new arena for the pool, before anything touches it so its pages come from the
+// pool's node and, where the kernel has them, are huge
+void map_arena(struct buffer_pool* pool) {
+  int protection = PROT_READ | PROT_WRITE;
+  char* arena = MAP_FAILED;
+  if (pool->hugetlb) {
+    arena = mmap(NULL, ARENA_SIZE, protection, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    // none are reserved, or they ran out, either way we stop asking
+    if (arena == MAP_FAILED)
+      pool->hugetlb = false;
+  }
+  if (arena == MAP_FAILED) {
+    // a transparent huge page has to start on a huge page boundary, so map enough to find
+    // one and unmap what lies either side of it
+    char* mapped = mmap(NULL, 2 * ARENA_SIZE, protection, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED)
+      panic("failed to map arena")
+    arena = (char*) (((uintptr_t) mapped + ARENA_SIZE - 1) & ~((uintptr_t) ARENA_SIZE - 1));
+    if (arena > mapped)
+      munmap(mapped, arena - mapped);
+    munmap(arena + ARENA_SIZE, mapped + ARENA_SIZE - arena);
+    // only a hint, without THP the arena is just ordinary pages
+    if (pool->huge_pages)
+      madvise(arena, ARENA_SIZE, MADV_HUGEPAGE);
+  }
+  // preferred rather than bound, a full node takes memory from another rather than failing
+  if (pool->node >= 0 && pool->node < (int) (sizeof(unsigned long) * CHAR_BIT)) {
+    unsigned long nodes = 1ul << pool->node;
+    if (syscall(SYS_mbind, arena, ARENA_SIZE, MPOL_PREFERRED, &nodes, sizeof(nodes) * CHAR_BIT, 0) == -1) {
+      log_warn("failed to place buffers on NUMA node %d: %s", pool->node, strerror(errno));
+      pool->node = -1;
     }
-    int length = read(client_buffer->client.socket, client_buffer->buffer + client_buffer->bytes_read, available);
-    if (length != available)
-      panic("reading available bytes")
-    return available;
   }
-  return 0;
+  pool->arena = arena;
+  pool->arena_used = 0;
 }
 
-// a configuration for the server
-struct config {
-  // address the server will live on
-  struct sockaddr_in address;
-  // maximum number of connections allowed to be pending for the server's socket
-  unsigned short connection_backlog;
-  // number of worker threads you want to be onliny
-  unsigned int nworkers;
-  // maximum number of requests we process simultaneously
-  unsigned int  nrequests;
-};
+// carve a new slab into objects of object_size and put them on free_list
+void carve_slab(struct buffer_pool* pool, struct pool_link** free_list, size_t object_size) {
+  if (pool->arena == NULL || pool->arena_used == ARENA_SIZE)
+    map_arena(pool);
+  char* slab = pool->arena + pool->arena_used;
+  pool->arena_used += SLAB_SIZE;
 
-// make a new config
-struct config make_config
-  ( // the port to bind to
-    uint16_t port
-    // the ip address to bind to
-  , long ip
-    // the number of connections to allow in the backlog of the socket
-  , short connection_backlog
-    // the number of workers which process requests
-  , short nworkers
-    // the maximum number of requests which we will process at once
-  , short nrequests
-  ) 
+  // keep objects on their own cache lines
+  object_size = (object_size + CACHE_LINE_SIZE - 1) & ~((size_t) CACHE_LINE_SIZE - 1);
+  size_t offset;
+  for (offset = 0; offset + object_size <= SLAB_SIZE; offset += object_size) {
+    struct pool_link* link = (struct pool_link*) (slab + offset);
+    link->next = *free_list;
+    *free_list = link;
+  }
+}
+
+// take an object off free_list, carving a new slab if it is empty
+void* pool_take(struct buffer_pool* pool, struct pool_link** free_list, size_t object_size) {
+  if (*free_list == NULL)
+    carve_slab(pool, free_list, object_size);
+  struct pool_link* link = *free_list;
+  *free_list = link->next;
+  return link;
+}
+
+// put an object back on free_list
+void pool_give(struct pool_link** free_list, void* object) {
+  struct pool_link* link = (struct pool_link*) object;
+  link->next = *free_list;
+  *free_list = link;
+}
+
+// storage for at least size bytes, from the pool if it has a class that large
+char* pool_acquire_storage(struct buffer_pool* pool, int size, int* size_class) {
+  *size_class = buffer_class(size);
+  if (*size_class == -1) {
+    char* storage = (char*) malloc(size);
+    if (storage == NULL)
+      panic("failed to allocate buffer storage")
+    return storage;
+  }
+  return (char*) pool_take(pool, &pool->free_blocks[*size_class], buffer_class_sizes[*size_class]);
+}
+
+// return storage obtained from pool_acquire_storage
+void pool_release_storage(struct buffer_pool* pool, char* storage, int size_class) {
+  if (size_class == -1)
+    free(storage);
+  else
+    pool_give(&pool->free_blocks[size_class], storage);
+}
+
+// the pooled analogue of make_client_buffer, initial_size is rounded up to its size class
+struct client_buffer* pool_acquire_client_buffer
+  ( // the pool of the worker which will own the client_buffer
+    struct buffer_pool* pool
+    // the client to read from
+  , struct client client
+    // the initial size of the buffer
+  , int initial_size
+  )
 {
-  struct config config;
-  config.address.sin_family = AF_INET;
-  config.address.sin_port = htons(port);
-  config.address.sin_addr.s_addr = htonl(ip);
-  config.connection_backlog = connection_backlog;
-  config.nworkers = nworkers;
-  config.nrequests = nrequests;
-  return config;
+  if (initial_size < 0)
+    panic("initial_size of client_buffer less than 0")
+  struct client_buffer* client_buffer = (struct client_buffer*)
+    pool_take(pool, &pool->free_client_buffers, sizeof(struct client_buffer));
+  client_buffer->buffer = pool_acquire_storage(pool, initial_size, &client_buffer->size_class);
+  client_buffer->size = client_buffer->size_class == -1
+    ? initial_size
+    : buffer_class_sizes[client_buffer->size_class];
+  client_buffer->bytes_read = 0;
+  client_buffer->consumed = 0;
+  client_buffer->limit = INT_MAX;
+  client_buffer->hung_up = false;
+  client_buffer->client = client;
+  client_buffer->pool = pool;
+  return client_buffer;
+}
+
+// recycle a client_buffer from pool_acquire_client_buffer once its connection is closed
+void pool_release_client_buffer(struct client_buffer* client_buffer) {
+  struct buffer_pool* pool = client_buffer->pool;
+  pool_release_storage(pool, client_buffer->buffer, client_buffer->size_class);
+  pool_give(&pool->free_client_buffers, client_buffer);
+}
+
+// slide the unconsumed bytes of a client_buffer to the front of its storage
+void compact_client_buffer(struct client_buffer* client_buffer) {
+  int pending = client_buffer->bytes_read - client_buffer->consumed;
+  memmove(client_buffer->buffer, client_buffer->buffer + client_buffer->consumed, pending);
+  client_buffer->consumed = 0;
+  client_buffer->bytes_read = pending;
+}
+
+// move the unconsumed contents of a client_buffer into storage of at least size bytes
+void resize_client_buffer(struct client_buffer* client_buffer, int size) {
+  // unpooled buffers keep using the heap
+  if (client_buffer->pool == NULL) {
+    compact_client_buffer(client_buffer);
+    char* buffer = (char*) realloc(client_buffer->buffer, size);
+    if (buffer == NULL)
+      panic("failed to grow buffer")
+    client_buffer->buffer = buffer;
+    client_buffer->size = size;
+    return;
+  }
+  int size_class;
+  int pending = client_buffer->bytes_read - client_buffer->consumed;
+  char* buffer = pool_acquire_storage(client_buffer->pool, size, &size_class);
+  // only the unconsumed bytes come along, so moving compacts for free
+  memcpy(buffer, client_buffer->buffer + client_buffer->consumed, pending);
+  pool_release_storage(client_buffer->pool, client_buffer->buffer, client_buffer->size_class);
+  client_buffer->buffer = buffer;
+  client_buffer->size = size_class == -1 ? size : buffer_class_sizes[size_class];
+  client_buffer->size_class = size_class;
+  client_buffer->consumed = 0;
+  client_buffer->bytes_read = pending;
+}
+
+// make room for wanted more bytes at the end of a client_buffer, returning how many
+// bytes may now be written at buffer + bytes_read, which is less once we near the limit
+int reserve_client_buffer(struct client_buffer* client_buffer, int wanted) {
+  int pending = client_buffer->bytes_read - client_buffer->consumed;
+  int allowed = client_buffer->limit - pending;
+  if (allowed <= 0)
+    return 0;
+  if (wanted > allowed)
+    wanted = allowed;
+  if (client_buffer->size - client_buffer->bytes_read < wanted) {
+    int needed = pending + wanted;
+    // compacting moves no more bytes than were consumed since the last compaction,
+    // and growth at least doubles, so both are amortized constant time per byte
+    if (needed <= client_buffer->size
+        && (client_buffer->consumed >= pending || client_buffer->size >= client_buffer->limit)) {
+      compact_client_buffer(client_buffer);
+    } else {
+      int size = client_buffer->size > 0 ? client_buffer->size : 1;
+      do
+        size = size > INT_MAX / 2 ? INT_MAX : size * 2;
+      while (size < needed);
+      if (size > client_buffer->limit)
+        size = client_buffer->limit;
+      resize_client_buffer(client_buffer, size);
+    }
+  }
+  int room = client_buffer->size - client_buffer->bytes_read;
+  return room < allowed ? room : allowed;
+}
+
+// the first unconsumed byte of a client_buffer
+char* client_buffer_data(struct client_buffer* client_buffer) {
+  return client_buffer->buffer + client_buffer->consumed;
+}
+
+// the number of bytes read from the client but not yet consumed
+int client_buffer_pending(struct client_buffer* client_buffer) {
+  return client_buffer->bytes_read - client_buffer->consumed;
+}
+
+// mark the first count unconsumed bytes as handled
+void consume_client_buffer(struct client_buffer* client_buffer, int count) {
+  if (count < 0 || count > client_buffer_pending(client_buffer))
+    panic("consuming more than was read")
+  client_buffer->consumed += count;
+  // an empty buffer compacts for free
+  if (client_buffer->consumed == client_buffer->bytes_read) {
+    client_buffer->consumed = 0;
+    client_buffer->bytes_read = 0;
+  }
+}
+
+// how the bytes a client sends are cut into messages before the handler sees them
+enum framing {
+  // not at all, the handler gets on_data and finds its own messages
+  FRAMING_NONE,
+  // each message is a 32 bit big endian length followed by that many bytes
+  FRAMING_LENGTH_PREFIXED,
+  // each message ends in a newline, which is not part of it, nor is a carriage return before it
+  FRAMING_LINES
 };
 
-// handle to a servant
-struct server {
-  // the socket the server is listening on
-  int socket;
-  // the configuration of the server
-  struct config config;
-  // the array of config.nrequests client_buffer_references
-  struct client_buffer_reference* client_buffer_references;
+// a complete message, pointing into the client_buffer it arrived in
+struct frame {
+  // the first byte of the message, past any length prefix
+  const char* data;
+  // the number of bytes in the message, without its prefix or delimiter
+  int length;
 };
 
-// make a new server
-struct server initialize_server
-  ( // the configuration of the server
-    struct config config
-  ) 
+// what frame_next found
+enum frame_status {
+  // a complete frame
+  FRAME_READY,
+  // the start of a frame whose end has not arrived yet
+  FRAME_PARTIAL,
+  // the start of a frame which could never fit in the buffer
+  FRAME_TOO_LONG
+};
+
+// the size of a length prefix
+#define FRAME_PREFIX_SIZE 4
+
+// the first newline in length bytes of data, NULL if there is none, by memchr, which the
+// scanners below also finish the bytes they leave over with
+const char* scan_newline_bytes(const char* data, size_t length) {
+  return (const char*) memchr(data, '\n', length);
+}
+
+#if defined(__x86_64__)
+// scan_newline_bytes, 16 bytes at a time, and 64 at a time through long runs, every
+// x86-64 has SSE2
+const char* scan_newline_sse2(const char* data, size_t length) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 64 <= length; i += 64) {
+    __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (data + i)), newline);
+    __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (data + i + 16)), newline);
+    __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (data + i + 32)), newline);
+    __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (data + i + 48)), newline);
+    // one test for all four, the loop below finds which one it was
+    if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d))) != 0)
+      break;
+  }
+  for (; i + 16 <= length; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*) (data + i));
+    unsigned int matches = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+    if (matches != 0)
+      return data + i + __builtin_ctz(matches);
+  }
+  return scan_newline_bytes(data + i, length - i);
+}
+
+// scan_newline_bytes, 32 bytes at a time, and 128 at a time through long runs
+__attribute__((target("avx2")))
+const char* scan_newline_avx2(const char* data, size_t length) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 128 <= length; i += 128) {
+    __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + i)), newline);
+    __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + i + 32)), newline);
+    __m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + i + 64)), newline);
+    __m256i d = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + i + 96)), newline);
+    // one test for all four, the loop below finds which one it was
+    if (!_mm256_testz_si256(_mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d)), _mm256_set1_epi8(-1)))
+      break;
+  }
+  for (; i + 32 <= length; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*) (data + i));
+    unsigned int matches = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+    if (matches != 0)
+      return data + i + __builtin_ctz(matches);
+  }
+  return scan_newline_sse2(data + i, length - i);
+}
+#elif defined(__aarch64__)
+// scan_newline_bytes, 16 bytes at a time, every AArch64 has NEON
+const char* scan_newline_neon(const char* data, size_t length) {
+  const uint8x16_t newline = vdupq_n_u8('\n');
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    uint8x16_t equal = vceqq_u8(vld1q_u8((const uint8_t*) (data + i)), newline);
+    // narrowing leaves four bits per byte, there being no movemask
+    uint64_t matches = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(equal), 4)), 0);
+    if (matches != 0)
+      return data + i + (__builtin_ctzll(matches) >> 2);
+  }
+  return scan_newline_bytes(data + i, length - i);
+}
+#endif
+
+// the fastest newline scanner this CPU has, set by select_newline_scanner. glibc's memchr
+// is vectorized already and measures as fast as ours or faster at every line length, so
+// ours only stand in for a memchr that is not
+static const char* (*scan_newline)(const char* data, size_t length) =
+#if defined(__GLIBC__)
+  scan_newline_bytes;
+#elif defined(__x86_64__)
+  scan_newline_sse2;
+#elif defined(__aarch64__)
+  scan_newline_neon;
+#else
+  scan_newline_bytes;
+#endif
+
+// pick scan_newline by what the CPU supports, once, before any worker runs
+void select_newline_scanner(void) {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+#if !defined(__GLIBC__)
+  if (__builtin_cpu_supports("avx2"))
+    scan_newline = scan_newline_avx2;
+#endif
+#endif
+}
+
+// look for a complete frame at the start of length bytes of data, setting frame to it and
+// size to the bytes it spans, prefix and delimiter included. scanned is how many bytes of
+// data are already known not to end a frame, and is kept up to date so a frame that arrives
+// in pieces is never scanned twice
+enum frame_status frame_next
+  ( // how the frames are delimited
+    enum framing framing
+    // the unconsumed bytes
+  , const char* data
+    // how many there are
+  , int length
+    // the most bytes a frame may span
+  , int limit
+    // how far into data we already looked
+  , int* scanned
+    // set to the frame found
+  , struct frame* frame
+    // set to the number of bytes the frame spans
+  , int* size
+  )
 {
-  struct server server;
-  server.config = config;
+  if (framing == FRAMING_LENGTH_PREFIXED) {
+    if (length < FRAME_PREFIX_SIZE)
+      return FRAME_PARTIAL;
+    const unsigned char* prefix = (const unsigned char*) data;
+    uint32_t body = (uint32_t) prefix[0] << 24 | (uint32_t) prefix[1] << 16 | (uint32_t) prefix[2] << 8 | prefix[3];
+    if (body > (uint32_t) (limit - FRAME_PREFIX_SIZE))
+      return FRAME_TOO_LONG;
+    if (length - FRAME_PREFIX_SIZE < (int) body)
+      return FRAME_PARTIAL;
+    frame->data = data + FRAME_PREFIX_SIZE;
+    frame->length = (int) body;
+    *size = FRAME_PREFIX_SIZE + (int) body;
+    return FRAME_READY;
+  }
 
-  // create a new TCP socket
-  if ((server.socket = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-    panic("failed to create socket")
+  const char* newline = scan_newline(data + *scanned, length - *scanned);
+  if (newline == NULL) {
+    *scanned = length;
+    return length >= limit ? FRAME_TOO_LONG : FRAME_PARTIAL;
+  }
+  *scanned = 0;
+  frame->data = data;
+  frame->length = (int) (newline - data);
+  if (frame->length > 0 && newline[-1] == '\r')
+    frame->length--;
+  *size = (int) (newline - data) + 1;
+  return FRAME_READY;
+}
 
-  // bind the TCP socket to the IP address and port specified in the config
-  if (bind(server.socket, (struct sockaddr *) &server.config.address, sizeof(server.config.address)) == -1)
-    panic("failed to bind socket")
+// why read_available stopped reading
+enum read_status {
+  // the socket has nothing more for us right now
+  READ_DRAINED,
+  // we read our budget for this wakeup, the socket may have more
+  READ_BUDGET,
+  // the buffer holds limit unconsumed bytes, the socket may have more
+  READ_FULL,
+  // the client hung up
+  READ_CLOSED,
+  // the socket failed, errno says why
+  READ_ERROR
+};
 
-  // put the TCP socket into a passive state, accepting peer connections
-  if (listen(server.socket, config.connection_backlog) == -1)
-    panic("failed to listen on socket")
+// the most bytes a single read may take beyond the free space of a client_buffer
+#define READ_SPILL_SIZE (1 << 16)
+
+// caller must completely own this buffer. reads into the free space of the buffer until
+// the socket would block, the buffer is full, or budget bytes were read, setting count
+// to the number of bytes appended
+enum read_status read_available
+  ( // the buffer to append to
+    struct client_buffer* client_buffer
+    // the most bytes to read before giving other clients their turn
+  , int budget
+    // set to the number of bytes read
+  , int* count
+  )
+{
+  // whatever does not fit in the free space lands here, so we only grow once data arrived
+  char spill[READ_SPILL_SIZE];
+  *count = 0;
+  while (*count < budget) {
+    int wanted = budget - *count;
+    int room = reserve_client_buffer(client_buffer, 1);
+    if (room == 0)
+      return READ_FULL;
+    int allowed = client_buffer->limit - client_buffer_pending(client_buffer);
+    if (wanted > allowed)
+      wanted = allowed;
 
-  server.client_buffer_references =
-    (struct client_buffer_reference*) malloc(sizeof(struct client_buffer_reference) * config.nrequests);
+    struct iovec iov[2];
+    iov[0].iov_base = client_buffer->buffer + client_buffer->bytes_read;
+    iov[0].iov_len = room < wanted ? room : wanted;
+    iov[1].iov_base = spill;
+    iov[1].iov_len = wanted - (int) iov[0].iov_len;
+    if (iov[1].iov_len > READ_SPILL_SIZE)
+      iov[1].iov_len = READ_SPILL_SIZE;
+    int requested = (int) (iov[0].iov_len + iov[1].iov_len);
 
-  return server;
+    ssize_t length = readv(client_buffer->client.socket, iov, iov[1].iov_len > 0 ? 2 : 1);
+    if (length == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return READ_DRAINED;
+      return READ_ERROR;
+    }
+    if (length == 0)
+      return READ_CLOSED;
+
+    if (length <= (ssize_t) iov[0].iov_len) {
+      client_buffer->bytes_read += length;
+    } else {
+      client_buffer->bytes_read += iov[0].iov_len;
+      // allowed bounded the spill, so there is room for it once we grow
+      int spilled = (int) (length - iov[0].iov_len);
+      reserve_client_buffer(client_buffer, spilled);
+      memcpy(client_buffer->buffer + client_buffer->bytes_read, spill, spilled);
+      client_buffer->bytes_read += spilled;
+    }
+    *count += length;
+    // a short read means the socket queue is empty, no need to hear EAGAIN to believe it,
+    // unless the end of the stream is waiting behind the data
+    if (length < requested && !client_buffer->hung_up)
+      return READ_DRAINED;
+  }
+  return READ_BUDGET;
 }
 
-// running a server
-void run_server
-  ( // client_buffer_reference consumer
-    void (*handle_client)(struct client_buffer_reference client_buffer_reference),
-    // server handle
-    struct server server
+// the most plaintext a TLS record carries
+#define TLS_RECORD_SIZE (1 << 14)
+
+// read_available for a client whose TLS we decrypt ourselves, through tls rather than
+// from the socket, a record's worth at a time
+enum read_status tls_read_available
+  ( // the buffer to append to
+    struct client_buffer* client_buffer
+    // the client's TLS session
+  , SSL* tls
+    // the most bytes to read before giving other clients their turn
+  , int budget
+    // set to the number of bytes read
+  , int* count
   )
 {
-  // loop, forever for connections and adding them to the queue
+  *count = 0;
+  while (*count < budget) {
+    int room = reserve_client_buffer(client_buffer, TLS_RECORD_SIZE);
+    if (room == 0)
+      return READ_FULL;
+    if (room > budget - *count)
+      room = budget - *count;
+    size_t length;
+    ERR_clear_error();
+    if (SSL_read_ex(tls, client_buffer->buffer + client_buffer->bytes_read, room, &length) == 1) {
+      client_buffer->bytes_read += (int) length;
+      *count += (int) length;
+      continue;
+    }
+    switch (SSL_get_error(tls, 0)) {
+      // the socket is empty, and nothing is left over in tls either, so an edge comes
+      case SSL_ERROR_WANT_READ:
+      case SSL_ERROR_WANT_WRITE:
+        return READ_DRAINED;
+      case SSL_ERROR_ZERO_RETURN:
+        return READ_CLOSED;
+      case SSL_ERROR_SYSCALL:
+        if (errno == EINTR)
+          continue;
+        return READ_ERROR;
+      default:
+        errno = EPROTO;
+        return READ_ERROR;
+    }
+  }
+  return READ_BUDGET;
+}
+
+// the most pieces of a write queue we hand to a single writev
+#define WRITE_IOVECS 64
+
+// a piece of a response waiting for the socket to take it
+struct write_entry {
+  // the unwritten bytes, when sending from memory
+  const char* data;
+  // the number of bytes left to write
+  size_t length;
+  // the file to send from, -1 when sending from memory
+  int file;
+  // where in file the unwritten bytes start
+  off_t offset;
+  // whether file is a pipe or socket we splice from, rather than a file we sendfile from
+  bool splice;
+  // pool storage we copied data into and give back once it is written, or NULL
+  char* block;
+  // the pool size class of block
+  int size_class;
+  // called once the entry is written or dropped, for memory and files we were lent
+  void (*release)(void* argument);
+  // handed to release
+  void* argument;
+  // whether some of data went out with MSG_ZEROCOPY, so the kernel may still be reading it
+  bool pinned;
+  // the last send with MSG_ZEROCOPY which took any of data
+  uint32_t zerocopy_send;
+};
+
+// the responses of one connection, in the order they go out
+struct write_queue {
+  // a ring of pending entries, NULL until the first write
+  struct write_entry* entries;
+  // the number of entries the ring has room for, a power of two
+  unsigned int capacity;
+  // the index of the oldest entry
+  unsigned int head;
+  // the number of entries in the ring
+  unsigned int count;
+  // the pool size class of the storage behind entries
+  int size_class;
+  // the number of bytes waiting to be written
+  size_t bytes;
+};
+
+// what a socket sending large entries with MSG_ZEROCOPY owes us: the kernel reads them
+// straight from our memory until it says on the socket's error queue that it is done, so
+// their storage cannot go back to the pool before then
+struct zerocopy {
+  // the smallest memory entry worth pinning rather than copying, 0 to always copy
+  size_t threshold;
+  // entries written in full which the kernel may still be reading, oldest first
+  struct write_queue pinned;
+  // the number of sends with MSG_ZEROCOPY the socket took, the kernel numbers them from 0
+  uint32_t sent;
+  // the number of them the kernel is done with
+  uint32_t completed;
+};
+
+// an empty write_queue, which takes no memory until it is written to
+void initialize_write_queue(struct write_queue* queue) {
+  queue->entries = NULL;
+  queue->capacity = 0;
+  queue->head = 0;
+  queue->count = 0;
+  queue->size_class = -1;
+  queue->bytes = 0;
+}
+
+// the newest entry of a non-empty write_queue
+struct write_entry* write_queue_tail(struct write_queue* queue) {
+  return &queue->entries[(queue->head + queue->count - 1) & (queue->capacity - 1)];
+}
+
+// make room for one more entry, growing the ring from pool if it is full
+void write_queue_reserve(struct write_queue* queue, struct buffer_pool* pool) {
+  if (queue->count == queue->capacity) {
+    unsigned int capacity = queue->capacity == 0 ? 16 : queue->capacity * 2;
+    int size_class;
+    struct write_entry* entries = (struct write_entry*)
+      pool_acquire_storage(pool, capacity * sizeof(struct write_entry), &size_class);
+    // unroll the ring so the oldest entry is first again
+    unsigned int i;
+    for (i = 0; i < queue->count; i++)
+      entries[i] = queue->entries[(queue->head + i) & (queue->capacity - 1)];
+    if (queue->entries != NULL)
+      pool_release_storage(pool, (char*) queue->entries, queue->size_class);
+    queue->entries = entries;
+    queue->capacity = capacity;
+    queue->size_class = size_class;
+    queue->head = 0;
+  }
+}
+
+// a blank entry
+void initialize_write_entry(struct write_entry* entry) {
+  entry->data = NULL;
+  entry->length = 0;
+  entry->file = -1;
+  entry->offset = 0;
+  entry->splice = false;
+  entry->block = NULL;
+  entry->size_class = -1;
+  entry->release = NULL;
+  entry->argument = NULL;
+  entry->pinned = false;
+  entry->zerocopy_send = 0;
+}
+
+// a blank entry at the back of the queue, growing it from pool if it is full
+struct write_entry* write_queue_push(struct write_queue* queue, struct buffer_pool* pool) {
+  write_queue_reserve(queue, pool);
+  queue->count++;
+  struct write_entry* entry = write_queue_tail(queue);
+  initialize_write_entry(entry);
+  return entry;
+}
+
+// a blank entry at the front of the queue, to go out before everything else
+struct write_entry* write_queue_push_front(struct write_queue* queue, struct buffer_pool* pool) {
+  write_queue_reserve(queue, pool);
+  queue->head = (queue->head - 1) & (queue->capacity - 1);
+  queue->count++;
+  struct write_entry* entry = &queue->entries[queue->head];
+  initialize_write_entry(entry);
+  return entry;
+}
+
+// retire the oldest entry, whether or not it was written
+void write_queue_pop(struct write_queue* queue, struct buffer_pool* pool) {
+  struct write_entry* entry = &queue->entries[queue->head];
+  queue->bytes -= entry->length;
+  if (entry->block != NULL)
+    pool_release_storage(pool, entry->block, entry->size_class);
+  if (entry->release != NULL)
+    entry->release(entry->argument);
+  queue->head = (queue->head + 1) & (queue->capacity - 1);
+  queue->count--;
+}
+
+// drop everything in the queue and give its storage back to the pool
+void clear_write_queue(struct write_queue* queue, struct buffer_pool* pool) {
+  while (queue->count > 0)
+    write_queue_pop(queue, pool);
+  if (queue->entries != NULL)
+    pool_release_storage(pool, (char*) queue->entries, queue->size_class);
+  initialize_write_queue(queue);
+}
+
+// nothing sent with MSG_ZEROCOPY yet, and nothing ever for a threshold of 0
+void initialize_zerocopy(struct zerocopy* zerocopy, size_t threshold) {
+  zerocopy->threshold = threshold;
+  initialize_write_queue(&zerocopy->pinned);
+  zerocopy->sent = 0;
+  zerocopy->completed = 0;
+}
+
+// move the oldest entry, written in full but maybe still being read by the kernel, over
+// to the pinned entries
+void write_queue_pin(struct write_queue* queue, struct buffer_pool* pool, struct zerocopy* zerocopy) {
+  *write_queue_push(&zerocopy->pinned, pool) = queue->entries[queue->head];
+  queue->head = (queue->head + 1) & (queue->capacity - 1);
+  queue->count--;
+}
+
+// hear back from the kernel about sends with MSG_ZEROCOPY on socket, and give back the
+// pinned entries it is done reading, returns how many of the sends it copied after all,
+// as it does when the device cannot gather from our pages, and always over loopback
+uint32_t reap_zerocopy(struct zerocopy* zerocopy, struct buffer_pool* pool, int socket) {
+  uint32_t copied = 0;
   while (true) {
-    int i;
-    for (i = 0; i < server.config.nrequests; i++) {
-      if ( sem_trywait(server.client_buffer_references[i].lock) == 0 ) {
-        socklen_t client_address_size = (socklen_t) sizeof(struct sockaddr_in);
-        struct client client;
-
-        // accept a peer connection
-        if ((client.socket = accept(server.socket, (struct sockaddr *) &client.address, &client_address_size)) == -1)
-          panic("failed to accept connection")
-        // handle the client requests
-        server.client_buffer_references[i].client_buffer = make_client_buffer(client, 1024);
-        sem_post(server.client_buffer_references[i].lock);
-      } else {
+    union {
+      char buffer[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+      struct cmsghdr align;
+    } control;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    if (recvmsg(socket, &message, MSG_ERRQUEUE) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    struct cmsghdr* header;
+    for (header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+      if (!(header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR)
+          && !(header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR))
         continue;
+      struct sock_extended_err error;
+      memcpy(&error, CMSG_DATA(header), sizeof(error));
+      if (error.ee_origin != SO_EE_ORIGIN_ZEROCOPY || error.ee_errno != 0)
+        continue;
+      // the kernel merges notifications, sends ee_info through ee_data are done
+      if ((int32_t) (error.ee_data + 1 - zerocopy->completed) > 0)
+        zerocopy->completed = error.ee_data + 1;
+      if (error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        copied += error.ee_data - error.ee_info + 1;
+    }
+  }
+  // TCP is done with sends in the order it made them, as the client acknowledges them
+  while (zerocopy->pinned.count > 0
+      && (int32_t) (zerocopy->pinned.entries[zerocopy->pinned.head].zerocopy_send - zerocopy->completed) < 0)
+    write_queue_pop(&zerocopy->pinned, pool);
+  return copied;
+}
+
+// account for written bytes having left the front of the queue, entries the kernel may
+// still be reading going over to zerocopy's pinned entries rather than back to the pool
+void write_queue_advance
+  ( struct write_queue* queue
+  , struct buffer_pool* pool
+  , struct zerocopy* zerocopy
+  , size_t written
+  )
+{
+  while (written > 0) {
+    struct write_entry* entry = &queue->entries[queue->head];
+    size_t taken = written < entry->length ? written : entry->length;
+    // sendfile moves the offset itself, and splice has none
+    if (entry->file == -1)
+      entry->data += taken;
+    entry->length -= taken;
+    queue->bytes -= taken;
+    written -= taken;
+    if (entry->length == 0 && entry->pinned)
+      write_queue_pin(queue, pool, zerocopy);
+    else if (entry->length == 0)
+      write_queue_pop(queue, pool);
+  }
+}
+
+// why flush_write_queue stopped writing
+enum write_status {
+  // everything queued was written
+  WRITE_DONE,
+  // the socket buffer is full, wait for it to become writable
+  WRITE_BLOCKED,
+  // the socket failed, errno says why
+  WRITE_ERROR
+};
+
+// write as much of the queue to socket as it will take, gathering runs of small memory
+// entries into a single writev, and sending the large ones on their own with MSG_ZEROCOPY
+enum write_status flush_write_queue
+  ( // the queue to write
+    struct write_queue* queue
+    // the pool its storage came from
+  , struct buffer_pool* pool
+    // the socket to write to
+  , int socket
+    // which entries to send with MSG_ZEROCOPY, and where to keep them once written
+  , struct zerocopy* zerocopy
+  )
+{
+  while (queue->count > 0) {
+    struct write_entry* entry = &queue->entries[queue->head];
+    ssize_t written;
+    if (entry->file != -1) {
+      written = entry->splice
+        ? splice(entry->file, NULL, socket, NULL, entry->length, SPLICE_F_NONBLOCK | SPLICE_F_MOVE)
+        : sendfile(socket, entry->file, &entry->offset, entry->length);
+      // the file was shorter than we were told, or the pipe closed early
+      if (written == 0) {
+        write_queue_pop(queue, pool);
+        continue;
+      }
+    } else if (zerocopy->threshold > 0 && entry->length >= zerocopy->threshold) {
+      // the kernel pins our pages rather than copying them, and numbers the send so it
+      // can tell us once it is done with them
+      written = send(socket, entry->data, entry->length, MSG_ZEROCOPY);
+      if (written > 0) {
+        entry->pinned = true;
+        entry->zerocopy_send = zerocopy->sent++;
+      } else if (written == -1 && errno == ENOBUFS) {
+        // past the memory the kernel lets a socket track pinned pages in, copy this once
+        written = send(socket, entry->data, entry->length, 0);
       }
+    } else {
+      struct iovec iov[WRITE_IOVECS];
+      int n = 0;
+      unsigned int i;
+      for (i = 0; i < queue->count && n < WRITE_IOVECS; i++) {
+        struct write_entry* next = &queue->entries[(queue->head + i) & (queue->capacity - 1)];
+        if (next->file != -1 || (zerocopy->threshold > 0 && next->length >= zerocopy->threshold))
+          break;
+        iov[n].iov_base = (void*) next->data;
+        iov[n].iov_len = next->length;
+        n++;
+      }
+      written = writev(socket, iov, n);
+    }
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      // a pipe we splice from having nothing yet also lands here, we retry once writable
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return WRITE_BLOCKED;
+      return WRITE_ERROR;
+    }
+    write_queue_advance(queue, pool, zerocopy, written);
+  }
+  return WRITE_DONE;
+}
+
+// read the next piece of the file or pipe at the front of the queue into pool storage,
+// as a memory entry ahead of it, or in its place once it is the last piece, for a socket
+// which can only be written through TLS we encrypt ourselves
+enum write_status stage_file_entry(struct write_queue* queue, struct buffer_pool* pool) {
+  struct write_entry* entry = &queue->entries[queue->head];
+  size_t wanted = entry->length < (size_t) buffer_class_sizes[BUFFER_CLASSES - 1]
+    ? entry->length : (size_t) buffer_class_sizes[BUFFER_CLASSES - 1];
+  int size_class;
+  char* block = pool_acquire_storage(pool, (int) wanted, &size_class);
+  ssize_t length;
+  do
+    length = entry->splice ? read(entry->file, block, wanted) : pread(entry->file, block, wanted, entry->offset);
+  while (length == -1 && errno == EINTR);
+  if (length <= 0) {
+    pool_release_storage(pool, block, size_class);
+    // the file was shorter than we were told, or the pipe closed early
+    if (length == 0) {
+      write_queue_pop(queue, pool);
+      return WRITE_DONE;
     }
+    // a pipe with nothing yet is retried once the socket is writable, as with splice
+    return errno == EAGAIN || errno == EWOULDBLOCK ? WRITE_BLOCKED : WRITE_ERROR;
+  }
+  entry->offset += length;
+  entry->length -= length;
+  if (entry->length == 0) {
+    // the file is done with, the memory entry takes over its place
+    if (entry->release != NULL)
+      entry->release(entry->argument);
+    entry->release = NULL;
+    entry->file = -1;
+  } else {
+    entry = write_queue_push_front(queue, pool);
   }
+  entry->block = block;
+  entry->size_class = size_class;
+  entry->data = block;
+  entry->length = length;
+  return WRITE_DONE;
 }
 
-// handling an individual client
-void handle_client(struct client_buffer_reference client_buffer_reference)
+// flush_write_queue for a client whose TLS we encrypt ourselves, through tls: a large
+// memory entry goes out as it is, runs of small ones are gathered into scratch so they
+// share records, and files are read into memory first
+enum write_status flush_tls_write_queue
+  ( // the queue to write
+    struct write_queue* queue
+    // the pool its storage came from
+  , struct buffer_pool* pool
+    // the client's TLS session
+  , SSL* tls
+    // TLS_RECORD_SIZE bytes to gather small entries into
+  , char* scratch
+  )
 {
-  sem_wait(client_buffer_reference.lock);
-  int read = 0;
-  while (read == 0) {
-    read += read_available(client_buffer_reference.client_buffer);
-    printf("\nReceived %d bytes\n", read);
+  while (queue->count > 0) {
+    struct write_entry* entry = &queue->entries[queue->head];
+    if (entry->file != -1) {
+      enum write_status status = stage_file_entry(queue, pool);
+      if (status != WRITE_DONE)
+        return status;
+      continue;
+    }
+    // a retry after the socket filled up must offer the bytes it offered before, which it
+    // does, as the front of the queue only ever grows until written
+    const char* data = entry->data;
+    size_t length = entry->length;
+    if (length < TLS_RECORD_SIZE) {
+      length = 0;
+      unsigned int i;
+      for (i = 0; i < queue->count && length < TLS_RECORD_SIZE; i++) {
+        struct write_entry* next = &queue->entries[(queue->head + i) & (queue->capacity - 1)];
+        if (next->file != -1)
+          break;
+        size_t taken = next->length < TLS_RECORD_SIZE - length ? next->length : TLS_RECORD_SIZE - length;
+        memcpy(scratch + length, next->data, taken);
+        length += taken;
+      }
+      data = scratch;
+    }
+    size_t written;
+    ERR_clear_error();
+    if (SSL_write_ex(tls, data, length, &written) != 1) {
+      switch (SSL_get_error(tls, 0)) {
+        case SSL_ERROR_WANT_WRITE:
+        case SSL_ERROR_WANT_READ:
+          return WRITE_BLOCKED;
+        case SSL_ERROR_SYSCALL:
+          if (errno == EINTR)
+            continue;
+          return WRITE_ERROR;
+        default:
+          errno = EPROTO;
+          return WRITE_ERROR;
+      }
+    }
+    // nothing we encrypt was sent zerocopy
+    write_queue_advance(queue, pool, NULL, written);
   }
-  fflush(stdout);
-  sem_post(client_buffer_reference.lock);
+  return WRITE_DONE;
 }
 
-int main() {
-  struct config config = make_config
-    ( 8080
+// the length of one tick of a timer_wheel, timeouts are rounded up to whole ticks
+#define TIMER_TICK_MILLISECONDS 10
+
+// each level of a timer_wheel covers this many more bits of the tick than the one below
+#define TIMER_LEVEL_BITS 6
+
+// the number of slots in each level of a timer_wheel
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+
+// the number of levels of a timer_wheel, timers further out than they reach go off early
+#define TIMER_LEVELS 4
+
+// the furthest out a timer can be armed, in ticks
+#define TIMER_HORIZON ((uint64_t) 1 << (TIMER_LEVEL_BITS * TIMER_LEVELS))
+
+// a timer, embedded in whatever it times
+struct timer {
+  // the next timer in the same slot
+  struct timer* next;
+  // the pointer pointing at us, so unlinking takes no search, NULL while not armed
+  struct timer** previous;
+  // the tick the timer goes off on
+  uint64_t expires;
+  // the slot of the timer_wheel we are in, level * TIMER_SLOTS + slot
+  unsigned int slot;
+};
+
+// hierarchical timing wheel: level 0 has a slot per tick for the next TIMER_SLOTS ticks,
+// each level above has a slot per TIMER_SLOTS slots of the level below, and a slot
+// cascades into the levels below once the ticks it covers come up, so arming and
+// cancelling never search and expiring costs one step per tick
+struct timer_wheel {
+  // the armed timers, by level and slot
+  struct timer* slots[TIMER_LEVELS][TIMER_SLOTS];
+  // a bit per non-empty slot, for each level
+  uint64_t occupied[TIMER_LEVELS];
+  // the tick being expired, everything earlier than it has gone off
+  uint64_t now;
+  // the CLOCK_MONOTONIC time of tick 0, in milliseconds
+  uint64_t start;
+};
+
+// milliseconds on CLOCK_MONOTONIC
+uint64_t monotonic_milliseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+// nanoseconds on CLOCK_MONOTONIC
+uint64_t monotonic_nanoseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+// USDT probes marking where each traced step starts and ends, for bpftrace and the like,
+// a single nop apiece until something attaches, wherever systemtap's sdt.h is there to
+// define them
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define trace_probe(name, socket) STAP_PROBE1(server, name, socket)
+#else
+#define trace_probe(name, socket) do { (void) (socket); } while (0)
+#endif
+
+// the steps of getting a request in and a response out that we time
+enum trace_kind {
+  // accepting a connection
+  TRACE_ACCEPT,
+  // a connection waiting in the handoff queue, from the acceptor accepting it to a worker
+  // taking it
+  TRACE_QUEUED,
+  // reading what a client sent
+  TRACE_READ,
+  // the handler dealing with what arrived
+  TRACE_HANDLER,
+  // writing what the handler queued
+  TRACE_WRITE
+};
+
+// the names the steps are exported with
+static const char* trace_kind_names[] = { "accept", "queued", "read", "handler", "write" };
+
+// the number of steps each thread's trace ring remembers, a power of two
+#define TRACE_RING_EVENTS 16384
+
+// one timed step
+struct trace_event {
+  // when it started, on the trace_clock
+  uint64_t start;
+  // how long it took, on the trace_clock
+  uint64_t duration;
+  // the client it was for
+  int socket;
+  // which step it was, a trace_kind
+  int kind;
+};
+
+// the steps a thread took most recently, which it overwrites oldest first, and which
+// anyone may copy out
+struct trace_ring {
+  // the steps
+  struct trace_event events[TRACE_RING_EVENTS];
+  // the next ring in the registry
+  struct trace_ring* next;
+  // the number the thread logs under
+  unsigned int thread;
+  // the number of steps ever written, the next goes at this modulo TRACE_RING_EVENTS
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t written;
+};
+
+// whether the hot path records what it does, only set before any thread but main runs
+static bool tracing = false;
+
+// every trace ring ever registered, rings live as long as the process
+static _Atomic(struct trace_ring*) trace_rings = NULL;
+
+// the calling thread's ring, NULL until it first records a step
+static __thread struct trace_ring* trace_thread_ring = NULL;
+
+// a reading of the trace_clock and CLOCK_MONOTONIC, taken as tracing started, which with
+// another pair taken on export converts one to the other
+static uint64_t trace_epoch_clock;
+static uint64_t trace_epoch_nanoseconds;
+
+// a clock costing tens of cycles rather than a call into the vDSO: the time stamp counter
+// on x86, which is invariant on anything we run on, or the generic timer on ARM
+static inline uint64_t trace_clock(void) {
+#if defined(__x86_64__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t ticks;
+  __asm__ volatile ("mrs %0, cntvct_el0" : "=r" (ticks));
+  return ticks;
+#else
+  return monotonic_nanoseconds();
+#endif
+}
+
+// start recording steps, before any thread but main runs
+void start_tracing(void) {
+  trace_epoch_clock = trace_clock();
+  trace_epoch_nanoseconds = monotonic_nanoseconds();
+  tracing = true;
+}
+
+// the calling thread's ring, registering a new one the first time around
+struct trace_ring* trace_ring(void) {
+  if (trace_thread_ring != NULL)
+    return trace_thread_ring;
+  struct trace_ring* ring = (struct trace_ring*) aligned_alloc(CACHE_LINE_SIZE, sizeof(struct trace_ring));
+  if (ring == NULL)
+    panic("failed to allocate trace ring")
+  // so the steps line up with what the thread logs
+  ring->thread = log_ring()->thread;
+  atomic_init(&ring->written, 0);
+  ring->next = atomic_load(&trace_rings);
+  while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring))
+    ;
+  trace_thread_ring = ring;
+  return ring;
+}
+
+// put a step in the calling thread's ring
+void trace_record(enum trace_kind kind, uint64_t start, uint64_t end, int socket) {
+  struct trace_ring* ring = trace_ring();
+  uint64_t written = atomic_load_explicit(&ring->written, memory_order_relaxed);
+  struct trace_event* event = &ring->events[written & (TRACE_RING_EVENTS - 1)];
+  event->start = start;
+  event->duration = end - start;
+  event->socket = socket;
+  event->kind = kind;
+  atomic_store_explicit(&ring->written, written + 1, memory_order_release);
+}
+
+// the start of a step, which without tracing costs a predicted branch and a nop
+#define trace_start(name, socket) \
+  ({ trace_probe(name##__start, socket); __builtin_expect(tracing, 0) ? trace_clock() : 0; })
+
+// the end of a step begun with trace_start
+#define trace_end(name, kind, start, socket) do {\
+  trace_probe(name##__done, socket);\
+  if (__builtin_expect(tracing, 0))\
+    trace_record((kind), (start), trace_clock(), (socket));\
+} while (0)
+
+// write every step the rings remember in the Chrome trace event format, which Perfetto
+// and chrome://tracing load: each thread's steps on a track of their own, and the waits
+// in the handoff queue, which overlap, as async slices of their own
+void write_trace(FILE* out) {
+  uint64_t clock = trace_clock();
+  uint64_t nanoseconds = monotonic_nanoseconds();
+  double nanoseconds_per_tick = clock > trace_epoch_clock
+    ? (double) (nanoseconds - trace_epoch_nanoseconds) / (double) (clock - trace_epoch_clock)
+    : 1;
+  struct trace_event* events = (struct trace_event*) malloc(sizeof(struct trace_event) * TRACE_RING_EVENTS);
+  if (events == NULL)
+    panic("failed to allocate trace events")
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  bool first = true;
+  struct trace_ring* ring;
+  for (ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next) {
+    fprintf
+      ( out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}"
+      , first ? "" : ",", ring->thread, ring->thread);
+    first = false;
+    // the thread goes on writing while we copy, so whatever it may have overwritten in the
+    // meantime is left out
+    uint64_t written = atomic_load_explicit(&ring->written, memory_order_acquire);
+    uint64_t oldest = written > TRACE_RING_EVENTS ? written - TRACE_RING_EVENTS : 0;
+    uint64_t i;
+    for (i = oldest; i < written; i++)
+      events[i - oldest] = ring->events[i & (TRACE_RING_EVENTS - 1)];
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t rewritten = atomic_load_explicit(&ring->written, memory_order_relaxed);
+    uint64_t intact = rewritten > TRACE_RING_EVENTS ? rewritten - TRACE_RING_EVENTS : 0;
+    for (i = oldest > intact ? oldest : intact; i < written; i++) {
+      struct trace_event* event = &events[i - oldest];
+      double start = (double) (int64_t) (event->start - trace_epoch_clock) * nanoseconds_per_tick / 1000;
+      double duration = (double) event->duration * nanoseconds_per_tick / 1000;
+      const char* name = trace_kind_names[event->kind];
+      if (event->kind == TRACE_QUEUED)
+        fprintf
+          ( out
+          , ",\n{\"name\":\"%s\",\"cat\":\"handoff\",\"ph\":\"b\",\"id\":\"%u.%lu\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"socket\":%d}}"
+            ",\n{\"name\":\"%s\",\"cat\":\"handoff\",\"ph\":\"e\",\"id\":\"%u.%lu\",\"pid\":1,\"tid\":%u,\"ts\":%.3f}"
+          , name, ring->thread, (unsigned long) i, ring->thread, start, event->socket
+          , name, ring->thread, (unsigned long) i, ring->thread, start + duration);
+      else
+        fprintf
+          ( out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"socket\":%d}}"
+          , name, ring->thread, start, duration, event->socket);
+    }
+  }
+  fprintf(out, "\n]}\n");
+  free(events);
+}
+
+// an empty timer_wheel, at tick 0 now
+void initialize_timer_wheel(struct timer_wheel* wheel) {
+  memset(wheel, 0, sizeof(struct timer_wheel));
+  wheel->start = monotonic_milliseconds();
+}
+
+// a timer which is not armed
+void initialize_timer(struct timer* timer) {
+  timer->next = NULL;
+  timer->previous = NULL;
+  timer->expires = 0;
+  timer->slot = 0;
+}
+
+// the number of ticks covering a timeout in milliseconds, never zero so it cannot fire
+// before the time has passed
+uint64_t timer_ticks(unsigned int milliseconds) {
+  return ((uint64_t) milliseconds + TIMER_TICK_MILLISECONDS - 1) / TIMER_TICK_MILLISECONDS + 1;
+}
+
+// the tick it is now
+uint64_t timer_wheel_clock(struct timer_wheel* wheel) {
+  return (monotonic_milliseconds() - wheel->start) / TIMER_TICK_MILLISECONDS;
+}
+
+// put an unlinked timer in the slot for its expiry
+void timer_link(struct timer_wheel* wheel, struct timer* timer) {
+  if (timer->expires < wheel->now)
+    timer->expires = wheel->now;
+  if (timer->expires - wheel->now >= TIMER_HORIZON)
+    timer->expires = wheel->now + TIMER_HORIZON - 1;
+  uint64_t delta = timer->expires - wheel->now;
+  unsigned int level = 0;
+  while (delta >= ((uint64_t) 1 << (TIMER_LEVEL_BITS * (level + 1))))
+    level++;
+  unsigned int slot = (unsigned int) (timer->expires >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1);
+  struct timer** head = &wheel->slots[level][slot];
+  timer->next = *head;
+  if (timer->next != NULL)
+    timer->next->previous = &timer->next;
+  timer->previous = head;
+  timer->slot = level * TIMER_SLOTS + slot;
+  *head = timer;
+  wheel->occupied[level] |= (uint64_t) 1 << slot;
+}
+
+// disarm a timer, whether or not it is armed
+void timer_cancel(struct timer_wheel* wheel, struct timer* timer) {
+  if (timer->previous == NULL)
+    return;
+  *timer->previous = timer->next;
+  if (timer->next != NULL)
+    timer->next->previous = timer->previous;
+  unsigned int level = timer->slot / TIMER_SLOTS, slot = timer->slot % TIMER_SLOTS;
+  if (wheel->slots[level][slot] == NULL)
+    wheel->occupied[level] &= ~((uint64_t) 1 << slot);
+  timer->next = NULL;
+  timer->previous = NULL;
+}
+
+// arm a timer to go off on the given tick, moving it if it was already armed
+void timer_arm(struct timer_wheel* wheel, struct timer* timer, uint64_t expires) {
+  if (timer->previous != NULL && timer->expires == expires)
+    return;
+  timer_cancel(wheel, timer);
+  timer->expires = expires;
+  timer_link(wheel, timer);
+}
+
+// move every timer in a slot of an upper level into the levels below
+void timer_cascade(struct timer_wheel* wheel, unsigned int level, unsigned int slot) {
+  struct timer* timer = wheel->slots[level][slot];
+  wheel->slots[level][slot] = NULL;
+  wheel->occupied[level] &= ~((uint64_t) 1 << slot);
+  while (timer != NULL) {
+    struct timer* next = timer->next;
+    timer_link(wheel, timer);
+    timer = next;
+  }
+}
+
+// whether no timer at all is armed
+bool timer_wheel_empty(struct timer_wheel* wheel) {
+  unsigned int level;
+  for (level = 0; level < TIMER_LEVELS; level++)
+    if (wheel->occupied[level] != 0)
+      return false;
+  return true;
+}
+
+// the next timer due by the given tick, disarmed, or NULL once none are left, take them
+// one at a time so whatever runs for one may freely arm and cancel the others
+struct timer* timer_wheel_expire(struct timer_wheel* wheel, uint64_t tick) {
+  while (true) {
+    struct timer* timer = wheel->slots[0][wheel->now & (TIMER_SLOTS - 1)];
+    if (timer != NULL) {
+      timer_cancel(wheel, timer);
+      return timer;
+    }
+    if (wheel->now >= tick)
+      return NULL;
+    // with nothing armed there is nothing to step through
+    if (timer_wheel_empty(wheel)) {
+      wheel->now = tick;
+      return NULL;
+    }
+    wheel->now++;
+    // the slots above whose ticks just came up fall into the levels below
+    unsigned int level;
+    for (level = 1; level < TIMER_LEVELS; level++) {
+      if (wheel->now & (((uint64_t) 1 << (TIMER_LEVEL_BITS * level)) - 1))
+        break;
+      timer_cascade(wheel, level, (unsigned int) (wheel->now >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1));
+    }
+  }
+}
+
+// how many milliseconds to wait before calling timer_wheel_expire again, -1 if no timer
+// is armed, as an event loop takes it
+int timer_wheel_timeout(struct timer_wheel* wheel) {
+  uint64_t wake = UINT64_MAX;
+  unsigned int level;
+  for (level = 0; level < TIMER_LEVELS; level++) {
+    if (wheel->occupied[level] == 0)
+      continue;
+    unsigned int shift = TIMER_LEVEL_BITS * level;
+    unsigned int current = (unsigned int) (wheel->now >> shift) & (TIMER_SLOTS - 1);
+    uint64_t rotated = current == 0
+      ? wheel->occupied[level]
+      : wheel->occupied[level] >> current | wheel->occupied[level] << (TIMER_SLOTS - current);
+    uint64_t distance = (uint64_t) __builtin_ctzll(rotated);
+    // the current slot of a level above 0 already cascaded, what is in it is a lap away
+    if (level > 0 && distance == 0)
+      distance = TIMER_SLOTS;
+    uint64_t tick = level == 0 ? wheel->now + distance : ((wheel->now >> shift) + distance) << shift;
+    if (tick < wake)
+      wake = tick;
+  }
+  if (wake == UINT64_MAX)
+    return -1;
+  uint64_t due = wheel->start + wake * TIMER_TICK_MILLISECONDS;
+  uint64_t now = monotonic_milliseconds();
+  if (due <= now)
+    return 0;
+  return due - now > INT_MAX ? INT_MAX : (int) (due - now);
+}
+
+struct worker;
+
+// a slot holding one connection, owned by exactly one worker, with what the event loop
+// looks at on every event, the rest is in the slot's connection_cold
+struct connection {
+  // client buffer, NULL while the slot is free
+  struct client_buffer* client_buffer;
+  // the worker owning the connection
+  struct worker* worker;
+  // whatever the handler wants to keep for the connection
+  void* user;
+  // what we have yet to write to the client
+  struct write_queue write_queue;
+  // the TLS session of a client of a tls listener, NULL for plaintext
+  SSL* tls;
+  // the index of the slot in its worker's table
+  unsigned int slot;
+  // bumped every time the slot is given back, so a handle to a client since closed does
+  // not find whoever holds the slot now
+  uint32_t generation;
+  // how many of the unconsumed bytes we looked through without finding the end of a frame,
+  // or of the head of a request with the http handler
+  int scanned;
+  // whether the TLS handshake is still going, so nothing is read or written but it
+  bool handshaking;
+  // whether kernel TLS encrypts what we write, or decrypts what we read, so the socket is
+  // used as though it were plaintext, sendfile and all
+  bool ktls_send;
+  bool ktls_receive;
+  // whether the client is on its worker's ready list
+  bool ready;
+  // whether the last write hit a full socket, so on_writable is owed once it drains
+  bool blocked;
+  // whether we stopped reading because the client_buffer reached its limit, or the write
+  // queue did, and owe the client a read once it has room
+  bool stalled;
+  // whether the write queue is past the write_queue_limit, so we do not read any more
+  bool throttled;
+  // whether the connection closes once the write queue drains
+  bool closing;
+  // whether a multishot recv is armed for the client, with the io_uring backend
+  bool receiving;
+  // whether we asked io_uring to cancel the recv
+  bool cancelling;
+  // whether a poll for writability is armed for the client, with the io_uring backend
+  bool polling;
+  // whether the handler is sitting on unconsumed bytes, and request_at counts
+  bool partial;
+};
+
+// the rest of a slot, in a table of its own beside the worker's connections so that the
+// connections pack into fewer cache lines
+struct connection_cold {
+  // what we wrote with MSG_ZEROCOPY and the kernel may still be reading
+  struct zerocopy zerocopy;
+  // goes off when the client has been waited on for longer than it is allowed
+  struct timer timer;
+  // the tick we last heard from the client
+  uint64_t active_at;
+  // the tick the socket last took some of the write queue
+  uint64_t written_at;
+  // the tick the bytes the handler has yet to consume started arriving
+  uint64_t request_at;
+  // whether we asked io_uring to cancel the poll for writability, only ever done on the way
+  // out, so it waits here rather than beside polling
+  bool cancelling_poll;
+};
+
+// names a connection for as long as it holds its slot: the slot's generation in the high
+// half, its index above the three low bits, which are left for a tag saying what an
+// event or completion carrying the handle is for
+typedef uint64_t connection_handle;
+
+// the handle of a connection holding a slot
+connection_handle handle_of(const struct connection* connection) {
+  return (uint64_t) connection->generation << 32 | (uint64_t) connection->slot << 3;
+}
+
+// the most frames handed to a single call of on_frames
+#define FRAME_BATCH 64
+
+// the most datagrams received per recvmmsg, sent per sendmmsg, or handed to a single call
+// of on_datagrams
+#define DATAGRAM_BATCH 64
+
+// the longest payload a UDP datagram can carry, and so the most a reply can be
+#define DATAGRAM_MAX 65507
+
+// the most segments we have the kernel cut one send into with UDP_SEGMENT
+#define DATAGRAM_SEGMENTS 64
+
+// the built-in cache spreads its keys over 1 << KV_STRIPE_BITS stripes by the top bits of
+// their hashes, each stripe with its own lock, table and share of the memory
+#define KV_STRIPE_BITS 4
+#define KV_STRIPES (1 << KV_STRIPE_BITS)
+
+// the memory a size class of the cache takes at a time, and so the largest item
+#define KV_PAGE_SIZE (1 << 20)
+
+// the smallest item of the cache, and the unit its items are addressed in
+#define KV_ITEM_UNIT 64
+
+// the size classes of the cache, doubling from KV_ITEM_UNIT to KV_PAGE_SIZE
+#define KV_CLASSES 15
+
+// the most keys of one request the cache hashes and prefetches before looking any up
+#define KV_BATCH 16
+
+// a datagram that arrived on one of the udp listeners
+struct datagram {
+  // the payload, a view into a buffer which is received into again once the handler returns
+  const char* data;
+  // the length of the payload
+  int length;
+  // who sent it, and where a reply to it goes
+  const union peer_address* peer;
+  // the length of peer
+  socklen_t peer_length;
+};
+
+// a worker's socket for one of the udp listeners: a batch of pool buffers recvmmsg fills,
+// and a batch of replies sendmmsg sends once the handler is done with what arrived
+struct datagram_socket {
+  // the socket, bound with SO_REUSEPORT so each worker receives its share of the flows
+  int socket;
+  // the worker owning the socket
+  struct worker* worker;
+  // the size of each buffer we receive into
+  int buffer_size;
+  // the buffers we receive into, from the worker's pool
+  char* buffers[DATAGRAM_BATCH];
+  // the pool size class of the buffers
+  int size_class;
+  // a receive batch, with the buffer, sender and UDP_GRO segment size of each message
+  struct mmsghdr messages[DATAGRAM_BATCH];
+  struct iovec iovecs[DATAGRAM_BATCH];
+  union peer_address peers[DATAGRAM_BATCH];
+  union {
+    char buffer[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } controls[DATAGRAM_BATCH];
+  // the payloads of the queued replies, back to back, from the worker's pool
+  char* replies;
+  // the pool size class of replies
+  int replies_class;
+  // the number of bytes of replies taken
+  size_t replied;
+  // a send batch, with the payload, receiver and UDP_SEGMENT segment size of each reply,
+  // where with gso a reply may be a run of equal segments to the same receiver
+  struct mmsghdr reply_messages[DATAGRAM_BATCH];
+  struct iovec reply_iovecs[DATAGRAM_BATCH];
+  union peer_address reply_peers[DATAGRAM_BATCH];
+  union {
+    char buffer[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+  } reply_controls[DATAGRAM_BATCH];
+  uint16_t segments[DATAGRAM_BATCH];
+  // the number of replies queued
+  unsigned int nreplies;
+};
+
+// what the server does with its connections, every callback but on_data, or on_frames
+// when there is framing, may be NULL
+struct handler {
+  // a connection was accepted, set connection->user here if you need it
+  void (*on_open)(struct connection* connection);
+  // new bytes arrived in connection->client_buffer, consume those you are done with,
+  // only called without framing
+  void (*on_data)(struct connection* connection);
+  // the write queue drained after the socket had been full
+  void (*on_writable)(struct connection* connection);
+  // the connection is going away, release whatever connection->user holds
+  void (*on_close)(struct connection* connection);
+  // shared by every connection, for the handler's own use
+  void* context;
+  // how incoming bytes are cut into frames, FRAMING_NONE to get them as they come
+  enum framing framing;
+  // complete frames arrived, in order, as views into connection->client_buffer which
+  // are consumed once this returns, so copy whatever must outlive the call
+  void (*on_frames)(struct connection* connection, const struct frame* frames, int count);
+  // datagrams arrived on a udp listener, in order for each sender, as views into buffers
+  // which are received into again once this returns, answer with datagram_reply, only
+  // needed with udp listeners
+  void (*on_datagrams)(struct datagram_socket* socket, const struct datagram* datagrams, int count);
+};
+
+// a cell of the handoff_queue, its sequence says whose turn it is to touch it
+struct handoff_cell {
+  // the position this cell may next be written at, or the position plus one when full
+  _Atomic size_t sequence;
+  // the accepted client being handed off
+  struct client client;
+};
+
+// bounded multi-producer/multi-consumer ring carrying accepted clients to workers,
+// after Dmitry Vyukov's bounded MPMC queue
+struct handoff_queue {
+  // the ring of cells, capacity is a power of two
+  struct handoff_cell* cells;
+  // capacity - 1, for turning positions into indices
+  size_t mask;
+  // eventfd which sleeping consumers watch, only written when someone sleeps
+  int eventfd;
+  // the next position a producer will claim
+  _Alignas(CACHE_LINE_SIZE) _Atomic size_t enqueue_position;
+  // the next position a consumer will claim
+  _Alignas(CACHE_LINE_SIZE) _Atomic size_t dequeue_position;
+  // the number of consumers which found the queue empty and are going to sleep
+  _Alignas(CACHE_LINE_SIZE) _Atomic unsigned int sleepers;
+};
+
+// make a new handoff_queue holding at least capacity clients
+struct handoff_queue* make_handoff_queue(size_t capacity) {
+  size_t rounded = 2;
+  while (rounded < capacity)
+    rounded <<= 1;
+  struct handoff_queue* queue =
+    (struct handoff_queue*) aligned_alloc(CACHE_LINE_SIZE, sizeof(struct handoff_queue));
+  if (queue == NULL)
+    panic("failed to allocate handoff queue")
+  queue->cells = (struct handoff_cell*) malloc(sizeof(struct handoff_cell) * rounded);
+  if (queue->cells == NULL)
+    panic("failed to allocate handoff queue")
+  queue->mask = rounded - 1;
+  size_t i;
+  for (i = 0; i < rounded; i++)
+    atomic_init(&queue->cells[i].sequence, i);
+  atomic_init(&queue->enqueue_position, 0);
+  atomic_init(&queue->dequeue_position, 0);
+  atomic_init(&queue->sleepers, 0);
+  if ((queue->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    panic("failed to create handoff eventfd")
+  return queue;
+}
+
+// wake the sleeping consumers, if there are any
+void handoff_signal(struct handoff_queue* queue) {
+  // pairs with the fence in handoff_sleep, either we see the sleeper or it sees the client
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&queue->sleepers, memory_order_relaxed) > 0) {
+    uint64_t one = 1;
+    if (write(queue->eventfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+      panic("failed to wake handoff consumers")
+  }
+}
+
+// try to hand a client off, false if the queue is full
+bool handoff_push(struct handoff_queue* queue, struct client client) {
+  struct handoff_cell* cell;
+  size_t position = atomic_load_explicit(&queue->enqueue_position, memory_order_relaxed);
+  while (true) {
+    cell = &queue->cells[position & queue->mask];
+    size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+    if (difference == 0) {
+      // the cell is free at our position, try to claim it
+      if (atomic_compare_exchange_weak_explicit
+            (&queue->enqueue_position, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if (difference < 0) {
+      // a whole lap behind, the queue is full
+      return false;
+    } else {
+      // another producer got here first
+      position = atomic_load_explicit(&queue->enqueue_position, memory_order_relaxed);
+    }
+  }
+  cell->client = client;
+  atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+
+  handoff_signal(queue);
+  return true;
+}
+
+// try to take a client, false if the queue is empty
+bool handoff_pop(struct handoff_queue* queue, struct client* client) {
+  struct handoff_cell* cell;
+  size_t position = atomic_load_explicit(&queue->dequeue_position, memory_order_relaxed);
+  while (true) {
+    cell = &queue->cells[position & queue->mask];
+    size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t difference = (intptr_t) sequence - (intptr_t) (position + 1);
+    if (difference == 0) {
+      // the cell is filled at our position, try to claim it
+      if (atomic_compare_exchange_weak_explicit
+            (&queue->dequeue_position, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if (difference < 0) {
+      // nothing written here yet, the queue is empty
+      return false;
+    } else {
+      // another consumer got here first
+      position = atomic_load_explicit(&queue->dequeue_position, memory_order_relaxed);
+    }
+  }
+  *client = cell->client;
+  // the cell is free again for the producer one lap ahead
+  atomic_store_explicit(&cell->sequence, position + queue->mask + 1, memory_order_release);
+  return true;
+}
+
+// whether a consumer would find something in the queue right now
+bool handoff_empty(struct handoff_queue* queue) {
+  size_t position = atomic_load_explicit(&queue->dequeue_position, memory_order_relaxed);
+  struct handoff_cell* cell = &queue->cells[position & queue->mask];
+  return atomic_load_explicit(&cell->sequence, memory_order_acquire) != position + 1;
+}
+
+// announce that we are about to block, false if a client arrived meanwhile
+bool handoff_sleep(struct handoff_queue* queue) {
+  atomic_fetch_add_explicit(&queue->sleepers, 1, memory_order_relaxed);
+  // pairs with the fence in handoff_push
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!handoff_empty(queue)) {
+    atomic_fetch_sub_explicit(&queue->sleepers, 1, memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+// we woke up, producers no longer need to signal on our behalf
+void handoff_wake(struct handoff_queue* queue) {
+  atomic_fetch_sub_explicit(&queue->sleepers, 1, memory_order_relaxed);
+}
+
+// consume a signal on the eventfd, whoever gets here first does it for everyone
+void handoff_reset(struct handoff_queue* queue) {
+  uint64_t count;
+  if (read(queue->eventfd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    panic("failed to reset handoff eventfd")
+}
+
+// the number of entries in each worker's io_uring submission queue
+#define URING_ENTRIES 256
+
+// the number of buffers each worker provides to the kernel for multishot recv
+#define URING_BUFFERS 256
+
+// the pool size class of the provided buffers, 4K
+#define URING_BUFFER_CLASS 1
+
+// the buffer group all provided buffers of a ring belong to
+#define URING_BUFFER_GROUP 0
+
+// the most connections a worker holds on to after running out of slots, multishot
+// accept keeps completing until our cancellation reaches it
+#define URING_HELD_SOCKETS 64
+
+// what a completion is for, kept in the low bits of its user_data
+enum uring_tag {
+  // the multishot accept on the worker's listening socket whose index makes up the other bits
+  URING_ACCEPT = 1,
+  // the multishot recv of the connection whose handle makes up the other bits
+  URING_RECV = 2,
+  // a cancellation, whose result we do not care about
+  URING_CANCEL = 3,
+  // the writability poll of the connection whose handle makes up the other bits
+  URING_POLL = 4,
+  // the poll on the worker's wake eventfd
+  URING_WAKE = 5
+};
+
+// mask for the tag bits of a user_data
+#define URING_TAG_MASK 7
+
+// a minimal io_uring, set up and driven with the raw system calls
+struct uring {
+  // the ring itself
+  int fd;
+  // the kernel's end of the submission queue
+  unsigned* sq_head;
+  // our end of the submission queue
+  unsigned* sq_tail;
+  // for turning submission positions into indices
+  unsigned sq_mask;
+  // the indirection array from submission positions to sqes
+  unsigned* sq_array;
+  // the submission queue entries
+  struct io_uring_sqe* sqes;
+  // the number of sqes filled in since the last io_uring_enter
+  unsigned to_submit;
+  // our end of the completion queue
+  unsigned* cq_head;
+  // the kernel's end of the completion queue
+  unsigned* cq_tail;
+  // for turning completion positions into indices
+  unsigned cq_mask;
+  // the completion queue entries
+  struct io_uring_cqe* cqes;
+  // ring of buffers the kernel picks from when a multishot recv completes
+  struct io_uring_buf_ring* buffer_ring;
+  // our end of the buffer ring
+  unsigned short buffer_tail;
+  // the pool storage behind each buffer id
+  char* buffers[URING_BUFFERS];
+};
+
+// an io_uring system call, there is no libc wrapper for them
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* argument, size_t size) {
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, argument, size);
+}
+
+// hand a buffer back to the kernel for the next recv
+void uring_provide_buffer(struct uring* ring, unsigned short id) {
+  struct io_uring_buf* buffer = &ring->buffer_ring->bufs[ring->buffer_tail & (URING_BUFFERS - 1)];
+  buffer->addr = (uint64_t) (uintptr_t) ring->buffers[id];
+  buffer->len = buffer_class_sizes[URING_BUFFER_CLASS];
+  buffer->bid = id;
+  ring->buffer_tail++;
+  atomic_store_explicit((_Atomic uint16_t*) &ring->buffer_ring->tail, ring->buffer_tail, memory_order_release);
+}
+
+// set up an io_uring whose provided buffers come out of pool
+void initialize_uring(struct uring* ring, struct buffer_pool* pool) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  // completions arrive in bursts of one per recv, give them room
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+  params.cq_entries = URING_ENTRIES * 8;
+  ring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  // older kernels know neither of the task flags
+  if (ring->fd == -1 && errno == EINVAL) {
+    params.flags = IORING_SETUP_CQSIZE;
+    ring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  }
+  if (ring->fd == -1)
+    panic("failed to set up io_uring")
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)
+      || !(params.features & IORING_FEAT_EXT_ARG))
+    panic("io_uring is too old, we need IORING_FEAT_SINGLE_MMAP, IORING_FEAT_NODROP and IORING_FEAT_EXT_ARG")
+
+  // both queues live in a single mapping
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  size_t size = sq_size > cq_size ? sq_size : cq_size;
+  char* queues = (char*) mmap
+    (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (queues == MAP_FAILED)
+    panic("failed to map io_uring queues")
+  ring->sq_head = (unsigned*) (queues + params.sq_off.head);
+  ring->sq_tail = (unsigned*) (queues + params.sq_off.tail);
+  ring->sq_mask = *(unsigned*) (queues + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*) (queues + params.sq_off.array);
+  ring->cq_head = (unsigned*) (queues + params.cq_off.head);
+  ring->cq_tail = (unsigned*) (queues + params.cq_off.tail);
+  ring->cq_mask = *(unsigned*) (queues + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*) (queues + params.cq_off.cqes);
+  ring->sqes = (struct io_uring_sqe*) mmap
+    ( NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE
+    , MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    panic("failed to map io_uring submission entries")
+  ring->to_submit = 0;
+
+  // register the ring of provided buffers, the kernel wants it page aligned
+  ring->buffer_ring = (struct io_uring_buf_ring*) mmap
+    ( NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE
+    , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->buffer_ring == MAP_FAILED)
+    panic("failed to map io_uring buffer ring")
+  struct io_uring_buf_reg registration;
+  memset(&registration, 0, sizeof(registration));
+  registration.ring_addr = (uint64_t) (uintptr_t) ring->buffer_ring;
+  registration.ring_entries = URING_BUFFERS;
+  registration.bgid = URING_BUFFER_GROUP;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) == -1)
+    panic("failed to register io_uring buffer ring")
+  ring->buffer_tail = 0;
+  unsigned short i;
+  for (i = 0; i < URING_BUFFERS; i++) {
+    ring->buffers[i] = (char*) pool_take
+      (pool, &pool->free_blocks[URING_BUFFER_CLASS], buffer_class_sizes[URING_BUFFER_CLASS]);
+    uring_provide_buffer(ring, i);
+  }
+}
+
+// submit everything we have queued, and wait for at least wait completions or until
+// timeout milliseconds have passed, -1 to wait for ever
+void uring_submit(struct uring* ring, unsigned wait, int timeout) {
+  struct __kernel_timespec limit;
+  struct io_uring_getevents_arg argument;
+  memset(&argument, 0, sizeof(argument));
+  unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+  if (wait > 0 && timeout >= 0) {
+    limit.tv_sec = timeout / 1000;
+    limit.tv_nsec = (long long) (timeout % 1000) * 1000000;
+    argument.ts = (uint64_t) (uintptr_t) &limit;
+    flags |= IORING_ENTER_EXT_ARG;
+  }
+  while (true) {
+    int submitted = flags & IORING_ENTER_EXT_ARG
+      ? uring_enter(ring->fd, ring->to_submit, wait, flags, &argument, sizeof(argument))
+      : uring_enter(ring->fd, ring->to_submit, wait, flags, NULL, 0);
+    if (submitted >= 0) {
+      ring->to_submit -= submitted;
+      return;
+    }
+    // running out the clock is what we asked for
+    if (errno == ETIME)
+      return;
+    // a signal or a full completion queue, both are cleared by coming back
+    if (errno != EINTR && errno != EBUSY && errno != EAGAIN)
+      panic("failed to submit to io_uring")
+    if (errno != EINTR)
+      return;
+  }
+}
+
+// a blank submission queue entry, submitting the ones we have if the queue is full
+struct io_uring_sqe* uring_sqe(struct uring* ring) {
+  unsigned tail = *ring->sq_tail;
+  while (tail - atomic_load_explicit((_Atomic unsigned*) ring->sq_head, memory_order_acquire) > ring->sq_mask)
+    uring_submit(ring, 0, -1);
+  unsigned index = tail & ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  atomic_store_explicit((_Atomic unsigned*) ring->sq_tail, tail + 1, memory_order_release);
+  ring->to_submit++;
+  return sqe;
+}
+
+// cancel whatever is in flight with the given user_data
+void uring_cancel(struct uring* ring, uint64_t user_data) {
+  struct io_uring_sqe* sqe = uring_sqe(ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = user_data;
+  sqe->user_data = URING_CANCEL;
+}
+
+// which event loop the workers run
+enum io_backend {
+  // readiness with epoll, then read and accept ourselves
+  IO_BACKEND_EPOLL,
+  // completions with io_uring, multishot accept and recv into provided buffers
+  IO_BACKEND_URING
+};
+
+// how connections get from the kernel to the workers
+enum server_mode {
+  // every worker accepts on its own SO_REUSEPORT socket
+  SERVER_MODE_REACTOR,
+  // one acceptor thread hands clients to the workers through a handoff_queue
+  SERVER_MODE_ACCEPTOR
+};
+
+// the most addresses one server listens on
+#define MAX_LISTENERS 16
+
+// an address to listen on
+struct listen_address {
+  // a sockaddr_in, sockaddr_in6 or sockaddr_un
+  struct sockaddr_storage address;
+  // the length of address
+  socklen_t length;
+  // whether clients speak TLS to us, which we terminate
+  bool tls;
+};
+
+// a configuration for the server
+struct config {
+  // addresses the server will live on, every worker serves all of them
+  struct listen_address listeners[MAX_LISTENERS];
+  // the number of listeners
+  unsigned int nlisteners;
+  // the UDP addresses to receive datagrams on, each worker with its own socket for each
+  struct listen_address datagram_listeners[MAX_LISTENERS];
+  // the number of datagram_listeners
+  unsigned int ndatagram_listeners;
+  // whether IPv6 listeners leave IPv4 to others rather than taking it too
+  bool v6only;
+  // maximum number of connections allowed to be pending for the server's socket
+  unsigned short connection_backlog;
+  // number of worker threads you want to be onliny
+  unsigned int nworkers;
+  // maximum number of requests we process simultaneously
+  unsigned int  nrequests;
+  // whether each worker thread is pinned to its own CPU, with its buffers on that CPU's NUMA
+  // node and its sockets preferring connections and datagrams the CPU received
+  bool pin_workers;
+  // how accepted connections reach the workers
+  enum server_mode mode;
+  // the size client_buffers start out at
+  int initial_buffer_size;
+  // the most unconsumed bytes we buffer per client before we stop reading from it
+  int read_buffer_limit;
+  // the most bytes we read from one client per wakeup before serving the others
+  int read_budget;
+  // the most connections we accept per wakeup before serving the ones we have
+  unsigned int accept_budget;
+  // the event loop the workers run
+  enum io_backend backend;
+  // the port metrics are served on, on the same address as the server, 0 for none
+  uint16_t admin_port;
+  // the most bytes we queue for a client before we stop reading from it
+  size_t write_queue_limit;
+  // milliseconds a client may go without sending anything while we owe it nothing, 0 for ever
+  unsigned int idle_timeout;
+  // milliseconds a client may take to finish a request it started sending, 0 for ever
+  unsigned int header_timeout;
+  // milliseconds a full socket may go without taking any of what we write, 0 for ever
+  unsigned int write_timeout;
+  // milliseconds the connections we have get to finish once we stop accepting, before we
+  // exit regardless
+  unsigned int drain_timeout;
+  // whether responses go out as soon as they are written rather than waiting on Nagle
+  bool nodelay;
+  // seconds the kernel holds a connection back from accept until it has data, 0 for off
+  int defer_accept;
+  // SO_RCVBUF and SO_SNDBUF of every connection, 0 to leave them to the kernel's autotuning
+  int receive_buffer;
+  int send_buffer;
+  // how many TCP Fast Open requests may wait on their handshake at once, 0 for off
+  int fastopen;
+  // microseconds a read spins on the device queue before sleeping, 0 for off
+  int busy_poll;
+  // the smallest write sent from our memory with MSG_ZEROCOPY rather than copied into the
+  // socket, with the epoll backend over TCP, 0 to always copy
+  size_t zerocopy_threshold;
+  // the longest datagram we receive whole, longer ones are dropped
+  int datagram_size;
+  // whether the kernel may hand us a run of datagrams from one sender in a single
+  // buffer, UDP_GRO, which takes buffers of the largest size a datagram can be
+  bool gro;
+  // whether runs of equal sized replies to one sender go out as a single send the kernel,
+  // or the device, cuts up, UDP_SEGMENT
+  bool gso;
+  // whether the workers' buffers are in huge pages, sparing the TLB
+  bool huge_pages;
+  // whether each thread records how long the steps of accepting, reading, handling and
+  // writing take, for the admin port to export on /trace
+  bool trace;
+  // PEM files with the certificate chain and private key tls listeners present, NULL for none
+  const char* tls_certificate;
+  const char* tls_key;
+  // a file of 80 random bytes encrypting session tickets, so that servers sharing it resume
+  // each other's sessions, and a reload resumes its predecessor's, NULL for a key of our own
+  const char* tls_ticket_key;
+};
+
+// make a new config
+struct config make_config
+  ( // the port to bind to
+    uint16_t port
+    // the ip address to bind to
+  , long ip
+    // the number of connections to allow in the backlog of the socket
+  , short connection_backlog
+    // the number of workers which process requests
+  , unsigned int nworkers
+    // the maximum number of requests which we will process at once
+  , unsigned int nrequests
+    // whether to pin each worker to a CPU
+  , bool pin_workers
+    // whether workers accept for themselves or are handed clients
+  , enum server_mode mode
+    // whether workers are driven by epoll or io_uring
+  , enum io_backend backend
+  ) 
+{
+  struct config config;
+  memset(&config.listeners, 0, sizeof(config.listeners));
+  struct sockaddr_in* address = (struct sockaddr_in*) &config.listeners[0].address;
+  address->sin_family = AF_INET;
+  address->sin_port = htons(port);
+  address->sin_addr.s_addr = htonl(ip);
+  config.listeners[0].length = sizeof(struct sockaddr_in);
+  config.nlisteners = 1;
+  config.ndatagram_listeners = 0;
+  config.v6only = false;
+  config.connection_backlog = connection_backlog;
+  config.nworkers = nworkers;
+  config.nrequests = nrequests;
+  config.pin_workers = pin_workers;
+  config.mode = mode;
+  config.backend = backend;
+  config.admin_port = 9090;
+  // buffers start in the smallest pool class and may grow up to a megabyte
+  config.initial_buffer_size = 1 << 10;
+  config.read_buffer_limit = 1 << 20;
+  config.read_budget = 1 << 16;
+  config.accept_budget = 64;
+  config.write_queue_limit = 1 << 20;
+  // a minute of silence, ten seconds to get a request across, thirty to take a response
+  config.idle_timeout = 60000;
+  config.header_timeout = 10000;
+  config.write_timeout = 30000;
+  config.drain_timeout = 30000;
+  // small responses are the common case, and Nagle only ever delays them
+  config.nodelay = true;
+  config.defer_accept = 0;
+  config.receive_buffer = 0;
+  config.send_buffer = 0;
+  config.fastopen = 0;
+  config.busy_poll = 0;
+  // pinning pages only pays off for writes of tens of kilobytes, through a real device
+  config.zerocopy_threshold = 0;
+  // an MTU sized datagram and then some, in the pool's second size class
+  config.datagram_size = 1 << 12;
+  config.gro = false;
+  config.gso = false;
+  config.huge_pages = true;
+  config.trace = false;
+  config.tls_certificate = NULL;
+  config.tls_key = NULL;
+  config.tls_ticket_key = NULL;
+  return config;
+};
+
+// read the first line of a small file into line, false if there is none
+bool read_first_line(const char* path, char* line, int size) {
+  FILE* file = fopen(path, "re");
+  if (file == NULL)
+    return false;
+  bool read = fgets(line, size, file) != NULL;
+  fclose(file);
+  if (read)
+    line[strcspn(line, "\n")] = '\0';
+  return read;
+}
+
+// the CPUs our cgroup's quota pays for, rounded up, 0 if it sets none
+unsigned int cgroup_cpus(void) {
+  char line[PATH_MAX];
+  char path[PATH_MAX + 64] = "";
+  long quota, period;
+
+  // cgroup v2 has one hierarchy, ours is the path of its "0::" line, though inside a
+  // container's cgroup namespace that is usually just the root
+  FILE* file = fopen("/proc/self/cgroup", "re");
+  if (file != NULL) {
+    while (fgets(line, sizeof(line), file) != NULL) {
+      if (strncmp(line, "0::", 3) != 0)
+        continue;
+      line[strcspn(line, "\n")] = '\0';
+      snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", line + 3);
+      break;
+    }
+    fclose(file);
+  }
+  // cpu.max reads "max 100000" when there is no quota, which does not scan
+  if (((path[0] != '\0' && read_first_line(path, line, sizeof(line))) ||
+       read_first_line("/sys/fs/cgroup/cpu.max", line, sizeof(line))) &&
+      sscanf(line, "%ld %ld", &quota, &period) == 2 && quota > 0 && period > 0)
+    return (quota + period - 1) / period;
+
+  // cgroup v1 keeps the two apart, with -1 for no quota
+  if (read_first_line("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", line, sizeof(line)) &&
+      sscanf(line, "%ld", &quota) == 1 && quota > 0 &&
+      read_first_line("/sys/fs/cgroup/cpu/cpu.cfs_period_us", line, sizeof(line)) &&
+      sscanf(line, "%ld", &period) == 1 && period > 0)
+    return (quota + period - 1) / period;
+  return 0;
+}
+
+// the CPUs we may actually use: those in our affinity mask, capped by our cgroup's quota,
+// so a container given two cores of a 96 core host runs two workers rather than 96
+unsigned int available_cpus(void) {
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned int ncpus = online > 0 ? online : 1;
+  cpu_set_t cpus;
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+    ncpus = CPU_COUNT(&cpus);
+  unsigned int quota = cgroup_cpus();
+  if (quota > 0 && quota < ncpus)
+    ncpus = quota;
+  return ncpus > 0 ? ncpus : 1;
+}
+
+// the options the server takes, past the single letter ones
+enum config_option {
+  OPTION_MODE = 256,
+  OPTION_BACKEND,
+  OPTION_PIN,
+  OPTION_ADMIN_PORT,
+  OPTION_BUFFER_SIZE,
+  OPTION_READ_BUFFER_LIMIT,
+  OPTION_READ_BUDGET,
+  OPTION_ACCEPT_BUDGET,
+  OPTION_WRITE_QUEUE_LIMIT,
+  OPTION_IDLE_TIMEOUT,
+  OPTION_HEADER_TIMEOUT,
+  OPTION_WRITE_TIMEOUT,
+  OPTION_DRAIN_TIMEOUT,
+  OPTION_NODELAY,
+  OPTION_DEFER_ACCEPT,
+  OPTION_RECEIVE_BUFFER,
+  OPTION_SEND_BUFFER,
+  OPTION_FASTOPEN,
+  OPTION_BUSY_POLL,
+  OPTION_ZEROCOPY_THRESHOLD,
+  OPTION_DATAGRAM_SIZE,
+  OPTION_GRO,
+  OPTION_GSO,
+  OPTION_HUGE_PAGES,
+  OPTION_TRACE,
+  OPTION_TLS_CERTIFICATE,
+  OPTION_TLS_KEY,
+  OPTION_TLS_TICKET_KEY,
+  OPTION_HTTP,
+  OPTION_KV,
+  OPTION_KV_MEMORY,
+  OPTION_V6ONLY
+};
+
+// every option can also be set in the environment as SERVER_ and its name in upper case
+// with underscores for dashes, SERVER_IDLE_TIMEOUT=5000 for --idle-timeout=5000, and the
+// command line wins over the environment
+struct option config_options[] =
+  { { "listen", required_argument, NULL, 'l' }
+  , { "v6only", optional_argument, NULL, OPTION_V6ONLY }
+  , { "backlog", required_argument, NULL, 'b' }
+  , { "workers", required_argument, NULL, 'w' }
+  , { "connections", required_argument, NULL, 'c' }
+  , { "mode", required_argument, NULL, OPTION_MODE }
+  , { "backend", required_argument, NULL, OPTION_BACKEND }
+  , { "pin", optional_argument, NULL, OPTION_PIN }
+  , { "admin-port", required_argument, NULL, OPTION_ADMIN_PORT }
+  , { "buffer-size", required_argument, NULL, OPTION_BUFFER_SIZE }
+  , { "read-buffer-limit", required_argument, NULL, OPTION_READ_BUFFER_LIMIT }
+  , { "read-budget", required_argument, NULL, OPTION_READ_BUDGET }
+  , { "accept-budget", required_argument, NULL, OPTION_ACCEPT_BUDGET }
+  , { "write-queue-limit", required_argument, NULL, OPTION_WRITE_QUEUE_LIMIT }
+  , { "idle-timeout", required_argument, NULL, OPTION_IDLE_TIMEOUT }
+  , { "header-timeout", required_argument, NULL, OPTION_HEADER_TIMEOUT }
+  , { "write-timeout", required_argument, NULL, OPTION_WRITE_TIMEOUT }
+  , { "drain-timeout", required_argument, NULL, OPTION_DRAIN_TIMEOUT }
+  , { "nodelay", optional_argument, NULL, OPTION_NODELAY }
+  , { "defer-accept", required_argument, NULL, OPTION_DEFER_ACCEPT }
+  , { "receive-buffer", required_argument, NULL, OPTION_RECEIVE_BUFFER }
+  , { "send-buffer", required_argument, NULL, OPTION_SEND_BUFFER }
+  , { "fastopen", required_argument, NULL, OPTION_FASTOPEN }
+  , { "busy-poll", required_argument, NULL, OPTION_BUSY_POLL }
+  , { "zerocopy-threshold", required_argument, NULL, OPTION_ZEROCOPY_THRESHOLD }
+  , { "datagram-size", required_argument, NULL, OPTION_DATAGRAM_SIZE }
+  , { "gro", optional_argument, NULL, OPTION_GRO }
+  , { "gso", optional_argument, NULL, OPTION_GSO }
+  , { "huge-pages", optional_argument, NULL, OPTION_HUGE_PAGES }
+  , { "trace", optional_argument, NULL, OPTION_TRACE }
+  , { "tls-certificate", required_argument, NULL, OPTION_TLS_CERTIFICATE }
+  , { "tls-key", required_argument, NULL, OPTION_TLS_KEY }
+  , { "tls-ticket-key", required_argument, NULL, OPTION_TLS_TICKET_KEY }
+  , { "http", optional_argument, NULL, OPTION_HTTP }
+  , { "kv", optional_argument, NULL, OPTION_KV }
+  , { "kv-memory", required_argument, NULL, OPTION_KV_MEMORY }
+  , { "help", no_argument, NULL, 'h' }
+  , { NULL, 0, NULL, 0 }
+  };
+
+void usage(const char* name) {
+  fprintf
+    ( stderr
+    , "usage: %s [-l address:port|unix:path|udp:address:port|tls:address:port ...] [--v6only[=0|1]] [-b backlog] [-w workers]\n"
+      "  [-c connections] [--mode=reactor|acceptor] [--backend=epoll|uring] [--pin[=0|1]] [--admin-port=port]\n"
+      "  [--buffer-size=bytes] [--read-buffer-limit=bytes] [--read-budget=bytes] [--accept-budget=count]\n"
+      "  [--write-queue-limit=bytes] [--idle-timeout=ms] [--header-timeout=ms]\n"
+      "  [--write-timeout=ms] [--drain-timeout=ms] [--nodelay[=0|1]] [--defer-accept=seconds]\n"
+      "  [--receive-buffer=bytes] [--send-buffer=bytes] [--fastopen=queue length]\n"
+      "  [--busy-poll=microseconds] [--zerocopy-threshold=bytes] [--datagram-size=bytes]\n"
+      "  [--gro[=0|1]] [--gso[=0|1]] [--huge-pages[=0|1]] [--tls-certificate=file]\n"
+      "  [--tls-key=file] [--tls-ticket-key=file] [--trace[=0|1]] [--http[=0|1]]\n"
+      "  [--kv[=0|1]] [--kv-memory=bytes]\n"
+      "every option may also be given in the environment, --idle-timeout as SERVER_IDLE_TIMEOUT\n"
+    , name );
+  exit(EXIT_FAILURE);
+}
+
+// a number from min to max, or exit naming whatever it came from
+long parse_number(const char* source, const char* value, long min, long max) {
+  char* end;
+  errno = 0;
+  long number = strtol(value, &end, 10);
+  if (errno != 0 || end == value || *end != '\0' || number < min || number > max) {
+    fprintf(stderr, "%s wants a number from %ld to %ld, not \"%s\"\n", source, min, max, value);
+    exit(EXIT_FAILURE);
+  }
+  return number;
+}
+
+// parse an address to listen on, 0.0.0.0:8080, [::]:8080, a bare port for every IPv4
+// address, unix:/path for a unix socket or unix:@name for one in the abstract namespace,
+// false if text is none of those
+bool parse_listen_address(const char* text, struct listen_address* listener) {
+  if (strncmp(text, "unix:", 5) == 0) {
+    memset(listener, 0, sizeof(*listener));
+    struct sockaddr_un* unix_address = (struct sockaddr_un*) &listener->address;
+    const char* path = text + 5;
+    size_t length = strlen(path);
+    // an abstract name is not terminated, the path of a file is
+    if (length == 0 || length >= sizeof(unix_address->sun_path))
+      return false;
+    unix_address->sun_family = AF_UNIX;
+    memcpy(unix_address->sun_path, path, length);
+    if (path[0] == '@')
+      unix_address->sun_path[0] = '\0';
+    listener->length = offsetof(struct sockaddr_un, sun_path) + length + (path[0] != '@');
+    return true;
+  }
+
+  char host[INET6_ADDRSTRLEN];
+  const char* port = strrchr(text, ':');
+  size_t length = port == NULL ? 0 : (size_t) (port - text);
+  port = port == NULL ? text : port + 1;
+  if (text[0] == '[') {
+    // the brackets keep the colons of an IPv6 address apart from the port's
+    if (length < 2 || text[length - 1] != ']')
+      return false;
+    text++;
+    length -= 2;
+  }
+  if (length >= sizeof(host))
+    return false;
+  memcpy(host, text, length);
+  host[length] = '\0';
+
+  char* end;
+  errno = 0;
+  long number = strtol(port, &end, 10);
+  if (errno != 0 || end == port || *end != '\0' || number < 0 || number > UINT16_MAX)
+    return false;
+
+  memset(listener, 0, sizeof(*listener));
+  struct sockaddr_in* ipv4 = (struct sockaddr_in*) &listener->address;
+  struct sockaddr_in6* ipv6 = (struct sockaddr_in6*) &listener->address;
+  if (length == 0 || inet_pton(AF_INET, host, &ipv4->sin_addr) == 1) {
+    ipv4->sin_family = AF_INET;
+    ipv4->sin_port = htons(number);
+    listener->length = sizeof(struct sockaddr_in);
+    return true;
+  }
+  if (inet_pton(AF_INET6, host, &ipv6->sin6_addr) == 1) {
+    ipv6->sin6_family = AF_INET6;
+    ipv6->sin6_port = htons(number);
+    listener->length = sizeof(struct sockaddr_in6);
+    return true;
+  }
+  return false;
+}
+
+// a switch is on when it is given with no value
+bool parse_switch(const char* source, const char* value) {
+  if (value == NULL || strcmp(value, "1") == 0 || strcasecmp(value, "true") == 0 ||
+      strcasecmp(value, "yes") == 0 || strcasecmp(value, "on") == 0)
+    return true;
+  if (strcmp(value, "0") == 0 || strcasecmp(value, "false") == 0 ||
+      strcasecmp(value, "no") == 0 || strcasecmp(value, "off") == 0)
+    return false;
+  fprintf(stderr, "%s wants 0 or 1, not \"%s\"\n", source, value);
+  exit(EXIT_FAILURE);
+}
+
+// what configure learns beyond the config itself
+struct configure_result {
+  // whether to serve the demo routes over HTTP/1.1 rather than echoing
+  bool http;
+  // whether to serve the built-in cache rather than echoing, over the demo routes too
+  bool kv;
+  // the bytes the cache keeps keys and values in, its table of keys comes on top
+  long kv_memory;
+  // whether the connection count was given, or should follow the worker count
+  bool sized;
+  // whether the listeners were given, and replace the default rather than add to it
+  bool listening;
+};
+
+// apply one option from source, a flag or an environment variable, to config
+void apply_option
+  ( struct config* config
+  , struct configure_result* result
+  , int option
+  , const char* source
+  , const char* value
+  )
+{
+  switch (option) {
+    case 'l': {
+      // a list, separated by commas or spaces, so the environment can give several
+      char addresses[1024];
+      snprintf(addresses, sizeof(addresses), "%s", value);
+      char* saved;
+      char* address;
+      if (!result->listening) {
+        config->nlisteners = 0;
+        config->ndatagram_listeners = 0;
+      }
+      result->listening = true;
+      for (address = strtok_r(addresses, ", ", &saved); address != NULL; address = strtok_r(NULL, ", ", &saved)) {
+        // udp:address:port receives datagrams, and tls:address:port takes TLS connections,
+        // on an address or port as for TCP
+        bool datagram = strncmp(address, "udp:", 4) == 0;
+        bool tls = strncmp(address, "tls:", 4) == 0;
+        struct listen_address* listeners = datagram ? config->datagram_listeners : config->listeners;
+        unsigned int* nlisteners = datagram ? &config->ndatagram_listeners : &config->nlisteners;
+        if (*nlisteners == MAX_LISTENERS) {
+          fprintf(stderr, "%s: at most %d addresses of each kind\n", source, MAX_LISTENERS);
+          exit(EXIT_FAILURE);
+        }
+        struct listen_address* listener = &listeners[(*nlisteners)++];
+        if (!parse_listen_address(datagram || tls ? address + 4 : address, listener)
+            || ((datagram || tls) && listener->address.ss_family == AF_UNIX)) {
+          fprintf
+            ( stderr
+            , "%s wants address:port, [IPv6 address]:port, a port, unix:/path, unix:@name, or udp: or tls:\n"
+              "and an address or port, not \"%s\"\n"
+            , source, address );
+          exit(EXIT_FAILURE);
+        }
+        listener->tls = tls;
+      }
+      if (config->nlisteners + config->ndatagram_listeners == 0) {
+        fprintf(stderr, "%s wants at least one address\n", source);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case 'b': config->connection_backlog = parse_number(source, value, 1, USHRT_MAX); break;
+    case 'w': config->nworkers = parse_number(source, value, 1, 4096); break;
+    case 'c':
+      config->nrequests = parse_number(source, value, 1, 1 << 24);
+      result->sized = true;
+      break;
+    case OPTION_MODE:
+      if (strcmp(value, "reactor") == 0)
+        config->mode = SERVER_MODE_REACTOR;
+      else if (strcmp(value, "acceptor") == 0)
+        config->mode = SERVER_MODE_ACCEPTOR;
+      else {
+        fprintf(stderr, "%s wants reactor or acceptor, not \"%s\"\n", source, value);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case OPTION_BACKEND:
+      if (strcmp(value, "epoll") == 0)
+        config->backend = IO_BACKEND_EPOLL;
+      else if (strcmp(value, "uring") == 0)
+        config->backend = IO_BACKEND_URING;
+      else {
+        fprintf(stderr, "%s wants epoll or uring, not \"%s\"\n", source, value);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case OPTION_PIN: config->pin_workers = parse_switch(source, value); break;
+    case OPTION_ADMIN_PORT: config->admin_port = parse_number(source, value, 0, UINT16_MAX); break;
+    case OPTION_BUFFER_SIZE: config->initial_buffer_size = parse_number(source, value, 1, 1 << 30); break;
+    case OPTION_READ_BUFFER_LIMIT: config->read_buffer_limit = parse_number(source, value, 1, 1 << 30); break;
+    case OPTION_READ_BUDGET: config->read_budget = parse_number(source, value, 1, 1 << 30); break;
+    case OPTION_ACCEPT_BUDGET: config->accept_budget = parse_number(source, value, 1, UINT_MAX); break;
+    case OPTION_WRITE_QUEUE_LIMIT: config->write_queue_limit = parse_number(source, value, 1, LONG_MAX); break;
+    case OPTION_IDLE_TIMEOUT: config->idle_timeout = parse_number(source, value, 0, UINT_MAX); break;
+    case OPTION_HEADER_TIMEOUT: config->header_timeout = parse_number(source, value, 0, UINT_MAX); break;
+    case OPTION_WRITE_TIMEOUT: config->write_timeout = parse_number(source, value, 0, UINT_MAX); break;
+    case OPTION_DRAIN_TIMEOUT: config->drain_timeout = parse_number(source, value, 0, UINT_MAX); break;
+    case OPTION_NODELAY: config->nodelay = parse_switch(source, value); break;
+    case OPTION_DEFER_ACCEPT: config->defer_accept = parse_number(source, value, 0, INT_MAX); break;
+    case OPTION_RECEIVE_BUFFER: config->receive_buffer = parse_number(source, value, 0, INT_MAX); break;
+    case OPTION_SEND_BUFFER: config->send_buffer = parse_number(source, value, 0, INT_MAX); break;
+    case OPTION_FASTOPEN: config->fastopen = parse_number(source, value, 0, INT_MAX); break;
+    case OPTION_BUSY_POLL: config->busy_poll = parse_number(source, value, 0, INT_MAX); break;
+    case OPTION_ZEROCOPY_THRESHOLD: config->zerocopy_threshold = parse_number(source, value, 0, LONG_MAX); break;
+    case OPTION_DATAGRAM_SIZE: config->datagram_size = parse_number(source, value, 1, DATAGRAM_MAX); break;
+    case OPTION_GRO: config->gro = parse_switch(source, value); break;
+    case OPTION_GSO: config->gso = parse_switch(source, value); break;
+    case OPTION_HUGE_PAGES: config->huge_pages = parse_switch(source, value); break;
+    case OPTION_TRACE: config->trace = parse_switch(source, value); break;
+    case OPTION_TLS_CERTIFICATE: config->tls_certificate = value; break;
+    case OPTION_TLS_KEY: config->tls_key = value; break;
+    case OPTION_TLS_TICKET_KEY: config->tls_ticket_key = value; break;
+    case OPTION_HTTP: result->http = parse_switch(source, value); break;
+    case OPTION_KV: result->kv = parse_switch(source, value); break;
+    case OPTION_KV_MEMORY:
+      // every stripe needs a page, and its items must stay addressable in 32 bits
+      result->kv_memory = parse_number(source, value, (long) KV_STRIPES * KV_PAGE_SIZE, (long) KV_STRIPES << 36);
+      break;
+    case OPTION_V6ONLY: config->v6only = parse_switch(source, value); break;
+  }
+}
+
+// override config with the environment and then the command line, exiting with a usage
+// message on anything it does not understand
+struct configure_result configure(struct config* config, int argc, char** argv) {
+  struct configure_result result = { false, false, 256l << 20, false, false };
+  struct option* option;
+
+  for (option = config_options; option->name != NULL; option++) {
+    if (option->val == 'h')
+      continue;
+    char variable[64] = "SERVER_";
+    int i, length = strlen(variable);
+    for (i = 0; option->name[i] != '\0'; i++)
+      variable[length++] = option->name[i] == '-' ? '_' : toupper(option->name[i]);
+    variable[length] = '\0';
+    const char* value = getenv(variable);
+    if (value != NULL)
+      apply_option(config, &result, option->val, variable, value);
+  }
+
+  // getopt_long only sets index when it matches a long option
+  int flag, index = -1;
+  // the first listener on the command line replaces those of the environment
+  result.listening = false;
+  while ((flag = getopt_long(argc, argv, "l:b:w:c:h", config_options, &index)) != -1) {
+    if (flag == '?' || flag == 'h')
+      usage(argv[0]);
+    char source[64];
+    if (index >= 0)
+      snprintf(source, sizeof(source), "--%s", config_options[index].name);
+    else
+      snprintf(source, sizeof(source), "-%c", flag);
+    apply_option(config, &result, flag, source, optarg);
+    index = -1;
+  }
+  if (optind < argc)
+    usage(argv[0]);
+
+  if (!result.sized)
+    config->nrequests = config->nworkers * 100;
+  if (config->nworkers == 0 || config->nrequests < config->nworkers) {
+    fprintf(stderr, "%s: need at least one worker, and one connection per worker\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (config->backend == IO_BACKEND_URING && config->mode != SERVER_MODE_REACTOR) {
+    fprintf(stderr, "%s: --backend=uring needs --mode=reactor, every worker accepts for itself\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (config->backend == IO_BACKEND_URING && config->ndatagram_listeners > 0) {
+    fprintf(stderr, "%s: udp: listeners need --backend=epoll\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  unsigned int i;
+  for (i = 0; i < config->nlisteners; i++) {
+    if (config->backend == IO_BACKEND_URING && config->listeners[i].tls) {
+      fprintf(stderr, "%s: tls: listeners need --backend=epoll\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  return result;
+}
+
+// the kinds of failure we count, each costs at most one connection or a pause in
+// accepting, and none takes the server down
+enum error_class {
+  // a connection went away, or its network failed, before we accepted it
+  ERROR_ACCEPT_ABORTED,
+  // accept failed for want of file descriptors
+  ERROR_DESCRIPTORS,
+  // accept failed for want of kernel memory
+  ERROR_MEMORY,
+  // accept failed for some other reason
+  ERROR_ACCEPT,
+  // an accepted connection could not be set up for the event loop
+  ERROR_SETUP,
+  // reading from a client failed
+  ERROR_READ,
+  // writing to a client failed
+  ERROR_WRITE,
+  // a handler queued a file which could not be sent
+  ERROR_FILE,
+  // a datagram longer than the buffers we receive into arrived, and was dropped
+  ERROR_TRUNCATED,
+  // a TLS handshake failed
+  ERROR_TLS,
+  // the number of error classes
+  ERROR_CLASSES
+};
+
+// the label each error class is exported with
+static const char* error_class_names[ERROR_CLASSES] =
+  { "accept_aborted", "descriptors", "memory", "accept", "setup", "read", "write", "file", "truncated", "tls" };
+
+// what a worker counts, written only by the worker and read by the admin thread when it
+// is scraped, so recording takes no lock and touches no line another worker writes
+struct metrics {
+  // connections given a slot
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t accepted;
+  // connections closed, for whatever reason
+  _Atomic uint64_t closed;
+  // connections closed because their timer went off
+  _Atomic uint64_t timed_out;
+  // bytes read from clients
+  _Atomic uint64_t bytes_read;
+  // bytes the sockets took from the write queues
+  _Atomic uint64_t bytes_written;
+  // writes sent with MSG_ZEROCOPY
+  _Atomic uint64_t zerocopy_sent;
+  // of those, the ones the kernel copied after all
+  _Atomic uint64_t zerocopy_copied;
+  // datagrams received on the udp listeners, counting each of a coalesced run
+  _Atomic uint64_t datagrams_received;
+  // datagrams sent in reply
+  _Atomic uint64_t datagrams_sent;
+  // TLS handshakes completed
+  _Atomic uint64_t tls_handshakes;
+  // of those, the ones resuming an earlier session from its ticket
+  _Atomic uint64_t tls_resumed;
+  // of those, the ones the kernel took the encryption of what we write over for
+  _Atomic uint64_t tls_offloaded;
+  // failures, by error_class
+  _Atomic uint64_t errors[ERROR_CLASSES];
+  // how many nanoseconds the handler took each time it was handed data
+  struct histogram handler_latency;
+};
+
+// add to a counter only the calling thread writes, so no locked instruction is needed
+void metric_add(_Atomic uint64_t* counter, uint64_t amount) {
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+// the maximum number of events we collect per call to epoll_wait
+#define MAX_EVENTS 64
+
+// what an event of a worker's epoll instance is for, kept in the low bits of its data
+enum event_tag {
+  // a client, whose handle is the data
+  EVENT_CLIENT = 0,
+  // the worker's listening socket whose index makes up the other bits
+  EVENT_LISTENER = 1,
+  // the worker's datagram socket whose index makes up the other bits
+  EVENT_DATAGRAM = 2,
+  // the eventfd of the handoff queue
+  EVENT_HANDOFF = 3,
+  // the worker's wake eventfd
+  EVENT_WAKE = 4
+};
+
+// mask for the tag bits of an event's data
+#define EVENT_TAG_MASK 7
+
+// a reactor thread, with its own listening socket and event loop
+struct worker {
+  // index of the worker, also the CPU it is pinned to
+  unsigned int id;
+  // the thread running the event loop
+  pthread_t thread;
+  // this worker's SO_REUSEPORT socket for each of the config's listeners, the kernel
+  // spreads connections across the workers' sockets for the same address, or for a unix
+  // listener the one socket every worker shares
+  int sockets[MAX_LISTENERS];
+  // the number of sockets, 0 when clients arrive through the handoff queue instead
+  unsigned int nsockets;
+  // the sockets shared with the other workers, which the server owns, one bit each
+  uint32_t shared;
+  // the sockets whose backlogs may hold connections, one bit each
+  uint32_t unaccepted;
+  // this worker's SO_REUSEPORT socket for each of the config's udp listeners
+  struct datagram_socket* datagram_sockets;
+  // the number of datagram_sockets
+  unsigned int ndatagram_sockets;
+  // the datagram sockets which may hold more than we read last time, one bit each
+  uint32_t unread;
+  // what TLS sessions are made from, NULL without tls listeners
+  SSL_CTX* tls;
+  // TLS_RECORD_SIZE bytes gathering small writes into a record, NULL without tls listeners
+  char* tls_scratch;
+  // the queue the acceptor hands us clients on, NULL when we accept for ourselves
+  struct handoff_queue* handoff;
+  // the epoll instance watching the listening socket and every client of this worker
+  int epoll;
+  // the worker's table of connections, indexed by the slot of a handle
+  struct connection* connections;
+  // the cold half of each of the connections, indexed the same
+  struct connection_cold* cold;
+  // the number of slots in the table
+  unsigned int nslots;
+  // stack of indices of connections not holding a client
+  unsigned int* free_slots;
+  // the number of indices on the free_slots stack
+  unsigned int nfree_slots;
+  // whether connections may be waiting in the backlog for a free slot
+  bool accept_pending;
+  // clients which used up their read budget and must be read again without a new edge
+  struct connection** ready;
+  // the number of clients on the ready list
+  unsigned int nready;
+  // whether our epoll instance is watching the listening socket or handoff eventfd
+  bool watching_listener;
+  // what we do with our connections
+  struct handler* handler;
+  // the configuration of the server, copied so the worker owns everything it reads
+  struct config config;
+  // where this worker's client_buffers come from and go back to
+  struct buffer_pool pool;
+  // the worker's io_uring, NULL with the epoll backend
+  struct uring* uring;
+  // the sockets whose multishot accept is armed, one bit each, with the io_uring backend
+  uint32_t accepting;
+  // sockets accepted while we were out of slots, waiting for one, with the io_uring backend
+  int held_sockets[URING_HELD_SOCKETS];
+  // the number of held_sockets
+  unsigned int nheld_sockets;
+  // the timers of every connection this worker owns
+  struct timer_wheel timers;
+  // whether we stopped accepting for a while, having run out of file descriptors or memory
+  bool accept_paused;
+  // goes off once we may accept again
+  struct timer accept_timer;
+  // the number of connections holding one of our slots, only written by the worker
+  _Alignas(CACHE_LINE_SIZE) _Atomic unsigned int active;
+  // the number of our connections which are throttled, only written by the worker
+  _Atomic unsigned int throttled;
+  // what we count for the admin port
+  struct metrics metrics;
+  // eventfd the server writes to once we are to stop accepting and drain
+  int wake;
+  // whether we stopped accepting, and close connections as soon as they are idle
+  bool draining;
+};
+
+// the cold half of a connection
+struct connection_cold* cold_of(struct connection* connection) {
+  return &connection->worker->cold[connection->slot];
+}
+
+// the connection a handle names, NULL once it has let go of its slot
+struct connection* lookup_connection(struct worker* worker, connection_handle handle) {
+  struct connection* connection = &worker->connections[(uint32_t) handle >> 3];
+  if (connection->client_buffer == NULL || connection->generation != (uint32_t) (handle >> 32))
+    return NULL;
+  return connection;
+}
+
+// handle to a servant
+struct server {
+  // a socket for each of the config's listeners which the acceptor listens on, in
+  // SERVER_MODE_ACCEPTOR, or which every worker shares, in SERVER_MODE_REACTOR, where
+  // that is only the unix listeners and the rest are -1
+  int sockets[MAX_LISTENERS];
+  // the number of sockets, the number of listeners
+  unsigned int nsockets;
+  // the configuration of the server
+  struct config config;
+  // the config.nworkers reactors
+  struct worker* workers;
+  // the queue from the acceptor to the workers, NULL in SERVER_MODE_REACTOR
+  struct handoff_queue* handoff;
+  // the thread running the acceptor, in SERVER_MODE_ACCEPTOR
+  pthread_t acceptor;
+  // eventfd telling the acceptor to stop
+  int wake;
+  // failures of the acceptor, by error_class, written only by the acceptor
+  _Atomic uint64_t acceptor_errors[ERROR_CLASSES];
+  // the socket to tell the server we replace that we are up on, -1 unless we are a reload
+  int reload_channel;
+  // what the workers make TLS sessions from, NULL without tls listeners
+  SSL_CTX* tls;
+};
+
+// how loaded a server is
+struct gauges {
+  // connections holding a slot
+  unsigned int active;
+  // connections we stopped reading from until the client takes what we queued for it
+  unsigned int throttled;
+  // workers with every slot taken, which leave new connections to the backlog
+  unsigned int full_workers;
+};
+
+// the gauges of a server, summed over its workers, safe to call from any thread
+struct gauges read_gauges(struct server* server) {
+  struct gauges gauges = { 0, 0, 0 };
+  unsigned int i;
+  for (i = 0; i < server->config.nworkers; i++) {
+    struct worker* worker = &server->workers[i];
+    unsigned int active = atomic_load_explicit(&worker->active, memory_order_relaxed);
+    gauges.active += active;
+    gauges.throttled += atomic_load_explicit(&worker->throttled, memory_order_relaxed);
+    if (active == worker->nslots)
+      gauges.full_workers++;
+  }
+  return gauges;
+}
+
+// queue a copy of data, small writes coalesce into the storage of the one before them
+void connection_write(struct connection* connection, const void* data, size_t length) {
+  struct write_queue* queue = &connection->write_queue;
+  struct buffer_pool* pool = &connection->worker->pool;
+  if (length == 0)
+    return;
+  if (queue->count > 0) {
+    struct write_entry* tail = write_queue_tail(queue);
+    if (tail->block != NULL && tail->size_class != -1
+        && tail->data + tail->length + length <= tail->block + buffer_class_sizes[tail->size_class]) {
+      memcpy(tail->block + (tail->data - tail->block) + tail->length, data, length);
+      tail->length += length;
+      queue->bytes += length;
+      return;
+    }
+  }
+  struct write_entry* entry = write_queue_push(queue, pool);
+  entry->block = pool_acquire_storage(pool, (int) length, &entry->size_class);
+  memcpy(entry->block, data, length);
+  entry->data = entry->block;
+  entry->length = length;
+  queue->bytes += length;
+}
+
+// queue data without copying it, it must stay put until release is called, which may be
+// NULL for data that never goes away
+void connection_write_reference
+  ( // the connection to write to
+    struct connection* connection
+    // the bytes to write
+  , const void* data
+    // how many of them
+  , size_t length
+    // called once the bytes are written or dropped
+  , void (*release)(void* argument)
+    // handed to release
+  , void* argument
+  )
+{
+  struct write_entry* entry = write_queue_push(&connection->write_queue, &connection->worker->pool);
+  entry->data = (const char*) data;
+  entry->length = length;
+  entry->release = release;
+  entry->argument = argument;
+  connection->write_queue.bytes += length;
+}
+
+// queue length bytes of file starting at offset, sent by the kernel without passing through
+// userspace: sendfile for regular files, splice for pipes, which must already hold the bytes
+void connection_send_file
+  ( // the connection to write to
+    struct connection* connection
+    // the file to send from
+  , int file
+    // where in the file to start, ignored for pipes
+  , off_t offset
+    // how many bytes to send
+  , size_t length
+    // called once the bytes are sent or dropped, so the caller can close file
+  , void (*release)(void* argument)
+    // handed to release
+  , void* argument
+  )
+{
+  struct stat status;
+  // a file we cannot look at is one we cannot send either, splicing from it fails when its
+  // turn comes and closes the connection right where it was to go
+  bool known = fstat(file, &status) == 0;
+  if (!known) {
+    metric_add(&connection->worker->metrics.errors[ERROR_FILE], 1);
+    log_warn("failed to inspect file %d to send: %s", file, strerror(errno));
+  }
+  struct write_entry* entry = write_queue_push(&connection->write_queue, &connection->worker->pool);
+  entry->file = file;
+  entry->offset = offset;
+  entry->length = length;
+  entry->splice = !known || !S_ISREG(status.st_mode);
+  entry->release = release;
+  entry->argument = argument;
+  connection->write_queue.bytes += length;
+}
+
+// stop reading from the connection, and close it once everything queued has been written
+void connection_close(struct connection* connection) {
+  connection->closing = true;
+}
+
+// whether the server is shutting down or reloading, so the connection is closed as soon as
+// it is idle, a protocol which can tell the client to go elsewhere should
+bool connection_draining(struct connection* connection) {
+  return connection->worker->draining;
+}
+
+// set an option we can do without, warning when the kernel will not have it
+void set_socket_option(int fd, int level, int name, int value, const char* description) {
+  if (setsockopt(fd, level, name, &value, sizeof(value)) == -1)
+    log_warn("failed to set %s to %d: %s", description, value, strerror(errno));
+}
+
+// let connections accepted on a listening socket send with MSG_ZEROCOPY, without which the
+// kernel ignores the flag and the completions we would wait on never come, so failing that
+// turns zerocopy off
+void allow_zerocopy(int fd, struct config* config) {
+  int enable = 1;
+  if (config->zerocopy_threshold > 0 && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == -1) {
+    log_warn("failed to set SO_ZEROCOPY, copying every write: %s", strerror(errno));
+    config->zerocopy_threshold = 0;
+  }
+}
+
+// apply the config's socket tuning to a listening socket before it listens, since a
+// window scale is only negotiated from the buffer size at the handshake, and accepted
+// connections inherit all of it, so none of it costs a system call per connection
+void tune_listening_socket(int fd, struct config* config, int family) {
+  if (config->receive_buffer > 0)
+    set_socket_option(fd, SOL_SOCKET, SO_RCVBUF, config->receive_buffer, "SO_RCVBUF");
+  if (config->send_buffer > 0)
+    set_socket_option(fd, SOL_SOCKET, SO_SNDBUF, config->send_buffer, "SO_SNDBUF");
+  // the rest is about TCP
+  if (family == AF_UNIX)
+    return;
+  if (config->nodelay)
+    set_socket_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  if (config->defer_accept > 0)
+    set_socket_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, config->defer_accept, "TCP_DEFER_ACCEPT");
+  if (config->fastopen > 0)
+    set_socket_option(fd, IPPROTO_TCP, TCP_FASTOPEN, config->fastopen, "TCP_FASTOPEN");
+  // raising it past net.core.busy_poll takes CAP_NET_ADMIN
+  if (config->busy_poll > 0)
+    set_socket_option(fd, SOL_SOCKET, SO_BUSY_POLL, config->busy_poll, "SO_BUSY_POLL");
+  allow_zerocopy(fd, config);
+}
+
+// remove the file a unix socket left behind when nothing is listening on it any more, so
+// we can bind its path again without stealing it from a server still running
+void remove_stale_socket(struct listen_address* listener) {
+  struct sockaddr_un* address = (struct sockaddr_un*) &listener->address;
+  if (address->sun_path[0] == '\0')
+    return;
+  int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (probe == -1)
+    return;
+  if (connect(probe, (struct sockaddr *) address, listener->length) == -1 && errno == ECONNREFUSED)
+    unlink(address->sun_path);
+  close(probe);
+}
+
+// have the kernel coalesce runs of datagrams from one sender into a single receive, which
+// failing turns off, since coalesced runs only come once the socket asked for them
+void allow_gro(int fd, struct config* config) {
+  int enable = 1;
+  if (config->gro && setsockopt(fd, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == -1) {
+    log_warn("failed to set UDP_GRO, receiving datagrams one by one: %s", strerror(errno));
+    config->gro = false;
+  }
+}
+
+// open a non-blocking UDP socket on listener, sharing its port with the other workers so
+// the kernel spreads senders across them
+int open_datagram_socket(struct config* config, struct listen_address* listener) {
+  int fd, family = listener->address.ss_family;
+  if ((fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+    panic("failed to create datagram socket")
+  int enable = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1)
+    panic("failed to set SO_REUSEPORT")
+  int v6only = config->v6only;
+  if (family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) == -1)
+    panic("failed to set IPV6_V6ONLY")
+  // a burst of datagrams waits in the receive buffer, and what does not fit is dropped
+  if (config->receive_buffer > 0)
+    set_socket_option(fd, SOL_SOCKET, SO_RCVBUF, config->receive_buffer, "SO_RCVBUF");
+  if (config->send_buffer > 0)
+    set_socket_option(fd, SOL_SOCKET, SO_SNDBUF, config->send_buffer, "SO_SNDBUF");
+  allow_gro(fd, config);
+  if (bind(fd, (struct sockaddr *) &listener->address, listener->length) == -1)
+    panic("failed to bind datagram socket")
+  return fd;
+}
+
+// open a non-blocking listening socket on listener, for a TCP listener one which shares
+// its port with the other workers
+int open_listening_socket(struct config* config, struct listen_address* listener) {
+  int fd, family = listener->address.ss_family;
+  // create a new stream socket, non-blocking since the event loop only accepts once the
+  // socket is readable, and must never block doing so
+  if ((fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+    panic("failed to create socket")
+
+  // every worker binds its own socket to the same address, but unix sockets have no
+  // port to share, so there is one the workers take turns at
+  int enable = 1;
+  if (family == AF_UNIX)
+    remove_stale_socket(listener);
+  else if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1)
+    panic("failed to set SO_REUSEPORT")
+
+  // say which we want rather than leaving it to net.ipv6.bindv6only
+  int v6only = config->v6only;
+  if (listener->address.ss_family == AF_INET6 &&
+      setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) == -1)
+    panic("failed to set IPV6_V6ONLY")
+
+  tune_listening_socket(fd, config, family);
+
+  // bind the socket to the address specified in the config
+  if (bind(fd, (struct sockaddr *) &listener->address, listener->length) == -1)
+    panic("failed to bind socket")
+
+  // put the socket into a passive state, accepting peer connections
+  if (listen(fd, config->connection_backlog) == -1)
+    panic("failed to listen on socket")
+
+  return fd;
+}
+
+// the environment variable a reloaded server finds the socket its predecessor hands over
+// the listening sockets on
+#define RELOAD_ENVIRONMENT "SERVER_RELOAD_FD"
+
+// the most listening sockets a reload hands over, the most one message can carry
+#define RELOAD_MAX_SOCKETS 253
+
+// send count sockets over a unix socket
+bool send_sockets(int channel, int* sockets, unsigned int count) {
+  char byte = 0;
+  struct iovec iov = { &byte, 1 };
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE(sizeof(int) * RELOAD_MAX_SOCKETS)];
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.space;
+  message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+  struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+  memcpy(CMSG_DATA(header), sockets, sizeof(int) * count);
+  return sendmsg(channel, &message, 0) == 1;
+}
+
+// receive the sockets send_sockets sent, returning how many there were
+unsigned int receive_sockets(int channel, int* sockets) {
+  char byte;
+  struct iovec iov = { &byte, 1 };
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE(sizeof(int) * RELOAD_MAX_SOCKETS)];
+  } control;
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.space;
+  message.msg_controllen = sizeof(control.space);
+  if (recvmsg(channel, &message, MSG_CMSG_CLOEXEC) != 1)
+    panic("failed to receive listening sockets from the server we replace")
+  struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+  if (header == NULL || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+    return 0;
+  unsigned int count = (unsigned int) ((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+  memcpy(sockets, CMSG_DATA(header), sizeof(int) * count);
+  return count;
+}
+
+// take over the listening sockets of the server we replace, if we are a reload, setting
+// channel to the socket they came on, or -1, and returning how many there are
+unsigned int inherit_sockets(int* sockets, int* channel) {
+  const char* variable = getenv(RELOAD_ENVIRONMENT);
+  *channel = -1;
+  if (variable == NULL)
+    return 0;
+  *channel = atoi(variable);
+  unsetenv(RELOAD_ENVIRONMENT);
+  if (fcntl(*channel, F_SETFD, FD_CLOEXEC) == -1)
+    panic("failed to take the reload channel")
+  return receive_sockets(*channel, sockets);
+}
+
+// a descriptor kept open so that, out of descriptors, we can still accept the connections
+// waiting in a backlog and hang up on them rather than leave them hanging, -1 while some
+// thread is spending it
+_Atomic int spare_descriptor = -1;
+
+// out of descriptors, turn away every connection waiting on socket, whose clients are
+// better off retrying elsewhere than waiting on us to have descriptors again
+void shed_connections(int socket) {
+  int spare = atomic_exchange(&spare_descriptor, -1);
+  if (spare == -1)
+    return;
+  close(spare);
+  unsigned int shed = 0;
+  int fd;
+  while ((fd = accept4(socket, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+    close(fd);
+    shed++;
+  }
+  log_warn("out of file descriptors, turned away %u connections on socket %d", shed, socket);
+  atomic_store(&spare_descriptor, open("/dev/null", O_RDONLY | O_CLOEXEC));
+}
+
+// count an accept on socket failing with error, and say whether to stop accepting for a
+// while, rather than go on with the next connection
+bool accept_failed(int socket, int error, _Atomic uint64_t* errors) {
+  switch (error) {
+    // the connection went away while it waited, or the network under it failed, which is
+    // no reason not to take the next one
+    case ECONNABORTED: case EPROTO: case EPERM: case ENETDOWN: case ENOPROTOOPT:
+    case EHOSTDOWN: case ENONET: case EHOSTUNREACH: case EOPNOTSUPP: case ENETUNREACH:
+      metric_add(&errors[ERROR_ACCEPT_ABORTED], 1);
+      return false;
+    case EMFILE: case ENFILE:
+      metric_add(&errors[ERROR_DESCRIPTORS], 1);
+      shed_connections(socket);
+      return true;
+    case ENOBUFS: case ENOMEM:
+      metric_add(&errors[ERROR_MEMORY], 1);
+      log_warn("out of memory accepting on socket %d, backing off", socket);
+      return true;
+    default:
+      metric_add(&errors[ERROR_ACCEPT], 1);
+      log_error("failed to accept on socket %d, backing off: %s", socket, strerror(error));
+      return true;
+  }
+}
+
+// what came of accepting
+enum accept_status {
+  // there is a new client
+  ACCEPT_CLIENT,
+  // the backlog is empty
+  ACCEPT_DRAINED,
+  // we are out of descriptors or memory, or the socket failed, stop for a while
+  ACCEPT_FAILED
+};
+
+// milliseconds we stop accepting for once accepting failed
+#define ACCEPT_BACKOFF 100
+
+// accept a connection waiting in the backlog of socket, counting failures in errors, in
+// one system call: the socket comes non-blocking and close-on-exec, and with the options
+// tune_listening_socket gave the listening socket
+enum accept_status accept_client(int socket, struct client* client, _Atomic uint64_t* errors) {
+  while (true) {
+    socklen_t client_address_size = (socklen_t) sizeof(client->address);
+    uint64_t started = trace_start(accept, socket);
+    client->socket =
+      accept4(socket, (struct sockaddr *) &client->address, &client_address_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client->socket != -1) {
+      trace_end(accept, TRACE_ACCEPT, started, client->socket);
+      client->accepted_at = started;
+      return ACCEPT_CLIENT;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return ACCEPT_DRAINED;
+    if (errno != EINTR && accept_failed(socket, errno, errors))
+      return ACCEPT_FAILED;
+  }
+}
+
+// change the watch on the worker's index'th listening socket
+void watch_listening_socket(struct worker* worker, unsigned int index, int operation, uint32_t events) {
+  struct epoll_event event;
+  event.events = events;
+  event.data.u64 = (uint64_t) index << 3 | EVENT_LISTENER;
+  // a connection to a socket every worker watches wakes one of them rather than all
+  if ((worker->shared & (1u << index)) && events != 0)
+    event.events |= EPOLLEXCLUSIVE;
+  if (epoll_ctl(worker->epoll, operation, worker->sockets[index], &event) == -1)
+    panic("failed to change listening socket watch")
+}
+
+// the key session tickets are sealed with, laid out as the file it is read from
+struct tls_ticket_key {
+  // names the key in each ticket, so a ticket sealed with another key is told apart
+  unsigned char name[16];
+  // authenticates tickets, with HMAC-SHA256
+  unsigned char hmac[32];
+  // encrypts tickets, with AES-256-CBC
+  unsigned char aes[32];
+};
+
+// seal a new session ticket, or open one a client resumes with, with the ticket key of
+// the SSL_CTX, which OpenSSL calls on the handshaking worker
+int tls_ticket_callback
+  ( SSL* tls
+  , unsigned char name[16]
+  , unsigned char* iv
+  , EVP_CIPHER_CTX* cipher
+  , EVP_MAC_CTX* mac
+  , int sealing
+  )
+{
+  struct tls_ticket_key* key = (struct tls_ticket_key*) SSL_CTX_get_app_data(SSL_get_SSL_CTX(tls));
+  char digest[] = "SHA256";
+  OSSL_PARAM parameters[] =
+    { OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key->hmac, sizeof(key->hmac))
+    , OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0)
+    , OSSL_PARAM_construct_end()
+    };
+  if (sealing) {
+    memcpy(name, key->name, sizeof(key->name));
+    if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1
+        || EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key->aes, iv) != 1
+        || EVP_MAC_CTX_set_params(mac, parameters) != 1)
+      return -1;
+    return 1;
+  }
+  // a ticket from a key we do not have means a full handshake, not a failed one
+  if (memcmp(name, key->name, sizeof(key->name)) != 0)
+    return 0;
+  if (EVP_MAC_CTX_set_params(mac, parameters) != 1
+      || EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key->aes, iv) != 1)
+    return -1;
+  return 1;
+}
+
+// the context every worker makes the TLS sessions of its clients from, one for the whole
+// server so they all present the same certificate and resume each other's sessions
+SSL_CTX* make_tls_context(struct config* config) {
+  if (config->tls_certificate == NULL || config->tls_key == NULL) {
+    fprintf(stderr, "tls listeners need --tls-certificate and --tls-key\n");
+    exit(EXIT_FAILURE);
+  }
+  SSL_CTX* context = SSL_CTX_new(TLS_server_method());
+  if (context == NULL)
+    panic("failed to create TLS context")
+  SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+  // hand the keys to the kernel once the handshake is done, wherever it takes them, and
+  // treat a client going away without close_notify as the end of the stream, as most do
+  SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION);
+  // the write queue retries a write from wherever its front has moved, and may have more
+  SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  // tickets carry the session, so there is no cache for the workers to contend on
+  SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+  if (SSL_CTX_use_certificate_chain_file(context, config->tls_certificate) != 1
+      || SSL_CTX_use_PrivateKey_file(context, config->tls_key, SSL_FILETYPE_PEM) != 1
+      || SSL_CTX_check_private_key(context) != 1) {
+    ERR_print_errors_fp(stderr);
+    fprintf(stderr, "failed to load the certificate %s and key %s\n", config->tls_certificate, config->tls_key);
+    exit(EXIT_FAILURE);
+  }
+  // without a key file, OpenSSL seals tickets with a key of its own, for this server only
+  if (config->tls_ticket_key != NULL) {
+    struct tls_ticket_key* key = (struct tls_ticket_key*) malloc(sizeof(struct tls_ticket_key));
+    FILE* file = fopen(config->tls_ticket_key, "re");
+    bool read = file != NULL && key != NULL && fread(key, 1, sizeof(*key), file) == sizeof(*key);
+    if (file != NULL)
+      fclose(file);
+    if (!read) {
+      fprintf(stderr, "%s should hold %zu random bytes\n", config->tls_ticket_key, sizeof(*key));
+      exit(EXIT_FAILURE);
+    }
+    SSL_CTX_set_app_data(context, key);
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(context, tls_ticket_callback);
+  }
+  return context;
+}
+
+// a socket of type, SOCK_STREAM or SOCK_DGRAM, for listener, one of those the server we
+// replace handed over if it had one there too, taking it out of inherited, or a new one
+int take_listening_socket
+  ( struct config* config
+  , struct listen_address* listener
+  , int type
+  , int* inherited
+  , unsigned int ninherited
+  )
+{
+  unsigned int i;
+  for (i = 0; i < ninherited; i++) {
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    int inherited_type;
+    socklen_t type_length = sizeof(inherited_type);
+    if (inherited[i] == -1 || getsockname(inherited[i], (struct sockaddr*) &address, &length) == -1
+        || getsockopt(inherited[i], SOL_SOCKET, SO_TYPE, &inherited_type, &type_length) == -1)
+      continue;
+    // TCP and UDP sockets bound to the same port have the same address
+    if (inherited_type == type && length == listener->length && memcmp(&address, &listener->address, length) == 0) {
+      int fd = inherited[i];
+      inherited[i] = -1;
+      // the server before us may have run without zerocopy, or without GRO
+      if (type == SOCK_DGRAM)
+        allow_gro(fd, config);
+      else if (address.ss_family != AF_UNIX)
+        allow_zerocopy(fd, config);
+      return fd;
+    }
+  }
+  return type == SOCK_DGRAM ? open_datagram_socket(config, listener) : open_listening_socket(config, listener);
+}
+
+// make a new server
+struct server initialize_server
+  ( // the configuration of the server
+    struct config config
+  ) 
+{
+  struct server server;
+  server.config = config;
+
+  unsigned int i;
+  // a reload carries on with the sockets of the server it replaces, so nothing in their
+  // backlogs is lost
+  int inherited[RELOAD_MAX_SOCKETS];
+  unsigned int ninherited = inherit_sockets(inherited, &server.reload_channel);
+  if ((server.wake = eventfd(0, EFD_CLOEXEC)) == -1)
+    panic("failed to create wake eventfd")
+  for (i = 0; i < ERROR_CLASSES; i++)
+    atomic_init(&server.acceptor_errors[i], 0);
+  if ((spare_descriptor = open("/dev/null", O_RDONLY | O_CLOEXEC)) == -1)
+    panic("failed to open a spare file descriptor")
+
+  // in acceptor mode there is a single listening socket per address, and the workers
+  // share the queue
+  if (config.nlisteners + config.ndatagram_listeners == 0
+      || config.nlisteners > MAX_LISTENERS || config.ndatagram_listeners > MAX_LISTENERS)
+    panic("need at least one address to listen on")
+  server.tls = NULL;
+  for (i = 0; i < config.nlisteners; i++)
+    if (config.listeners[i].tls && server.tls == NULL)
+      server.tls = make_tls_context(&config);
+  for (server.nsockets = 0; server.nsockets < config.nlisteners; server.nsockets++) {
+    struct listen_address* listener = &config.listeners[server.nsockets];
+    server.sockets[server.nsockets] =
+      config.mode == SERVER_MODE_ACCEPTOR || listener->address.ss_family == AF_UNIX
+        ? take_listening_socket(&config, listener, SOCK_STREAM, inherited, ninherited)
+        : -1;
+  }
+  server.handoff = config.mode == SERVER_MODE_ACCEPTOR ? make_handoff_queue(config.nrequests) : NULL;
+
+  // each worker gets an equal share of the slots in a table of its own, so they never share
+  // one, nor a cache line of one
+  unsigned int nslots = config.nrequests / config.nworkers;
+  if (nslots > UINT32_MAX >> 3)
+    panic("too many request slots for a worker")
+  server.workers = (struct worker*) aligned_alloc(CACHE_LINE_SIZE, sizeof(struct worker) * config.nworkers);
+  if (server.workers == NULL)
+    panic("failed to allocate workers")
+  for (i = 0; i < config.nworkers; i++) {
+    struct worker* worker = &server.workers[i];
+    worker->id = i;
+    worker->handoff = server.handoff;
+    worker->nsockets = 0;
+    worker->shared = 0;
+    for (; server.handoff == NULL && worker->nsockets < config.nlisteners; worker->nsockets++) {
+      unsigned int j = worker->nsockets;
+      if (server.sockets[j] != -1)
+        worker->shared |= 1u << j;
+      worker->sockets[j] = server.sockets[j] != -1
+        ? server.sockets[j]
+        : take_listening_socket(&config, &config.listeners[j], SOCK_STREAM, inherited, ninherited);
+    }
+    worker->unaccepted = 0;
+    // the buffers are the worker's to take from its pool once it runs
+    worker->ndatagram_sockets = config.ndatagram_listeners;
+    worker->datagram_sockets = (struct datagram_socket*) malloc(sizeof(struct datagram_socket) * config.ndatagram_listeners);
+    if (worker->datagram_sockets == NULL && config.ndatagram_listeners > 0)
+      panic("failed to allocate datagram sockets")
+    unsigned int j;
+    for (j = 0; j < worker->ndatagram_sockets; j++) {
+      worker->datagram_sockets[j].socket =
+        take_listening_socket(&config, &config.datagram_listeners[j], SOCK_DGRAM, inherited, ninherited);
+      worker->datagram_sockets[j].worker = worker;
+    }
+    worker->unread = 0;
+    worker->tls = server.tls;
+    worker->tls_scratch = server.tls != NULL ? (char*) malloc(TLS_RECORD_SIZE) : NULL;
+    if (server.tls != NULL && worker->tls_scratch == NULL)
+      panic("failed to allocate TLS scratch")
+    if ((worker->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+      panic("failed to create wake eventfd")
+    worker->draining = false;
+    // whole cache lines, so the end of one table is not on the same line as another's start
+    size_t size = (sizeof(struct connection) * nslots + CACHE_LINE_SIZE - 1) & ~((size_t) CACHE_LINE_SIZE - 1);
+    worker->connections = (struct connection*) aligned_alloc(CACHE_LINE_SIZE, size);
+    size = (sizeof(struct connection_cold) * nslots + CACHE_LINE_SIZE - 1) & ~((size_t) CACHE_LINE_SIZE - 1);
+    worker->cold = (struct connection_cold*) aligned_alloc(CACHE_LINE_SIZE, size);
+    if (worker->connections == NULL || worker->cold == NULL)
+      panic("failed to allocate connection table")
+    worker->free_slots = (unsigned int*) malloc(sizeof(unsigned int) * nslots);
+    if (worker->free_slots == NULL)
+      panic("failed to allocate free slots")
+    worker->nslots = nslots;
+    worker->nfree_slots = nslots;
+    atomic_init(&worker->active, 0);
+    atomic_init(&worker->throttled, 0);
+    memset(&worker->metrics, 0, sizeof(worker->metrics));
+    initialize_histogram(&worker->metrics.handler_latency);
+    for (j = 0; j < nslots; j++) {
+      struct connection* connection = &worker->connections[j];
+      connection->client_buffer = NULL;
+      connection->worker = worker;
+      connection->slot = j;
+      connection->generation = 0;
+      connection->ready = false;
+      connection->receiving = false;
+      connection->polling = false;
+      // pop the lowest slots first
+      worker->free_slots[j] = nslots - 1 - j;
+    }
+    worker->accept_pending = false;
+    worker->accept_paused = false;
+    worker->ready = (struct connection**) malloc(sizeof(struct connection*) * nslots);
+    if (worker->ready == NULL)
+      panic("failed to allocate ready list")
+    worker->nready = 0;
+    worker->config = config;
+    initialize_buffer_pool(&worker->pool, config.huge_pages);
+    // the worker sets up its own ring, io_uring wants a single thread submitting to it
+    worker->uring = NULL;
+    worker->accepting = 0;
+    worker->nheld_sockets = 0;
+    worker->watching_listener = false;
+    if (config.backend == IO_BACKEND_URING) {
+      worker->epoll = -1;
+      continue;
+    }
+
+    // every readiness notification for the worker goes through this instance
+    if ((worker->epoll = epoll_create1(EPOLL_CLOEXEC)) == -1)
+      panic("failed to create epoll instance")
+
+    struct epoll_event event;
+    for (j = 0; j < worker->nsockets; j++)
+      watch_listening_socket(worker, j, EPOLL_CTL_ADD, EPOLLIN | EPOLLET);
+    for (j = 0; j < worker->ndatagram_sockets; j++) {
+      event.events = EPOLLIN | EPOLLET;
+      event.data.u64 = (uint64_t) j << 3 | EVENT_DATAGRAM;
+      if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, worker->datagram_sockets[j].socket, &event) == -1)
+        panic("failed to watch datagram socket")
+    }
+    if (worker->handoff != NULL) {
+      // every worker watches the same eventfd, level triggered so no sleeper misses it
+      event.events = EPOLLIN;
+      event.data.u64 = EVENT_HANDOFF;
+      if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, worker->handoff->eventfd, &event) == -1)
+        panic("failed to watch handoff eventfd")
+    }
+    worker->watching_listener = true;
+
+    event.events = EPOLLIN;
+    event.data.u64 = EVENT_WAKE;
+    if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, worker->wake, &event) == -1)
+      panic("failed to watch wake eventfd")
+  }
+  // whatever the server we replace listened on that we have no worker or listener for, we
+  // close, with the same workers and addresses there is none
+  unsigned int nunused = 0;
+  for (i = 0; i < ninherited; i++) {
+    if (inherited[i] != -1) {
+      close(inherited[i]);
+      nunused++;
+    }
+  }
+  if (nunused > 0)
+    log_warn("closed %u listening sockets we have no worker or listener for", nunused);
+
+  return server;
+}
+
+// hang up on a client and give its slot back
+void close_connection
+  ( // the worker owning the client
+    struct worker* worker
+    // the slot the client occupies
+  , struct connection* connection
+  )
+{
+  if (worker->handler->on_close != NULL)
+    worker->handler->on_close(connection);
+  int socket = connection->client_buffer->client.socket;
+  struct connection_cold* cold = cold_of(connection);
+  struct zerocopy* zerocopy = &cold->zerocopy;
+  if (zerocopy->sent != zerocopy->completed)
+    reap_zerocopy(zerocopy, &worker->pool, socket);
+  if (zerocopy->sent != zerocopy->completed) {
+    // the kernel may still be reading what we give back to the pool below, a reset has it
+    // drop every send it holds rather than go on with pages someone else now writes to
+    struct linger linger = { 1, 0 };
+    setsockopt(socket, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  }
+  clear_write_queue(&zerocopy->pinned, &worker->pool);
+  if (connection->tls != NULL) {
+    // close_notify tells the client the stream ended where it should, so only once
+    // everything we queued went out, and without waiting on its own
+    if (!connection->handshaking && connection->write_queue.count == 0)
+      SSL_shutdown(connection->tls);
+    ERR_clear_error();
+    SSL_free(connection->tls);
+    connection->tls = NULL;
+  }
+  clear_write_queue(&connection->write_queue, &worker->pool);
+  timer_cancel(&worker->timers, &cold->timer);
+  if (connection->throttled)
+    atomic_fetch_sub_explicit(&worker->throttled, 1, memory_order_relaxed);
+  // closing the socket also removes it from the epoll instance
+  close(socket);
+  pool_release_client_buffer(connection->client_buffer);
+  connection->client_buffer = NULL;
+  // events still carrying the old handle find nothing, whoever gets the slot next
+  connection->generation++;
+  // a stale entry on the ready list is skipped
+  connection->ready = false;
+  worker->free_slots[worker->nfree_slots++] = connection->slot;
+  atomic_store_explicit(&worker->active, worker->nslots - worker->nfree_slots, memory_order_relaxed);
+  metric_add(&worker->metrics.closed, 1);
+}
+
+// give a client one of the worker's free slots, there must be one
+struct connection* claim_slot(struct worker* worker, struct client client) {
+  unsigned int i = worker->free_slots[--worker->nfree_slots];
+  atomic_store_explicit(&worker->active, worker->nslots - worker->nfree_slots, memory_order_relaxed);
+  metric_add(&worker->metrics.accepted, 1);
+  if (worker->nfree_slots == 0)
+    log_warn("worker %u is out of slots, leaving new connections in the backlog", worker->id);
+  struct connection* connection = &worker->connections[i];
+  struct connection_cold* cold = &worker->cold[i];
+  struct client_buffer* client_buffer =
+    pool_acquire_client_buffer(&worker->pool, client, worker->config.initial_buffer_size);
+  client_buffer->limit = worker->config.read_buffer_limit;
+  connection->client_buffer = client_buffer;
+  connection->user = NULL;
+  initialize_write_queue(&connection->write_queue);
+  // io_uring writes have no error queue we watch, unix sockets cannot send zerocopy, and
+  // what we encrypt is not ours to pin
+  initialize_zerocopy
+    ( &cold->zerocopy
+    , worker->uring == NULL && client.address.any.sa_family != AF_UNIX && !client.tls
+      ? worker->config.zerocopy_threshold : 0);
+  connection->tls = NULL;
+  connection->handshaking = false;
+  connection->ktls_send = false;
+  connection->ktls_receive = false;
+  connection->ready = false;
+  connection->blocked = false;
+  connection->stalled = false;
+  connection->throttled = false;
+  connection->closing = false;
+  connection->receiving = false;
+  connection->cancelling = false;
+  connection->polling = false;
+  initialize_timer(&cold->timer);
+  cold->cancelling_poll = false;
+  cold->active_at = worker->timers.now;
+  cold->written_at = worker->timers.now;
+  connection->partial = false;
+  connection->scanned = 0;
+  if (worker->handler->on_open != NULL)
+    worker->handler->on_open(connection);
+  return connection;
+}
+
+// give a client one of the worker's free slots and start watching it, there must be one
+void add_client(struct worker* worker, struct client client) {
+  struct connection* connection = claim_slot(worker, client);
+  // the handshake is carried on as the socket lets it, starting with the first edge
+  if (client.tls) {
+    connection->tls = SSL_new(worker->tls);
+    if (connection->tls == NULL || SSL_set_fd(connection->tls, client.socket) != 1) {
+      metric_add(&worker->metrics.errors[ERROR_SETUP], 1);
+      log_warn("closing connection %d, failed to set up its TLS session", client.socket);
+      close_connection(worker, connection);
+      return;
+    }
+    SSL_set_accept_state(connection->tls);
+    connection->handshaking = true;
+  }
+
+  // watch the client for data, for room to write and for the peer hanging up, edge
+  // triggered so being writable costs nothing until we actually fill the socket
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.u64 = handle_of(connection) | EVENT_CLIENT;
+  if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, client.socket, &event) == -1) {
+    metric_add(&worker->metrics.errors[ERROR_SETUP], 1);
+    log_warn("closing connection %d, failed to watch it: %s", client.socket, strerror(errno));
+    close_connection(worker, connection);
+  }
+}
+
+// stop accepting for ACCEPT_BACKOFF, the backlogs keep what arrives in the meantime
+void pause_accepting(struct worker* worker) {
+  worker->accept_paused = true;
+  timer_arm(&worker->timers, &worker->accept_timer, worker->timers.now + timer_ticks(ACCEPT_BACKOFF));
+}
+
+// take clients from wherever this worker gets them, as long as we have slots for them
+void accept_clients(struct worker* worker) {
+  struct client client;
+  // a draining worker closed its listening socket
+  if (worker->draining && worker->handoff == NULL)
+    return;
+  unsigned int budget = worker->config.accept_budget;
+  while (worker->nfree_slots > 0) {
+    bool accepted = false;
+    if (worker->handoff != NULL && (accepted = handoff_pop(worker->handoff, &client)))
+      trace_end(queued, TRACE_QUEUED, client.accepted_at, client.socket);
+    // take from the first socket whose backlog may hold connections, until they all drained,
+    // or until we used up our budget and the rest waits for the next turn of the event loop
+    while (!accepted && worker->unaccepted != 0 && !worker->accept_paused) {
+      if (budget-- == 0)
+        return;
+      unsigned int index = __builtin_ctz(worker->unaccepted);
+      enum accept_status status = accept_client(worker->sockets[index], &client, worker->metrics.errors);
+      accepted = status == ACCEPT_CLIENT;
+      client.tls = worker->config.listeners[index].tls;
+      if (status == ACCEPT_DRAINED)
+        worker->unaccepted &= ~(1u << index);
+      if (status == ACCEPT_FAILED)
+        pause_accepting(worker);
+    }
+    // the backlogs or queue are drained, wait to be told there is more
+    if (!accepted) {
+      worker->accept_pending = false;
+      return;
+    }
+    add_client(worker, client);
+  }
+  // out of slots, whatever is left waits for a client to leave
+  worker->accept_pending = true;
+  // we may have swallowed the wakeup meant for a worker that still has room
+  if (worker->handoff != NULL && !handoff_empty(worker->handoff))
+    handoff_signal(worker->handoff);
+}
+
+// whether accept_clients left connections in a backlog for lack of budget, which it must
+// come back for without being told, as the edge that told it about them is spent
+bool accept_backlogged(struct worker* worker) {
+  return worker->unaccepted != 0 && worker->nfree_slots > 0 && !worker->accept_paused && !worker->draining;
+}
+
+// only watch the listening sockets or handoff eventfd while we have room for another
+// client, so a full worker is not woken for connections it cannot take and never
+// consumes a wakeup meant for a worker that can
+void watch_listener(struct worker* worker) {
+  bool watch = worker->nfree_slots > 0 && !worker->accept_paused;
+  if (watch == worker->watching_listener || (worker->draining && worker->handoff == NULL))
+    return;
+  struct epoll_event event;
+  unsigned int i;
+  for (i = 0; i < worker->nsockets; i++) {
+    // rearming an edge triggered watch reports a backlog which filled up in the meantime,
+    // as does adding one back, and an exclusive watch can only be added and deleted
+    int operation = !(worker->shared & (1u << i)) ? EPOLL_CTL_MOD : watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL;
+    watch_listening_socket(worker, i, operation, watch ? EPOLLIN | EPOLLET : 0);
+  }
+  if (worker->handoff != NULL) {
+    event.events = watch ? EPOLLIN : 0;
+    event.data.u64 = EVENT_HANDOFF;
+    if (epoll_ctl(worker->epoll, EPOLL_CTL_MOD, worker->handoff->eventfd, &event) == -1)
+      panic("failed to change handoff eventfd watch")
+  }
+  worker->watching_listener = watch;
+}
+
+// the user_data of the multishot accept on the worker's index'th listening socket
+#define URING_ACCEPT_DATA(index) ((uint64_t) (index) << 3 | URING_ACCEPT)
+
+// arm the multishot accept on the worker's index'th listening socket
+void uring_arm_accept(struct worker* worker, unsigned int index) {
+  struct io_uring_sqe* sqe = uring_sqe(worker->uring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = worker->sockets[index];
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = URING_ACCEPT_DATA(index);
+  worker->accepting |= 1u << index;
+}
+
+// arm the multishot accept on every listening socket it is not armed on
+void uring_arm_accepts(struct worker* worker) {
+  unsigned int i;
+  for (i = 0; i < worker->nsockets; i++)
+    if (!(worker->accepting & (1u << i)))
+      uring_arm_accept(worker, i);
+}
+
+// cancel every armed multishot accept, each stays armed until its last completion
+void uring_cancel_accepts(struct worker* worker) {
+  unsigned int i;
+  for (i = 0; i < worker->nsockets; i++)
+    if (worker->accepting & (1u << i))
+      uring_cancel(worker->uring, URING_ACCEPT_DATA(i));
+}
+
+// arm the multishot recv of a client, picking from the worker's provided buffers
+void uring_arm_recv(struct worker* worker, struct connection* connection) {
+  struct io_uring_sqe* sqe = uring_sqe(worker->uring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = connection->client_buffer->client.socket;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = handle_of(connection) | URING_RECV;
+  connection->receiving = true;
+  connection->cancelling = false;
+}
+
+// arm a one shot poll telling us when a full socket has room again
+void uring_arm_poll(struct worker* worker, struct connection* connection) {
+  struct io_uring_sqe* sqe = uring_sqe(worker->uring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = connection->client_buffer->client.socket;
+  sqe->poll32_events = POLLOUT;
+  sqe->user_data = handle_of(connection) | URING_POLL;
+  connection->polling = true;
+  cold_of(connection)->cancelling_poll = false;
+}
+
+// give an accepted socket a slot and start receiving from it, there must be a free slot
+void uring_add_client(struct worker* worker, int socket) {
+  struct client client;
+  client.socket = socket;
+  // multishot accept has nowhere to put a separate address for each connection
+  memset(&client.address, 0, sizeof(client.address));
+  client.tls = false;
+  uring_arm_recv(worker, claim_slot(worker, client));
+}
+
+// the ACCEPT_BACKOFF after accepting failed is over, see whether it works again
+void resume_accepting(struct worker* worker) {
+  worker->accept_paused = false;
+  if (worker->draining)
+    return;
+  if (worker->uring == NULL) {
+    accept_clients(worker);
+  } else if (worker->nfree_slots > 0) {
+    worker->accept_pending = false;
+    uring_arm_accepts(worker);
+  } else {
+    // once a slot frees up
+    worker->accept_pending = true;
+  }
+}
+
+// a multishot accept completed, res is the new socket
+void uring_accepted(struct worker* worker, struct io_uring_cqe* cqe) {
+  unsigned int index = cqe->user_data >> 3;
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    worker->accepting &= ~(1u << index);
+  if (worker->draining) {
+    // accepted before our cancellation took effect
+    if (cqe->res >= 0)
+      close(cqe->res);
+    return;
+  }
+  if (cqe->res < 0) {
+    // the accept was cancelled because we ran out of slots or stopped accepting, or failed
+    if (cqe->res != -ECANCELED && cqe->res != -EINTR && !worker->accept_paused
+        && accept_failed(worker->sockets[index], -cqe->res, worker->metrics.errors)) {
+      pause_accepting(worker);
+      uring_cancel_accepts(worker);
+    }
+  } else if (worker->nfree_slots > 0) {
+    uring_add_client(worker, cqe->res);
+  } else if (worker->nheld_sockets < URING_HELD_SOCKETS) {
+    // accepted before our cancellation took effect, it waits for a slot
+    worker->held_sockets[worker->nheld_sockets++] = cqe->res;
+  } else {
+    close(cqe->res);
+  }
+  // stop accepting until someone leaves
+  if (worker->nfree_slots == 0 && worker->accepting && !worker->accept_pending) {
+    worker->accept_pending = true;
+    uring_cancel_accepts(worker);
+  }
+  if (!(worker->accepting & (1u << index)) && worker->nfree_slots > 0 && !worker->accept_paused)
+    uring_arm_accept(worker, index);
+}
+
+// a slot opened up, hand it to a held socket or start accepting again
+void uring_slot_freed(struct worker* worker) {
+  if (worker->draining)
+    return;
+  if (worker->nheld_sockets > 0) {
+    uring_add_client(worker, worker->held_sockets[0]);
+    worker->nheld_sockets--;
+    memmove(worker->held_sockets, worker->held_sockets + 1, sizeof(int) * worker->nheld_sockets);
+  } else if (worker->accept_pending && !worker->accept_paused) {
+    worker->accept_pending = false;
+    uring_arm_accepts(worker);
+  }
+}
+
+// close a connection, and fill its slot with whoever is waiting for one
+void end_connection(struct worker* worker, struct connection* connection) {
+  close_connection(worker, connection);
+  if (worker->uring != NULL)
+    uring_slot_freed(worker);
+  else if (worker->accept_pending)
+    // a slot opened up for a connection left waiting in the backlog
+    accept_clients(worker);
+}
+
+// carry the TLS handshake of a connection on as far as the socket lets it, and once it is
+// done see whether the kernel took the keys, false if it failed
+bool continue_handshake(struct worker* worker, struct connection* connection) {
+  ERR_clear_error();
+  int result = SSL_do_handshake(connection->tls);
+  if (result != 1) {
+    int error = SSL_get_error(connection->tls, result);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+      return true;
+    const char* reason = ERR_reason_error_string(ERR_peek_error());
+    metric_add(&worker->metrics.errors[ERROR_TLS], 1);
+    log_debug
+      ( "closing connection %d, its TLS handshake failed: %s", connection->client_buffer->client.socket
+      , reason != NULL ? reason : error == SSL_ERROR_SYSCALL ? strerror(errno) : "closed");
+    return false;
+  }
+  connection->handshaking = false;
+  connection->ktls_send = BIO_get_ktls_send(SSL_get_wbio(connection->tls));
+  connection->ktls_receive = BIO_get_ktls_recv(SSL_get_rbio(connection->tls));
+  metric_add(&worker->metrics.tls_handshakes, 1);
+  if (SSL_session_reused(connection->tls))
+    metric_add(&worker->metrics.tls_resumed, 1);
+  if (connection->ktls_send)
+    metric_add(&worker->metrics.tls_offloaded, 1);
+  return true;
+}
+
+// write what the socket takes of the write queue, and tell the handler once a queue that
+// filled the socket has drained, false if the socket failed
+bool write_connection(struct worker* worker, struct connection* connection) {
+  int socket = connection->client_buffer->client.socket;
+  struct connection_cold* cold = cold_of(connection);
+  struct zerocopy* zerocopy = &cold->zerocopy;
+  if (zerocopy->sent != zerocopy->completed)
+    metric_add(&worker->metrics.zerocopy_copied, reap_zerocopy(zerocopy, &worker->pool, socket));
+  while (true) {
+    size_t queued = connection->write_queue.bytes;
+    uint32_t sent = zerocopy->sent;
+    // flushing an empty queue is not a step worth tracing
+    uint64_t started = queued > 0 ? trace_start(write, socket) : 0;
+    enum write_status status = connection->tls != NULL && !connection->ktls_send
+      ? flush_tls_write_queue(&connection->write_queue, &worker->pool, connection->tls, worker->tls_scratch)
+      : flush_write_queue(&connection->write_queue, &worker->pool, socket, zerocopy);
+    if (queued > 0)
+      trace_end(write, TRACE_WRITE, started, socket);
+    metric_add(&worker->metrics.zerocopy_sent, zerocopy->sent - sent);
+    if (connection->write_queue.bytes < queued) {
+      cold->written_at = worker->timers.now;
+      metric_add(&worker->metrics.bytes_written, queued - connection->write_queue.bytes);
+    }
+    if (status == WRITE_ERROR) {
+      metric_add(&worker->metrics.errors[ERROR_WRITE], 1);
+      return false;
+    }
+    if (status == WRITE_BLOCKED) {
+      connection->blocked = true;
+      return true;
+    }
+    if (!connection->blocked || worker->handler->on_writable == NULL) {
+      connection->blocked = false;
+      return true;
+    }
+    // whatever this queues goes out on the next time around
+    connection->blocked = false;
+    worker->handler->on_writable(connection);
+  }
+}
+
+// hand what a client sent to the handler, cut into batches of frames if it asked for them
+void hand_to_handler(struct worker* worker, struct connection* connection) {
+  struct handler* handler = worker->handler;
+  if (handler->framing == FRAMING_NONE) {
+    handler->on_data(connection);
+    return;
+  }
+  struct client_buffer* client_buffer = connection->client_buffer;
+  struct frame frames[FRAME_BATCH];
+  while (!connection->closing) {
+    const char* data = client_buffer_data(client_buffer);
+    int pending = client_buffer_pending(client_buffer);
+    int offset = 0, count = 0;
+    enum frame_status status = FRAME_READY;
+    while (count < FRAME_BATCH) {
+      int size;
+      status = frame_next
+        ( handler->framing, data + offset, pending - offset, client_buffer->limit
+        , &connection->scanned, &frames[count], &size);
+      if (status != FRAME_READY)
+        break;
+      offset += size;
+      count++;
+    }
+    if (count > 0) {
+      handler->on_frames(connection, frames, count);
+      consume_client_buffer(client_buffer, offset);
+    }
+    if (status == FRAME_TOO_LONG) {
+      log_debug("closing connection %d, it sent a frame too long to buffer", client_buffer->client.socket);
+      connection_close(connection);
+      return;
+    }
+    // a full batch may have more frames behind it
+    if (count < FRAME_BATCH)
+      return;
+  }
+}
+
+// hand_to_handler, timing how long the handler takes
+void deliver_data(struct worker* worker, struct connection* connection) {
+  int socket = connection->client_buffer->client.socket;
+  uint64_t traced = trace_start(handler, socket);
+  uint64_t started = monotonic_nanoseconds();
+  hand_to_handler(worker, connection);
+  histogram_record_shared(&worker->metrics.handler_latency, monotonic_nanoseconds() - started);
+  trace_end(handler, TRACE_HANDLER, traced, socket);
+}
+
+// arm the connection's timer for whichever timeout applies to what it is waiting on: the
+// client taking what we write, finishing the request it started, or sending a new one
+void schedule_timeout(struct worker* worker, struct connection* connection) {
+  // a handshake counts as the start of the first request
+  bool partial = client_buffer_pending(connection->client_buffer) > 0 || connection->handshaking;
+  struct connection_cold* cold = cold_of(connection);
+  if (partial && !connection->partial)
+    cold->request_at = worker->timers.now;
+  connection->partial = partial;
+
+  unsigned int timeout;
+  uint64_t since;
+  // the client has yet to acknowledge what we sent zerocopy, or the kernel would be done
+  if (connection->blocked || cold->zerocopy.pinned.count > 0) {
+    timeout = worker->config.write_timeout;
+    since = cold->written_at;
+  } else if (connection->partial) {
+    timeout = worker->config.header_timeout;
+    since = cold->request_at;
+  } else {
+    timeout = worker->config.idle_timeout;
+    since = cold->active_at;
+  }
+  if (timeout == 0)
+    timer_cancel(&worker->timers, &cold->timer);
+  else
+    timer_arm(&worker->timers, &cold->timer, since + timer_ticks(timeout));
+}
+
+// whether everything queued for a connection was written, and the kernel is done reading
+// whatever of it went out zerocopy
+bool connection_flushed(struct connection* connection) {
+  return connection->write_queue.count == 0 && cold_of(connection)->zerocopy.pinned.count == 0;
+}
+
+// whether a connection is between requests, with nothing read and nothing to write
+bool connection_idle(struct connection* connection) {
+  return client_buffer_pending(connection->client_buffer) == 0 && connection_flushed(connection);
+}
+
+// throttle a connection while more than write_queue_limit bytes wait for the client to
+// take them, so a client which sends but does not read cannot make us queue without end
+void throttle_connection(struct worker* worker, struct connection* connection) {
+  bool throttled = connection->write_queue.bytes > worker->config.write_queue_limit;
+  if (throttled == connection->throttled)
+    return;
+  connection->throttled = throttled;
+  if (throttled)
+    atomic_fetch_add_explicit(&worker->throttled, 1, memory_order_relaxed);
+  else
+    atomic_fetch_sub_explicit(&worker->throttled, 1, memory_order_relaxed);
+}
+
+// read what a client sent, let the handler at it, write what it answered, and put the
+// client on the ready list if it has more for us than its budget allowed
+void service_connection
+  ( // the worker owning the client
+    struct worker* worker
+    // the slot the client occupies
+  , struct connection* connection
+    // whether there may be something to read
+  , bool readable
+  )
+{
+  struct client_buffer* client_buffer = connection->client_buffer;
+  enum read_status status = READ_DRAINED;
+  if (connection->handshaking) {
+    if (!continue_handshake(worker, connection)) {
+      end_connection(worker, connection);
+      return;
+    }
+    if (connection->handshaking) {
+      schedule_timeout(worker, connection);
+      return;
+    }
+    // what the client sent behind its half of the handshake may already sit in the
+    // session, with no edge coming for it
+    readable = true;
+  }
+  // a throttled client gets read once the socket took enough of what we queued
+  if (readable && !connection->closing && connection->throttled) {
+    connection->stalled = true;
+  } else if (readable && !connection->closing) {
+    int count;
+    uint64_t started = trace_start(read, client_buffer->client.socket);
+    status = connection->tls != NULL && !connection->ktls_receive
+      ? tls_read_available(client_buffer, connection->tls, worker->config.read_budget, &count)
+      : read_available(client_buffer, worker->config.read_budget, &count);
+    trace_end(read, TRACE_READ, started, client_buffer->client.socket);
+    if (count > 0) {
+      cold_of(connection)->active_at = worker->timers.now;
+      metric_add(&worker->metrics.bytes_read, count);
+      deliver_data(worker, connection);
+    }
+    if (status == READ_ERROR) {
+      metric_add(&worker->metrics.errors[ERROR_READ], 1);
+      end_connection(worker, connection);
+      return;
+    }
+    // the client is done sending, finish writing whatever it asked for first
+    if (status == READ_CLOSED)
+      connection->closing = true;
+    if (status == READ_FULL)
+      connection->stalled = true;
+  }
+
+  // a draining worker lets clients finish what they started, and nothing more
+  if (!write_connection(worker, connection)
+      || (connection->closing && connection_flushed(connection))
+      || (worker->draining && connection_idle(connection))) {
+    end_connection(worker, connection);
+    return;
+  }
+  throttle_connection(worker, connection);
+
+  // edge triggered, so nobody will tell us about what we left in the socket
+  bool more = status == READ_BUDGET
+    || (connection->stalled && client_buffer_pending(client_buffer) < client_buffer->limit);
+  if (more && !connection->closing && !connection->ready) {
+    // we are owed a writable edge, which brings the client back here
+    if (connection->throttled) {
+      connection->stalled = true;
+      schedule_timeout(worker, connection);
+      return;
+    }
+    connection->stalled = false;
+    connection->ready = true;
+    worker->ready[worker->nready++] = connection;
+  }
+  schedule_timeout(worker, connection);
+}
+
+// give every client on the ready list another turn, clients which come back onto it
+// wait for the next round
+void service_ready_clients(struct worker* worker) {
+  unsigned int nready = worker->nready, i;
+  for (i = 0; i < nready; i++) {
+    struct connection* connection = worker->ready[i];
+    if (!connection->ready)
+      continue;
+    connection->ready = false;
+    service_connection(worker, connection, true);
+  }
+  memmove(worker->ready, worker->ready + nready, sizeof(*worker->ready) * (worker->nready - nready));
+  worker->nready -= nready;
+}
+
+// take the buffers of a worker's datagram sockets from its pool, and point a receive
+// batch at them, called on the worker's own thread
+void prepare_datagram_sockets(struct worker* worker) {
+  // a coalesced run may be as long as the largest datagram
+  int size = worker->config.gro ? DATAGRAM_MAX : worker->config.datagram_size;
+  unsigned int i, j;
+  for (i = 0; i < worker->ndatagram_sockets; i++) {
+    struct datagram_socket* datagram_socket = &worker->datagram_sockets[i];
+    for (j = 0; j < DATAGRAM_BATCH; j++)
+      datagram_socket->buffers[j] = pool_acquire_storage(&worker->pool, size, &datagram_socket->size_class);
+    datagram_socket->buffer_size = buffer_class_sizes[datagram_socket->size_class];
+    datagram_socket->replies = pool_acquire_storage(&worker->pool, DATAGRAM_MAX, &datagram_socket->replies_class);
+    datagram_socket->replied = 0;
+    datagram_socket->nreplies = 0;
+    memset(datagram_socket->messages, 0, sizeof(datagram_socket->messages));
+    memset(datagram_socket->reply_messages, 0, sizeof(datagram_socket->reply_messages));
+    for (j = 0; j < DATAGRAM_BATCH; j++) {
+      datagram_socket->iovecs[j].iov_base = datagram_socket->buffers[j];
+      datagram_socket->messages[j].msg_hdr.msg_iov = &datagram_socket->iovecs[j];
+      datagram_socket->messages[j].msg_hdr.msg_iovlen = 1;
+      datagram_socket->messages[j].msg_hdr.msg_name = &datagram_socket->peers[j];
+      datagram_socket->messages[j].msg_hdr.msg_control = datagram_socket->controls[j].buffer;
+      datagram_socket->reply_messages[j].msg_hdr.msg_iov = &datagram_socket->reply_iovecs[j];
+      datagram_socket->reply_messages[j].msg_hdr.msg_iovlen = 1;
+      datagram_socket->reply_messages[j].msg_hdr.msg_name = &datagram_socket->reply_peers[j];
+    }
+  }
+}
+
+// send the index'th queued reply, a run of segments, one segment at a time
+void send_segments(struct worker* worker, struct datagram_socket* datagram_socket, unsigned int index) {
+  struct msghdr* message = &datagram_socket->reply_messages[index].msg_hdr;
+  const char* data = (const char*) message->msg_iov->iov_base;
+  size_t length = message->msg_iov->iov_len, offset;
+  uint16_t segment = datagram_socket->segments[index];
+  for (offset = 0; offset < length; offset += segment) {
+    size_t size = length - offset < segment ? length - offset : segment;
+    if (sendto(datagram_socket->socket, data + offset, size, 0, message->msg_name, message->msg_namelen) == -1) {
+      log_debug("failed to send a reply: %s", strerror(errno));
+      metric_add(&worker->metrics.errors[ERROR_WRITE], 1);
+      continue;
+    }
+    metric_add(&worker->metrics.bytes_written, size);
+    metric_add(&worker->metrics.datagrams_sent, 1);
+  }
+}
+
+// send the replies the handler queued, in as few system calls as the socket allows, a
+// reply it will not take is dropped as the network might have dropped it
+void send_replies(struct worker* worker, struct datagram_socket* datagram_socket) {
+  unsigned int i;
+  for (i = 0; i < datagram_socket->nreplies; i++) {
+    struct msghdr* message = &datagram_socket->reply_messages[i].msg_hdr;
+    // a run of segments is cut up by the kernel, or the device, past this call
+    if (message->msg_iov->iov_len > datagram_socket->segments[i]) {
+      message->msg_control = datagram_socket->reply_controls[i].buffer;
+      message->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+      struct cmsghdr* header = CMSG_FIRSTHDR(message);
+      header->cmsg_level = SOL_UDP;
+      header->cmsg_type = UDP_SEGMENT;
+      header->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      memcpy(CMSG_DATA(header), &datagram_socket->segments[i], sizeof(uint16_t));
+    } else {
+      message->msg_control = NULL;
+      message->msg_controllen = 0;
+    }
+  }
+  unsigned int sent = 0;
+  while (sent < datagram_socket->nreplies) {
+    int count = sendmmsg
+      (datagram_socket->socket, datagram_socket->reply_messages + sent, datagram_socket->nreplies - sent, 0);
+    if (count == -1 && errno == EINTR)
+      continue;
+    if (count == -1 && datagram_socket->reply_messages[sent].msg_hdr.msg_controllen > 0) {
+      // segments longer than the path takes, or a device which cannot checksum them, have
+      // the kernel refuse the run, so it goes a datagram at a time
+      send_segments(worker, datagram_socket, sent);
+      count = 1;
+    } else if (count == -1) {
+      // the first reply failed, the ones behind it may still go
+      log_debug("failed to send a reply: %s", strerror(errno));
+      metric_add(&worker->metrics.errors[ERROR_WRITE], 1);
+      count = 1;
+    } else {
+      int j;
+      for (j = 0; j < count; j++) {
+        size_t length = datagram_socket->reply_iovecs[sent + j].iov_len;
+        uint16_t segment = datagram_socket->segments[sent + j];
+        metric_add(&worker->metrics.bytes_written, length);
+        metric_add(&worker->metrics.datagrams_sent, (length + segment - 1) / segment);
+      }
+    }
+    sent += count;
+  }
+  datagram_socket->nreplies = 0;
+  datagram_socket->replied = 0;
+}
+
+// queue a reply to whoever sent datagram, which goes out with the others the handler
+// queues for the same batch once it returns
+void datagram_reply
+  ( // the socket the datagram arrived on
+    struct datagram_socket* datagram_socket
+    // the datagram to answer
+  , const struct datagram* datagram
+    // the payload of the reply
+  , const void* data
+    // the length of the payload, at most DATAGRAM_MAX
+  , size_t length
+  )
+{
+  struct worker* worker = datagram_socket->worker;
+  if (length > DATAGRAM_MAX) {
+    log_warn("dropping a reply of %zu bytes, more than a datagram can carry", length);
+    metric_add(&worker->metrics.errors[ERROR_WRITE], 1);
+    return;
+  }
+  if (datagram_socket->replied + length > DATAGRAM_MAX)
+    send_replies(worker, datagram_socket);
+
+  // with gso, a reply the size of the segments of the last one, to the same receiver,
+  // joins it, and one that is shorter ends the run
+  if (worker->config.gso && datagram_socket->nreplies > 0 && length > 0) {
+    unsigned int last = datagram_socket->nreplies - 1;
+    struct msghdr* message = &datagram_socket->reply_messages[last].msg_hdr;
+    size_t run = message->msg_iov->iov_len;
+    uint16_t segment = datagram_socket->segments[last];
+    if (length <= segment && run % segment == 0 && run / segment < DATAGRAM_SEGMENTS
+        && message->msg_namelen == datagram->peer_length
+        && memcmp(message->msg_name, datagram->peer, datagram->peer_length) == 0) {
+      memcpy(datagram_socket->replies + datagram_socket->replied, data, length);
+      datagram_socket->replied += length;
+      message->msg_iov->iov_len += length;
+      return;
+    }
+  }
+
+  if (datagram_socket->nreplies == DATAGRAM_BATCH)
+    send_replies(worker, datagram_socket);
+  unsigned int i = datagram_socket->nreplies++;
+  struct msghdr* message = &datagram_socket->reply_messages[i].msg_hdr;
+  memcpy(&datagram_socket->reply_peers[i], datagram->peer, datagram->peer_length);
+  message->msg_namelen = datagram->peer_length;
+  message->msg_iov->iov_base = datagram_socket->replies + datagram_socket->replied;
+  message->msg_iov->iov_len = length;
+  datagram_socket->segments[i] = length > 0 ? (uint16_t) length : 1;
+  memcpy(datagram_socket->replies + datagram_socket->replied, data, length);
+  datagram_socket->replied += length;
+}
+
+// hand the datagrams of a receive batch to the handler, cutting coalesced runs back into
+// the datagrams they were, and send whatever it replied
+void deliver_datagrams(struct worker* worker, struct datagram_socket* datagram_socket, int count) {
+  struct datagram datagrams[DATAGRAM_BATCH];
+  int ndatagrams = 0, i;
+  uint64_t started = monotonic_nanoseconds();
+  for (i = 0; i < count; i++) {
+    struct msghdr* message = &datagram_socket->messages[i].msg_hdr;
+    int length = (int) datagram_socket->messages[i].msg_len;
+    metric_add(&worker->metrics.bytes_read, length);
+    if (message->msg_flags & MSG_TRUNC) {
+      metric_add(&worker->metrics.errors[ERROR_TRUNCATED], 1);
+      continue;
+    }
+    int segment = length;
+    struct cmsghdr* header;
+    for (header = CMSG_FIRSTHDR(message); header != NULL; header = CMSG_NXTHDR(message, header))
+      if (header->cmsg_level == SOL_UDP && header->cmsg_type == UDP_GRO)
+        memcpy(&segment, CMSG_DATA(header), sizeof(segment));
+    int offset = 0;
+    // an empty datagram is a datagram too
+    do {
+      if (ndatagrams == DATAGRAM_BATCH) {
+        worker->handler->on_datagrams(datagram_socket, datagrams, ndatagrams);
+        ndatagrams = 0;
+      }
+      struct datagram* datagram = &datagrams[ndatagrams++];
+      datagram->data = datagram_socket->buffers[i] + offset;
+      datagram->length = length - offset < segment ? length - offset : segment;
+      datagram->peer = &datagram_socket->peers[i];
+      datagram->peer_length = message->msg_namelen;
+      offset += datagram->length;
+      metric_add(&worker->metrics.datagrams_received, 1);
+    } while (offset < length);
+  }
+  if (ndatagrams > 0)
+    worker->handler->on_datagrams(datagram_socket, datagrams, ndatagrams);
+  histogram_record_shared(&worker->metrics.handler_latency, monotonic_nanoseconds() - started);
+  if (datagram_socket->nreplies > 0)
+    send_replies(worker, datagram_socket);
+}
+
+// receive what is queued on the worker's index'th datagram socket, a batch per system
+// call, until it is empty or we took our read budget, in which case it is marked unread
+// for another turn
+void receive_datagrams(struct worker* worker, unsigned int index) {
+  struct datagram_socket* datagram_socket = &worker->datagram_sockets[index];
+  worker->unread &= ~(1u << index);
+  size_t received = 0;
+  while (datagram_socket->socket != -1) {
+    int i;
+    for (i = 0; i < DATAGRAM_BATCH; i++) {
+      struct msghdr* message = &datagram_socket->messages[i].msg_hdr;
+      message->msg_namelen = sizeof(union peer_address);
+      message->msg_controllen = sizeof(datagram_socket->controls[i].buffer);
+      message->msg_flags = 0;
+      datagram_socket->iovecs[i].iov_len = datagram_socket->buffer_size;
+    }
+    int count = recvmmsg(datagram_socket->socket, datagram_socket->messages, DATAGRAM_BATCH, MSG_DONTWAIT, NULL);
+    if (count == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_warn("failed to receive datagrams: %s", strerror(errno));
+        metric_add(&worker->metrics.errors[ERROR_READ], 1);
+      }
+      return;
+    }
+    deliver_datagrams(worker, datagram_socket, count);
+    for (i = 0; i < count; i++)
+      received += datagram_socket->messages[i].msg_len;
+    // a short batch emptied the socket, and the next datagram brings a new edge
+    if (count < DATAGRAM_BATCH)
+      return;
+    if (received >= (size_t) worker->config.read_budget) {
+      worker->unread |= 1u << index;
+      return;
+    }
+  }
+}
+
+// give every datagram socket left with more to read another turn
+void receive_unread(struct worker* worker) {
+  uint32_t unread = worker->unread;
+  while (unread != 0) {
+    unsigned int index = __builtin_ctz(unread);
+    unread &= ~(1u << index);
+    receive_datagrams(worker, index);
+  }
+}
+
+// move a received buffer into the client's client_buffer, and give the kernel a buffer back
+void uring_take_buffer
+  ( // the worker whose ring the buffer belongs to
+    struct worker* worker
+    // the client the data is for
+  , struct client_buffer* client_buffer
+    // the buffer the kernel picked
+  , unsigned short id
+    // how many bytes it wrote to it
+  , int length
+  )
+{
+  struct uring* ring = worker->uring;
+  if (client_buffer_pending(client_buffer) == 0 && client_buffer->pool == &worker->pool) {
+    // nothing to append to, so swap storage instead of copying: the block the kernel
+    // filled becomes the client's, and the client's old block goes to the pool
+    pool_release_storage(&worker->pool, client_buffer->buffer, client_buffer->size_class);
+    client_buffer->buffer = ring->buffers[id];
+    client_buffer->size = buffer_class_sizes[URING_BUFFER_CLASS];
+    client_buffer->size_class = URING_BUFFER_CLASS;
+    client_buffer->consumed = 0;
+    client_buffer->bytes_read = length;
+    ring->buffers[id] = (char*) pool_take
+      (&worker->pool, &worker->pool.free_blocks[URING_BUFFER_CLASS], buffer_class_sizes[URING_BUFFER_CLASS]);
+  } else {
+    // the data has already arrived, so it goes in even if that takes us over the limit
+    int pending = client_buffer_pending(client_buffer);
+    if (client_buffer->size - client_buffer->bytes_read < length) {
+      if (client_buffer->consumed > 0)
+        compact_client_buffer(client_buffer);
+      if (client_buffer->size - client_buffer->bytes_read < length) {
+        int size = client_buffer->size;
+        while (size < pending + length)
+          size *= 2;
+        resize_client_buffer(client_buffer, size);
+      }
+    }
+    memcpy(client_buffer->buffer + client_buffer->bytes_read, ring->buffers[id], length);
+    client_buffer->bytes_read += length;
+  }
+  uring_provide_buffer(ring, id);
+}
+
+// bring the io_uring requests of a connection in line with what it needs after something
+// happened to it: writes go straight to the socket and only wait on io_uring once it is
+// full, and the slot is only recycled once nothing is in flight for it
+void uring_settle(struct worker* worker, struct connection* connection) {
+  struct client_buffer* client_buffer = connection->client_buffer;
+  if (worker->draining && connection_idle(connection))
+    connection->closing = true;
+  if (!connection->polling) {
+    if (!write_connection(worker, connection)) {
+      clear_write_queue(&connection->write_queue, &worker->pool);
+      connection->closing = true;
+    } else if (connection->blocked) {
+      uring_arm_poll(worker, connection);
+    }
+  }
+
+  if (connection->closing) {
+    // a client which hung up still has to take what it asked for in good time
+    if (connection->write_queue.count > 0) {
+      schedule_timeout(worker, connection);
+      return;
+    }
+    struct connection_cold* cold = cold_of(connection);
+    timer_cancel(&worker->timers, &cold->timer);
+    if (connection->receiving && !connection->cancelling) {
+      connection->cancelling = true;
+      uring_cancel(worker->uring, handle_of(connection) | URING_RECV);
+    }
+    if (connection->polling && !cold->cancelling_poll) {
+      cold->cancelling_poll = true;
+      uring_cancel(worker->uring, handle_of(connection) | URING_POLL);
+    }
+    if (!connection->receiving && !connection->polling)
+      end_connection(worker, connection);
+    return;
+  }
+
+  throttle_connection(worker, connection);
+  if (client_buffer_pending(client_buffer) >= client_buffer->limit || connection->throttled) {
+    // past either high-water mark, stop receiving
+    if (connection->receiving && !connection->cancelling) {
+      connection->cancelling = true;
+      uring_cancel(worker->uring, handle_of(connection) | URING_RECV);
+    }
+  } else if (!connection->receiving) {
+    uring_arm_recv(worker, connection);
+  }
+  schedule_timeout(worker, connection);
+}
+
+// the connection a completion is for, NULL if it is for one which let go of its slot, which
+// a slot only does once nothing is in flight for it
+struct connection* uring_connection(struct worker* worker, struct io_uring_cqe* cqe) {
+  return lookup_connection(worker, cqe->user_data & ~(uint64_t) URING_TAG_MASK);
+}
+
+// a multishot recv completed
+void uring_received(struct worker* worker, struct io_uring_cqe* cqe) {
+  struct connection* connection = uring_connection(worker, cqe);
+  if (connection == NULL) {
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+      uring_provide_buffer(worker->uring, (unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+    return;
+  }
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    connection->receiving = false;
+
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    unsigned short id = (unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    // anything arriving after we decided to close is dropped
+    if (cqe->res > 0 && !connection->closing)
+      uring_take_buffer(worker, connection->client_buffer, id, cqe->res);
+    else
+      uring_provide_buffer(worker->uring, id);
+  }
+
+  if (cqe->res > 0) {
+    cold_of(connection)->active_at = worker->timers.now;
+    metric_add(&worker->metrics.bytes_read, cqe->res);
+    if (!connection->closing)
+      deliver_data(worker, connection);
+  } else if (cqe->res == 0) {
+    // the client is done sending, finish writing whatever it asked for first
+    connection->closing = true;
+  } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+    // the socket failed, nothing we queued is going anywhere
+    metric_add(&worker->metrics.errors[ERROR_READ], 1);
+    clear_write_queue(&connection->write_queue, &worker->pool);
+    connection->closing = true;
+  }
+  // running the kernel out of buffers just means arming again, they are back by then
+  uring_settle(worker, connection);
+}
+
+// a full socket has room again, or our poll was cancelled
+void uring_writable(struct worker* worker, struct io_uring_cqe* cqe) {
+  struct connection* connection = uring_connection(worker, cqe);
+  if (connection == NULL)
+    return;
+  connection->polling = false;
+  uring_settle(worker, connection);
+}
+
+// a connection's timer went off, give up on it and whatever it still had coming
+void connection_timed_out(struct worker* worker, struct connection* connection) {
+  log_debug
+    ( "closing connection %d, it timed out %s", connection->client_buffer->client.socket
+    , connection->blocked ? "writing" : connection->partial ? "mid request" : "idle");
+  metric_add(&worker->metrics.timed_out, 1);
+  if (worker->uring == NULL) {
+    end_connection(worker, connection);
+    return;
+  }
+  clear_write_queue(&connection->write_queue, &worker->pool);
+  connection->closing = true;
+  uring_settle(worker, connection);
+}
+
+// run out every timer of the worker that is due
+void expire_timers(struct worker* worker) {
+  uint64_t tick = timer_wheel_clock(&worker->timers);
+  struct timer* timer;
+  while ((timer = timer_wheel_expire(&worker->timers, tick)) != NULL) {
+    if (timer == &worker->accept_timer)
+      resume_accepting(worker);
+    else {
+      struct connection_cold* cold =
+        (struct connection_cold*) ((char*) timer - offsetof(struct connection_cold, timer));
+      connection_timed_out(worker, &worker->connections[cold - worker->cold]);
+    }
+  }
+}
+
+// arm a poll on the worker's wake eventfd
+void uring_arm_wake(struct worker* worker) {
+  struct io_uring_sqe* sqe = uring_sqe(worker->uring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = worker->wake;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = URING_WAKE;
+}
+
+// stop accepting, and close every connection which is not in the middle of something,
+// the rest are closed as soon as they are idle
+void start_draining(struct worker* worker) {
+  uint64_t count;
+  if (read(worker->wake, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    panic("failed to reset wake eventfd")
+  if (worker->draining)
+    return;
+  worker->draining = true;
+  if (worker->uring != NULL)
+    uring_cancel_accepts(worker);
+  // whatever is in their backlogs is lost, unless a reloaded server holds the sockets too,
+  // the sockets we share are the server's to close, we just stop watching them
+  unsigned int i;
+  for (i = 0; i < worker->nsockets; i++) {
+    if (!(worker->shared & (1u << i)))
+      close(worker->sockets[i]);
+    else if (worker->epoll != -1 && worker->watching_listener)
+      watch_listening_socket(worker, i, EPOLL_CTL_DEL, 0);
+    worker->sockets[i] = -1;
+  }
+  worker->unaccepted = 0;
+  // a reloaded server holding the socket too keeps it in our epoll instance past close
+  for (i = 0; i < worker->ndatagram_sockets; i++) {
+    struct datagram_socket* datagram_socket = &worker->datagram_sockets[i];
+    if (worker->epoll != -1)
+      epoll_ctl(worker->epoll, EPOLL_CTL_DEL, datagram_socket->socket, NULL);
+    close(datagram_socket->socket);
+    datagram_socket->socket = -1;
+  }
+  worker->unread = 0;
+  for (; worker->nheld_sockets > 0; worker->nheld_sockets--)
+    close(worker->held_sockets[worker->nheld_sockets - 1]);
+
+  for (i = 0; i < worker->nslots; i++) {
+    struct connection* connection = &worker->connections[i];
+    if (connection->client_buffer == NULL || !connection_idle(connection))
+      continue;
+    if (worker->uring != NULL) {
+      // the slot is only let go once the kernel is done with it
+      if (!connection->closing) {
+        connection->closing = true;
+        uring_settle(worker, connection);
+      }
+    } else if (!connection->ready) {
+      // a request may be sitting in the socket, closing over it would reset the client
+      service_connection(worker, connection, true);
+    }
+  }
+}
+
+// whether a draining worker has nothing left to finish
+bool worker_drained(struct worker* worker) {
+  return worker->draining && worker->nfree_slots == worker->nslots
+    && (worker->handoff == NULL || handoff_empty(worker->handoff));
+}
+
+// the event loop of a single worker, driven by io_uring completions
+void run_worker_uring(struct worker* worker) {
+  struct uring ring;
+  initialize_uring(&ring, &worker->pool);
+  worker->uring = &ring;
+  uring_arm_accepts(worker);
+  uring_arm_wake(worker);
+
+  while (!worker_drained(worker)) {
+    // one system call submits everything the last batch of completions queued up
+    uring_submit(&ring, 1, timer_wheel_timeout(&worker->timers));
+    expire_timers(worker);
+    unsigned head = *ring.cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned*) ring.cq_tail, memory_order_acquire);
+    for (; head != tail; head++) {
+      struct io_uring_cqe* cqe = &ring.cqes[head & ring.cq_mask];
+      switch (cqe->user_data & URING_TAG_MASK) {
+        case URING_ACCEPT:
+          uring_accepted(worker, cqe);
+          break;
+        case URING_RECV:
+          uring_received(worker, cqe);
+          break;
+        case URING_POLL:
+          uring_writable(worker, cqe);
+          break;
+        case URING_WAKE:
+          start_draining(worker);
+          break;
+        default:
+          break;
+      }
+    }
+    atomic_store_explicit((_Atomic unsigned*) ring.cq_head, head, memory_order_release);
+  }
+  close(ring.fd);
+}
+
+// once the worker is pinned to cpu, take its buffers from the CPU's NUMA node, and have the
+// kernel prefer our sockets over the other workers' for the same address when the CPU is
+// the one that received the connection or datagram, the one servicing that device queue
+void settle_on_cpu(struct worker* worker, int cpu) {
+  unsigned int current, node;
+  if (getcpu(&current, &node) == 0 && current == (unsigned int) cpu)
+    worker->pool.node = (int) node;
+  unsigned int i;
+  for (i = 0; i < worker->nsockets; i++)
+    if (!(worker->shared & (1u << i)))
+      setsockopt(worker->sockets[i], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+  for (i = 0; i < worker->ndatagram_sockets; i++)
+    setsockopt(worker->datagram_sockets[i].socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+}
+
+// the event loop of a single worker
+void* run_worker(void* argument) {
+  struct worker* worker = (struct worker*) argument;
+
+  // pin to the id'th of the CPUs we were started on, not of the whole machine's
+  cpu_set_t allowed;
+  if (worker->config.pin_workers && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    int cpu, nth = worker->id % CPU_COUNT(&allowed);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, &allowed) && nth-- == 0)
+        break;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    // not fatal, we would just rather stay put
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+      log_warn("failed to pin worker %u", worker->id);
+    else
+      settle_on_cpu(worker, cpu);
+  }
+
+  initialize_timer_wheel(&worker->timers);
+  initialize_timer(&worker->accept_timer);
+  if (worker->config.backend == IO_BACKEND_URING) {
+    run_worker_uring(worker);
+    return NULL;
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  prepare_datagram_sockets(worker);
+  // sleep until the listening socket or some client has something for us
+  while (!worker_drained(worker)) {
+    watch_listener(worker);
+    // clients or datagram sockets with more to read, or backlogs with more to accept,
+    // mean we only poll and come straight back
+    bool busy = worker->nready > 0 || worker->unread != 0 || accept_backlogged(worker);
+    // a full worker leaves handed off clients to the others, so it does not count as a sleeper
+    bool sleeping = !busy && worker->handoff != NULL && worker->nfree_slots > 0;
+    if (sleeping && !handoff_sleep(worker->handoff)) {
+      accept_clients(worker);
+      continue;
+    }
+    int nevents = epoll_wait(worker->epoll, events, MAX_EVENTS, busy ? 0 : timer_wheel_timeout(&worker->timers));
+    if (sleeping)
+      handoff_wake(worker->handoff);
+    expire_timers(worker);
+    if (nevents == -1) {
+      if (errno == EINTR)
+        continue;
+      panic("failed to wait for events")
+    }
+    int i;
+    for (i = 0; i < nevents; i++) {
+      uint64_t data = events[i].data.u64;
+      switch (data & EVENT_TAG_MASK) {
+        case EVENT_LISTENER:
+          worker->unaccepted |= 1u << (data >> 3);
+          accept_clients(worker);
+          continue;
+        case EVENT_DATAGRAM:
+          receive_datagrams(worker, data >> 3);
+          continue;
+        case EVENT_HANDOFF:
+          handoff_reset(worker->handoff);
+          accept_clients(worker);
+          continue;
+        case EVENT_WAKE:
+          start_draining(worker);
+          continue;
+        default:
+          break;
+      }
+      // closed earlier in this batch, by a timer or by draining, maybe with its slot taken
+      // by a client accepted since
+      struct connection* connection = lookup_connection(worker, data);
+      if (connection == NULL)
+        continue;
+      // hang ups and errors show up as the read failing, after whatever arrived before them,
+      // though with zerocopy an error may just be the kernel telling us it is done with a send
+      if ((events[i].events & (EPOLLRDHUP | EPOLLHUP))
+          || ((events[i].events & EPOLLERR) && cold_of(connection)->zerocopy.threshold == 0))
+        connection->client_buffer->hung_up = true;
+      // clients on the ready list get read in their turn, but may still write now
+      bool readable = events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+      service_connection(worker, connection, readable && !connection->ready);
+    }
+    service_ready_clients(worker);
+    receive_unread(worker);
+    if (accept_backlogged(worker))
+      accept_clients(worker);
+  }
+  close(worker->epoll);
+  return NULL;
+}
+
+// accept connections on the server's sockets and hand them to the workers, until the
+// server's wake eventfd tells us to stop
+void* run_acceptor(void* argument) {
+  struct server* server = (struct server*) argument;
+  int epoll;
+  if ((epoll = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    panic("failed to create epoll instance")
+  struct epoll_event event;
+  unsigned int i;
+  for (i = 0; i < server->nsockets; i++) {
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &server->sockets[i];
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, server->sockets[i], &event) == -1)
+      panic("failed to watch listening socket")
+  }
+  event.events = EPOLLIN;
+  event.data.ptr = &server->wake;
+  if (epoll_ctl(epoll, EPOLL_CTL_ADD, server->wake, &event) == -1)
+    panic("failed to watch wake eventfd")
+
+  // a client we accepted but could not hand off yet
+  struct client client;
+  bool holding = false;
+  // the sockets whose backlogs may hold connections, one bit each
+  uint32_t unaccepted = 0;
+  // when we may accept again after accepting failed
+  uint64_t resume_at = 0;
+  struct epoll_event events[MAX_LISTENERS + 1];
+  while (true) {
+    // with the queue full, check back shortly rather than waiting for the next connection,
+    // and backing off, once we may accept again
+    uint64_t now = monotonic_milliseconds();
+    int timeout = holding ? 1 : unaccepted != 0 && now < resume_at ? (int) (resume_at - now) : -1;
+    int nevents = epoll_wait(epoll, events, MAX_LISTENERS + 1, timeout);
+    if (nevents == -1 && errno != EINTR)
+      panic("failed to wait for events")
+    int j;
+    for (j = 0; j < nevents; j++) {
+      if (events[j].data.ptr != &server->wake) {
+        unaccepted |= 1u << ((int*) events[j].data.ptr - server->sockets);
+        continue;
+      }
+      if (holding)
+        close(client.socket);
+      for (i = 0; i < server->nsockets; i++)
+        close(server->sockets[i]);
+      close(epoll);
+      return NULL;
+    }
+    bool backing_off = monotonic_milliseconds() < resume_at;
+    while (holding || (unaccepted != 0 && !backing_off)) {
+      if (!holding) {
+        unsigned int index = __builtin_ctz(unaccepted);
+        enum accept_status status = accept_client(server->sockets[index], &client, server->acceptor_errors);
+        client.tls = server->config.listeners[index].tls;
+        if (status == ACCEPT_DRAINED)
+          unaccepted &= ~(1u << index);
+        if (status == ACCEPT_FAILED) {
+          resume_at = monotonic_milliseconds() + ACCEPT_BACKOFF;
+          backing_off = true;
+        }
+        if (status != ACCEPT_CLIENT)
+          continue;
+      }
+      holding = !handoff_push(server->handoff, client);
+      if (holding)
+        break;
+    }
+  }
+}
+
+// the upper bounds of the handler latency buckets we export, in nanoseconds
+static const uint64_t handler_latency_buckets[] =
+  { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000
+  , 1000000, 2500000, 5000000, 10000000, 100000000, 1000000000 };
+
+// write one metric in the Prometheus text format
+void write_metric(FILE* out, const char* name, const char* type, const char* help, uint64_t value) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name, type, name, value);
+}
+
+// write the metrics of every worker, merged, in the Prometheus text format
+void write_metrics(struct server* server, FILE* out) {
+  uint64_t accepted = 0, closed = 0, timed_out = 0, bytes_read = 0, bytes_written = 0;
+  uint64_t zerocopy_sent = 0, zerocopy_copied = 0, datagrams_received = 0, datagrams_sent = 0;
+  uint64_t tls_handshakes = 0, tls_resumed = 0, tls_offloaded = 0;
+  uint64_t errors[ERROR_CLASSES];
+  unsigned int class;
+  for (class = 0; class < ERROR_CLASSES; class++)
+    errors[class] = atomic_load_explicit(&server->acceptor_errors[class], memory_order_relaxed);
+  struct histogram* latency = (struct histogram*) malloc(sizeof(struct histogram));
+  if (latency == NULL)
+    panic("failed to allocate histogram")
+  initialize_histogram(latency);
+  unsigned int i;
+  for (i = 0; i < server->config.nworkers; i++) {
+    struct metrics* metrics = &server->workers[i].metrics;
+    accepted += atomic_load_explicit(&metrics->accepted, memory_order_relaxed);
+    closed += atomic_load_explicit(&metrics->closed, memory_order_relaxed);
+    timed_out += atomic_load_explicit(&metrics->timed_out, memory_order_relaxed);
+    bytes_read += atomic_load_explicit(&metrics->bytes_read, memory_order_relaxed);
+    bytes_written += atomic_load_explicit(&metrics->bytes_written, memory_order_relaxed);
+    zerocopy_sent += atomic_load_explicit(&metrics->zerocopy_sent, memory_order_relaxed);
+    zerocopy_copied += atomic_load_explicit(&metrics->zerocopy_copied, memory_order_relaxed);
+    datagrams_received += atomic_load_explicit(&metrics->datagrams_received, memory_order_relaxed);
+    datagrams_sent += atomic_load_explicit(&metrics->datagrams_sent, memory_order_relaxed);
+    tls_handshakes += atomic_load_explicit(&metrics->tls_handshakes, memory_order_relaxed);
+    tls_resumed += atomic_load_explicit(&metrics->tls_resumed, memory_order_relaxed);
+    tls_offloaded += atomic_load_explicit(&metrics->tls_offloaded, memory_order_relaxed);
+    for (class = 0; class < ERROR_CLASSES; class++)
+      errors[class] += atomic_load_explicit(&metrics->errors[class], memory_order_relaxed);
+    histogram_merge_shared(latency, &metrics->handler_latency);
+  }
+  struct gauges gauges = read_gauges(server);
+
+  write_metric(out, "server_connections_accepted_total", "counter", "Connections given a slot.", accepted);
+  write_metric(out, "server_connections_closed_total", "counter", "Connections closed.", closed);
+  write_metric(out, "server_connections_timed_out_total", "counter", "Connections closed by a timeout.", timed_out);
+  write_metric(out, "server_read_bytes_total", "counter", "Bytes read from clients.", bytes_read);
+  write_metric(out, "server_written_bytes_total", "counter", "Bytes written to clients.", bytes_written);
+  write_metric(out, "server_zerocopy_sends_total", "counter", "Writes sent with MSG_ZEROCOPY.", zerocopy_sent);
+  write_metric
+    ( out, "server_zerocopy_copied_total", "counter", "Writes sent with MSG_ZEROCOPY the kernel copied after all."
+    , zerocopy_copied);
+  write_metric
+    (out, "server_datagrams_received_total", "counter", "Datagrams received on the udp listeners.", datagrams_received);
+  write_metric(out, "server_datagrams_sent_total", "counter", "Datagrams sent in reply.", datagrams_sent);
+  write_metric(out, "server_tls_handshakes_total", "counter", "TLS handshakes completed.", tls_handshakes);
+  write_metric(out, "server_tls_resumed_total", "counter", "TLS handshakes resuming a session.", tls_resumed);
+  write_metric
+    (out, "server_tls_offloaded_total", "counter", "TLS connections the kernel encrypts for.", tls_offloaded);
+  write_metric(out, "server_connections_active", "gauge", "Connections holding a slot.", gauges.active);
+  write_metric
+    (out, "server_connections_throttled", "gauge", "Connections not read until they take what we wrote.", gauges.throttled);
+  write_metric(out, "server_workers_full", "gauge", "Workers leaving new connections in the backlog.", gauges.full_workers);
+  fprintf
+    ( out, "# HELP server_errors_total Failures, each costing a connection or a pause in accepting.\n"
+      "# TYPE server_errors_total counter\n");
+  for (class = 0; class < ERROR_CLASSES; class++)
+    fprintf(out, "server_errors_total{class=\"%s\"} %lu\n", error_class_names[class], errors[class]);
+
+  fprintf
+    ( out, "# HELP server_handler_seconds Time the handler took with what arrived.\n"
+      "# TYPE server_handler_seconds histogram\n");
+  size_t bucket;
+  int index = 0;
+  uint64_t below = 0;
+  for (bucket = 0; bucket < sizeof(handler_latency_buckets) / sizeof(handler_latency_buckets[0]); bucket++) {
+    for (; index < HISTOGRAM_COUNTERS && histogram_value(index) <= handler_latency_buckets[bucket]; index++)
+      below += latency->counts[index];
+    fprintf(out, "server_handler_seconds_bucket{le=\"%g\"} %lu\n", handler_latency_buckets[bucket] / 1e9, below);
+  }
+  fprintf(out, "server_handler_seconds_bucket{le=\"+Inf\"} %lu\n", latency->total);
+  fprintf(out, "server_handler_seconds_sum %.9f\n", latency->sum / 1e9);
+  fprintf(out, "server_handler_seconds_count %lu\n", latency->total);
+  free(latency);
+}
+
+// the longest we wait on a scraper to send its request, in seconds
+#define ADMIN_TIMEOUT 1
+
+// answer every connection to the admin port with the metrics, or what the trace rings
+// hold for GET /trace, one at a time, so scraping never touches the workers' event loops
+void* run_admin(void* argument) {
+  struct server* server = (struct server*) argument;
+  // on the address of the first TCP listener, or loopback when there are only unix ones
+  struct listen_address loopback;
+  parse_listen_address("127.0.0.1:0", &loopback);
+  struct listen_address* listener = &loopback;
+  unsigned int i;
+  for (i = server->config.nlisteners; i > 0; i--)
+    if (server->config.listeners[i - 1].address.ss_family != AF_UNIX)
+      listener = &server->config.listeners[i - 1];
+  int fd;
+  if ((fd = socket(listener->address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+    panic("failed to create admin socket")
+  int enable = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1)
+    panic("failed to set SO_REUSEADDR")
+  // a reloaded server binds it while we are still draining
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1)
+    panic("failed to set SO_REUSEPORT")
+  struct sockaddr_storage address = listener->address;
+  if (address.ss_family == AF_INET6)
+    ((struct sockaddr_in6*) &address)->sin6_port = htons(server->config.admin_port);
+  else
+    ((struct sockaddr_in*) &address)->sin_port = htons(server->config.admin_port);
+  if (bind(fd, (struct sockaddr *) &address, listener->length) == -1)
+    panic("failed to bind admin socket")
+  if (listen(fd, 16) == -1)
+    panic("failed to listen on admin socket")
+
+  while (true) {
+    int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client == -1) {
+      log_warn("failed to accept on the admin port: %s", strerror(errno));
+      continue;
+    }
+    struct timeval timeout = { ADMIN_TIMEOUT, 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    // whatever else was asked for, up to the end of its head, gets the metrics
+    char request[4096];
+    size_t received = 0;
+    while (received < sizeof(request) - 1) {
+      ssize_t length = read(client, request + received, sizeof(request) - 1 - received);
+      if (length <= 0)
+        break;
+      received += length;
+      request[received] = '\0';
+      if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+        break;
+    }
+
+    bool trace = received >= 11 && strncmp(request, "GET /trace", 10) == 0
+      && (request[10] == ' ' || request[10] == '?');
+    char* body;
+    size_t body_length;
+    FILE* out = open_memstream(&body, &body_length);
+    if (out == NULL) {
+      log_warn("failed to open metrics stream: %s", strerror(errno));
+      close(client);
+      continue;
+    }
+    const char* status = "200 OK";
+    const char* type = "text/plain; version=0.0.4";
+    if (!trace) {
+      write_metrics(server, out);
+    } else if (!tracing) {
+      status = "404 Not Found";
+      type = "text/plain";
+      fprintf(out, "not tracing, start the server with --trace\n");
+    } else {
+      type = "application/json";
+      write_trace(out);
+    }
+    fclose(out);
+    char head[160];
+    int head_length = snprintf
+      ( head, sizeof(head)
+      , "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n"
+      , status, type, body_length);
+    struct iovec iov[2] = { { head, (size_t) head_length }, { body, body_length } };
+    if (writev(client, iov, 2) == -1)
+      log_debug("failed to send metrics: %s", strerror(errno));
+    free(body);
+    close(client);
+  }
+  return NULL;
+}
+
+// start serving metrics on the admin port, if there is one
+void start_admin(struct server* server) {
+  if (server->config.admin_port == 0)
+    return;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, run_admin, server) != 0)
+    panic("failed to start admin thread")
+  pthread_detach(thread);
+}
+
+// how long we give a reloaded server to come up, in milliseconds
+#define RELOAD_TIMEOUT 10000
+
+// the most arguments we pass on to a reloaded server
+#define RELOAD_MAX_ARGUMENTS 256
+
+// start a fresh copy of the server, from whatever binary is now where ours was, and hand
+// it our listening sockets, true once it says it is serving
+bool reload(struct server* server) {
+  // a child of a threaded process may only make async-signal-safe calls, so everything it
+  // needs to exec is put together first
+  char path[PATH_MAX];
+  ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if (length == -1) {
+    log_error("failed to find our own binary: %s", strerror(errno));
+    return false;
+  }
+  path[length] = '\0';
+  // a deploy replaced the binary, which is what we want to run
+  const char* deleted = " (deleted)";
+  if ((size_t) length > strlen(deleted) && strcmp(path + length - strlen(deleted), deleted) == 0)
+    path[length - strlen(deleted)] = '\0';
+
+  static char command_line[1 << 16];
+  char* arguments[RELOAD_MAX_ARGUMENTS + 1];
+  int fd = open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+  ssize_t size = fd == -1 ? -1 : read(fd, command_line, sizeof(command_line) - 1);
+  if (fd != -1)
+    close(fd);
+  if (size <= 0) {
+    log_error("failed to read our own command line");
+    return false;
+  }
+  command_line[size] = '\0';
+  int narguments = 0;
+  char* argument;
+  for (argument = command_line; argument < command_line + size && narguments < RELOAD_MAX_ARGUMENTS;
+       argument += strlen(argument) + 1)
+    arguments[narguments++] = argument;
+  arguments[narguments] = NULL;
+
+  int channel[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel) == -1) {
+    log_error("failed to create reload channel: %s", strerror(errno));
+    return false;
+  }
+  extern char** environ;
+  size_t nenvironment = 0;
+  while (environ[nenvironment] != NULL)
+    nenvironment++;
+  char** environment = (char**) malloc(sizeof(char*) * (nenvironment + 2));
+  if (environment == NULL)
+    panic("failed to allocate environment")
+  char variable[64];
+  snprintf(variable, sizeof(variable), "%s=%d", RELOAD_ENVIRONMENT, channel[1]);
+  size_t i, n = 0;
+  for (i = 0; i < nenvironment; i++)
+    if (strncmp(environ[i], RELOAD_ENVIRONMENT "=", strlen(RELOAD_ENVIRONMENT) + 1) != 0)
+      environment[n++] = environ[i];
+  environment[n++] = variable;
+  environment[n] = NULL;
+
+  pid_t child = fork();
+  if (child == 0) {
+    // nothing of ours but the reload channel goes along, the signals we handle stay
+    // blocked until the new server is ready to handle them itself
+    syscall(SYS_close_range, 3, ~0U, CLOSE_RANGE_CLOEXEC);
+    fcntl(channel[1], F_SETFD, 0);
+    execve(path, arguments, environment);
+    _exit(127);
+  }
+  free(environment);
+  close(channel[1]);
+  if (child == -1) {
+    log_error("failed to fork: %s", strerror(errno));
+    close(channel[0]);
+    return false;
+  }
+
+  int sockets[RELOAD_MAX_SOCKETS];
+  unsigned int nsockets = 0;
+  for (i = 0; i < server->nsockets; i++)
+    if (server->sockets[i] != -1)
+      sockets[nsockets++] = server->sockets[i];
+  // the new server finds each its place by the address it is bound to
+  for (i = 0; i < server->config.nworkers; i++) {
+    unsigned int j;
+    for (j = 0; j < server->workers[i].nsockets && nsockets < RELOAD_MAX_SOCKETS; j++)
+      if (!(server->workers[i].shared & (1u << j)))
+        sockets[nsockets++] = server->workers[i].sockets[j];
+    for (j = 0; j < server->workers[i].ndatagram_sockets && nsockets < RELOAD_MAX_SOCKETS; j++)
+      sockets[nsockets++] = server->workers[i].datagram_sockets[j].socket;
+  }
+  struct pollfd ready = { channel[0], POLLIN, 0 };
+  char byte;
+  bool up = send_sockets(channel[0], sockets, nsockets)
+    && poll(&ready, 1, RELOAD_TIMEOUT) == 1 && read(channel[0], &byte, 1) == 1;
+  close(channel[0]);
+  if (!up) {
+    log_error("the new server did not come up, carrying on");
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    return false;
+  }
+  log_info("reloaded as process %d, draining", (int) child);
+  return true;
+}
+
+// stop accepting, give the connections we have drain_timeout to finish, and exit, once
+// replaced by a reloaded server or not
+void drain(struct server* server, bool replaced) {
+  uint64_t one = 1;
+  // with nobody taking over the files of our unix sockets go, and clients connecting to
+  // their paths are turned away from now on rather than left in the backlog
+  unsigned int i;
+  for (i = 0; !replaced && i < server->config.nlisteners; i++) {
+    struct sockaddr_un* address = (struct sockaddr_un*) &server->config.listeners[i].address;
+    if (address->sun_family == AF_UNIX && address->sun_path[0] != '\0')
+      unlink(address->sun_path);
+  }
+  // clients stop arriving before the workers start waiting to be empty
+  if (server->handoff != NULL) {
+    if (write(server->wake, &one, sizeof(one)) == -1)
+      panic("failed to stop acceptor")
+    pthread_join(server->acceptor, NULL);
+  }
+  for (i = 0; i < server->config.nworkers; i++)
+    if (write(server->workers[i].wake, &one, sizeof(one)) == -1)
+      panic("failed to wake worker")
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += server->config.drain_timeout / 1000;
+  deadline.tv_nsec += (long) (server->config.drain_timeout % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  for (i = 0; i < server->config.nworkers; i++) {
+    if (pthread_timedjoin_np(server->workers[i].thread, NULL, &deadline) != 0) {
+      log_warn
+        ( "giving up on %u connections still open after %u milliseconds"
+        , read_gauges(server).active, server->config.drain_timeout);
+      break;
+    }
+  }
+  log_info("drained, exiting");
+  log_flush();
+  exit(EXIT_SUCCESS);
+}
+
+// handle the signals, which every other thread blocks: SIGTERM and SIGINT drain and exit,
+// SIGHUP starts a new server on our sockets and then drains and exits
+void supervise(struct server* server, sigset_t* signals) {
+  while (true) {
+    int received;
+    if (sigwait(signals, &received) != 0)
+      panic("failed to wait for signals")
+    if (received == SIGHUP) {
+      log_info("reloading");
+      if (!reload(server))
+        continue;
+    } else {
+      log_info("draining");
+    }
+    drain(server, received == SIGHUP);
+  }
+}
+
+// running a server
+void run_server
+  ( // what to do with the connections
+    struct handler* handler,
+    // server handle
+    struct server server
+  )
+{
+  if (handler->framing == FRAMING_NONE ? handler->on_data == NULL : handler->on_frames == NULL)
+    panic("a handler needs on_data, or on_frames when it asks for framing")
+  if (server.config.ndatagram_listeners > 0 && handler->on_datagrams == NULL)
+    panic("udp listeners need a handler with on_datagrams")
+  // a client hanging up mid write is its business, not a reason for us to die
+  signal(SIGPIPE, SIG_IGN);
+  // every thread we start inherits the mask, so only supervise sees these
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGHUP);
+  if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0)
+    panic("failed to block signals")
+  select_newline_scanner();
+  start_logger();
+  if (server.config.trace)
+    start_tracing();
+  start_admin(&server);
+
+  unsigned int i;
+  // one event loop per worker, they share nothing but the port
+  for (i = 0; i < server.config.nworkers; i++) {
+    server.workers[i].handler = handler;
+    if (pthread_create(&server.workers[i].thread, NULL, run_worker, &server.workers[i]) != 0)
+      panic("failed to start worker")
+  }
+  if (server.handoff != NULL && pthread_create(&server.acceptor, NULL, run_acceptor, &server) != 0)
+    panic("failed to start acceptor")
+  // we are up, the server we replace can start draining
+  if (server.reload_channel != -1) {
+    char byte = 1;
+    if (write(server.reload_channel, &byte, 1) != 1)
+      log_warn("failed to tell the server we replace that we are up");
+    close(server.reload_channel);
+  }
+  supervise(&server, &signals);
+}
+
+// handling an individual client, by saying how much it sent and sending it straight back
+void handle_client(struct connection* connection)
+{
+  struct client_buffer* client_buffer = connection->client_buffer;
+  int read = client_buffer_pending(client_buffer);
+  log_debug("received %d bytes", read);
+  connection_write(connection, client_buffer_data(client_buffer), read);
+  consume_client_buffer(client_buffer, read);
+}
+
+// answering each datagram with itself
+void handle_datagrams(struct datagram_socket* socket, const struct datagram* datagrams, int count) {
+  int i;
+  for (i = 0; i < count; i++)
+    datagram_reply(socket, &datagrams[i], datagrams[i].data, datagrams[i].length);
+}
+
+// the demo handler, an echo server
+struct handler echo_handler = { NULL, handle_client, NULL, NULL, NULL, FRAMING_NONE, NULL, handle_datagrams };
+
+// a header of an http_request
+struct http_header {
+  // the field name, in whatever case the client sent it
+  const char* name;
+  int name_length;
+  // the field value, without surrounding whitespace
+  const char* value;
+  int value_length;
+};
+
+// the most headers a request may carry
+#define HTTP_MAX_HEADERS 32
+
+struct http_route;
+
+// a request parsed in place, pointing into the client_buffer it arrived in, so it is only
+// good until the route handling it returns
+struct http_request {
+  // the method, such as GET
+  const char* method;
+  int method_length;
+  // the request target, query string and all
+  const char* target;
+  int target_length;
+  // 0 for HTTP/1.0, 1 for HTTP/1.1
+  int minor_version;
+  // the header fields, in the order they were sent
+  struct http_header headers[HTTP_MAX_HEADERS];
+  int nheaders;
+  // the body, as long as Content-Length said
+  const char* body;
+  int body_length;
+  // whether the connection stays open once we answered
+  bool keep_alive;
+  // the route answering the request
+  struct http_route* route;
+};
+
+// what http_parse found
+enum http_parse_status {
+  // a complete request
+  HTTP_PARSED,
+  // the start of a request, the rest has not arrived yet
+  HTTP_INCOMPLETE,
+  // something which is not a request we understand, 400
+  HTTP_BAD_REQUEST,
+  // a head which could never fit in the buffer, 431
+  HTTP_HEAD_TOO_LARGE,
+  // a body which could never fit in the buffer, 413
+  HTTP_BODY_TOO_LARGE,
+  // a transfer coding, which we do not take, 501
+  HTTP_UNSUPPORTED
+};
+
+// the size of the head of the request at the start of data, request line, headers and
+// the empty line ending them, or 0 if it has not all arrived. scanned is where the line
+// we have not seen the end of starts, so each line is only looked at once
+int http_head_size(const char* data, int length, int* scanned) {
+  while (true) {
+    const char* newline = scan_newline(data + *scanned, length - *scanned);
+    if (newline == NULL)
+      return 0;
+    int line = (int) (newline - data) - *scanned;
+    *scanned = (int) (newline - data) + 1;
+    if (line == 0 || (line == 1 && newline[-1] == '\r'))
+      return *scanned;
+  }
+}
+
+// whether a comma separated header value lists token, ignoring case
+bool http_has_token(const char* value, int length, const char* token) {
+  int size = (int) strlen(token), start = 0;
+  while (start < length) {
+    int end = start;
+    while (end < length && value[end] != ',')
+      end++;
+    int first = start, last = end;
+    while (first < last && (value[first] == ' ' || value[first] == '\t'))
+      first++;
+    while (last > first && (value[last - 1] == ' ' || value[last - 1] == '\t'))
+      last--;
+    if (last - first == size && strncasecmp(value + first, token, size) == 0)
+      return true;
+    start = end + 1;
+  }
+  return false;
+}
+
+// whether a header is called name, ignoring case
+bool http_header_is(struct http_header* header, const char* name) {
+  return header->name_length == (int) strlen(name) && strncasecmp(header->name, name, header->name_length) == 0;
+}
+
+// parse the request at the start of length bytes of data into request without copying or
+// allocating, setting size to the bytes it spans. scanned is for http_head_size, and is
+// left so that a request waiting on its body does not have its head searched again
+enum http_parse_status http_parse
+  ( // the unconsumed bytes
+    const char* data
+    // how many there are
+  , int length
+    // the most bytes a request may span
+  , int limit
+    // how far into data we already looked
+  , int* scanned
+    // set to the request found
+  , struct http_request* request
+    // set to the number of bytes the request spans
+  , int* size
+  )
+{
+  int head = http_head_size(data, length, scanned);
+  if (head == 0)
+    return length >= limit ? HTTP_HEAD_TOO_LARGE : HTTP_INCOMPLETE;
+
+  // the request line, method SP target SP version
+  const char* line = data;
+  const char* end = scan_newline(line, data + head - line);
+  int line_length = (int) (end - line);
+  if (line_length > 0 && line[line_length - 1] == '\r')
+    line_length--;
+  const char* space = (const char*) memchr(line, ' ', line_length);
+  if (space == NULL || space == line)
+    return HTTP_BAD_REQUEST;
+  request->method = line;
+  request->method_length = (int) (space - line);
+  request->target = space + 1;
+  space = (const char*) memchr(request->target, ' ', line + line_length - request->target);
+  if (space == NULL || space == request->target)
+    return HTTP_BAD_REQUEST;
+  request->target_length = (int) (space - request->target);
+  if (line + line_length - (space + 1) != 8 || memcmp(space + 1, "HTTP/1.", 7) != 0
+      || (space[8] != '0' && space[8] != '1'))
+    return HTTP_BAD_REQUEST;
+  request->minor_version = space[8] - '0';
+
+  // the header fields, name: value, up to the empty line
+  bool has_host = false, has_length = false, close = false, keep_alive = false;
+  long content_length = 0;
+  request->nheaders = 0;
+  for (line = end + 1; line < data + head; line = end + 1) {
+    end = scan_newline(line, data + head - line);
+    line_length = (int) (end - line);
+    if (line_length > 0 && line[line_length - 1] == '\r')
+      line_length--;
+    if (line_length == 0)
+      break;
+    if (request->nheaders == HTTP_MAX_HEADERS)
+      return HTTP_HEAD_TOO_LARGE;
+    const char* colon = (const char*) memchr(line, ':', line_length);
+    // no empty names, no whitespace in them, and no lines folded onto the one before
+    if (colon == NULL || colon == line || colon[-1] == ' ' || colon[-1] == '\t' || line[0] == ' ' || line[0] == '\t')
+      return HTTP_BAD_REQUEST;
+    struct http_header* header = &request->headers[request->nheaders++];
+    header->name = line;
+    header->name_length = (int) (colon - line);
+    const char* value = colon + 1;
+    const char* value_end = line + line_length;
+    while (value < value_end && (*value == ' ' || *value == '\t'))
+      value++;
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+      value_end--;
+    header->value = value;
+    header->value_length = (int) (value_end - value);
+
+    if (http_header_is(header, "Host")) {
+      has_host = true;
+    } else if (http_header_is(header, "Connection")) {
+      close = close || http_has_token(header->value, header->value_length, "close");
+      keep_alive = keep_alive || http_has_token(header->value, header->value_length, "keep-alive");
+    } else if (http_header_is(header, "Transfer-Encoding")) {
+      return HTTP_UNSUPPORTED;
+    } else if (http_header_is(header, "Content-Length")) {
+      // a second one could be smuggling a request past a proxy that believes the other
+      if (has_length || header->value_length == 0)
+        return HTTP_BAD_REQUEST;
+      has_length = true;
+      int i;
+      for (i = 0; i < header->value_length; i++) {
+        if (header->value[i] < '0' || header->value[i] > '9')
+          return HTTP_BAD_REQUEST;
+        content_length = content_length * 10 + (header->value[i] - '0');
+        if (content_length > limit)
+          return HTTP_BODY_TOO_LARGE;
+      }
+    }
+  }
+  if (request->minor_version == 1 && !has_host)
+    return HTTP_BAD_REQUEST;
+  request->keep_alive = request->minor_version == 1 ? !close : keep_alive && !close;
+
+  if (content_length > limit - head)
+    return HTTP_BODY_TOO_LARGE;
+  if (length - head < content_length) {
+    // come back to the empty line, and find it straight away once the body is in
+    *scanned = head - 1;
+    if (*scanned > 0 && data[*scanned - 1] == '\r')
+      (*scanned)--;
+    return HTTP_INCOMPLETE;
+  }
+  request->body = data + head;
+  request->body_length = (int) content_length;
+  *size = head + (int) content_length;
+  *scanned = 0;
+  return HTTP_PARSED;
+}
+
+// the reason phrase of a status code
+const char* http_reason(int status) {
+  switch (status) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 413: return "Content Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    default: return "Unknown";
+  }
+}
+
+// what the server answers one method and path with
+struct http_route {
+  // the method to answer, HEAD is answered by the GET route
+  const char* method;
+  // the path to answer, matched exactly, without the query string
+  const char* path;
+  // the status of the response
+  int status;
+  // the media type of the response
+  const char* content_type;
+  // the body of every response, when handle is NULL
+  const char* body;
+  // answers the request with http_respond, NULL to always answer with body
+  void (*handle)(struct connection* connection, struct http_request* request);
+  // the status line and Content-Type, serialized once by make_http_handler
+  char* prefix;
+  size_t prefix_length;
+  // with a fixed body, the whole response for keeping the connection open and for closing
+  // it, serialized once by make_http_handler
+  char* responses[2];
+  size_t response_lengths[2];
+  // how many bytes of each of responses are the head, all a HEAD request gets
+  size_t head_lengths[2];
+};
+
+// the routes of the http handler, its context
+struct http_router {
+  // the routes, tried in order
+  struct http_route* routes;
+  // the number of routes
+  int nroutes;
+  // what requests matching no route get
+  struct http_route not_found;
+};
+
+// serialize what a route always answers with, so answering costs no formatting
+void http_serialize_route(struct http_route* route) {
+  size_t length = strlen(route->content_type) + strlen(http_reason(route->status)) + 64;
+  route->prefix = (char*) malloc(length);
+  if (route->prefix == NULL)
+    panic("failed to allocate http route")
+  route->prefix_length = (size_t) snprintf
+    ( route->prefix, length, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\n"
+    , route->status, http_reason(route->status), route->content_type);
+  if (route->handle != NULL)
+    return;
+  size_t body_length = strlen(route->body);
+  int i;
+  for (i = 0; i < 2; i++) {
+    length = route->prefix_length + body_length + 64;
+    route->responses[i] = (char*) malloc(length);
+    if (route->responses[i] == NULL)
+      panic("failed to allocate http route")
+    route->head_lengths[i] = (size_t) snprintf
+      ( route->responses[i], length, "%sContent-Length: %zu\r\n%s\r\n"
+      , route->prefix, body_length, i == 0 ? "" : "Connection: close\r\n");
+    memcpy(route->responses[i] + route->head_lengths[i], route->body, body_length);
+    route->response_lengths[i] = route->head_lengths[i] + body_length;
+  }
+}
+
+// whether a request is a HEAD, whose response has no body
+bool http_is_head(struct http_request* request) {
+  return request->method_length == 4 && memcmp(request->method, "HEAD", 4) == 0;
+}
+
+// answer a request with the status and Content-Type of its route, and body, closing the
+// connection afterwards if the request did not keep it alive
+void http_respond(struct connection* connection, struct http_request* request, const char* body, size_t length) {
+  // the prefix lives as long as the route, so it goes out without a copy
+  connection_write_reference(connection, request->route->prefix, request->route->prefix_length, NULL, NULL);
+  char head[64];
+  int head_length = snprintf
+    ( head, sizeof(head), "Content-Length: %zu\r\n%s\r\n"
+    , length, request->keep_alive ? "" : "Connection: close\r\n");
+  connection_write(connection, head, head_length);
+  if (!http_is_head(request))
+    connection_write(connection, body, length);
+  if (!request->keep_alive)
+    connection_close(connection);
+}
+
+// answer something we could not make a request of, and hang up
+void http_fail(struct connection* connection, int status) {
+  char response[128];
+  int length = snprintf
+    ( response, sizeof(response), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+    , status, http_reason(status));
+  connection_write(connection, response, length);
+  connection_close(connection);
+}
+
+// the route for a request, the not_found route if none matches
+struct http_route* http_route(struct http_router* router, struct http_request* request) {
+  const char* query = (const char*) memchr(request->target, '?', request->target_length);
+  int path_length = query == NULL ? request->target_length : (int) (query - request->target);
+  int i;
+  for (i = 0; i < router->nroutes; i++) {
+    struct http_route* route = &router->routes[i];
+    const char* method = http_is_head(request) ? "GET" : request->method;
+    int method_length = http_is_head(request) ? 3 : request->method_length;
+    if ((int) strlen(route->path) == path_length && memcmp(route->path, request->target, path_length) == 0
+        && (int) strlen(route->method) == method_length && memcmp(route->method, method, method_length) == 0)
+      return route;
+  }
+  return &router->not_found;
+}
+
+// answer every complete request that arrived, in order, so pipelined responses go out in
+// the order they were asked for
+void http_on_data(struct connection* connection) {
+  struct http_router* router = (struct http_router*) connection->worker->handler->context;
+  struct client_buffer* client_buffer = connection->client_buffer;
+  while (!connection->closing) {
+    const char* data = client_buffer_data(client_buffer);
+    int pending = client_buffer_pending(client_buffer);
+    // empty lines between requests are allowed
+    if (connection->scanned == 0 && pending > 0
+        && (data[0] == '\n' || (pending > 1 && data[0] == '\r' && data[1] == '\n'))) {
+      consume_client_buffer(client_buffer, data[0] == '\n' ? 1 : 2);
+      continue;
+    }
+    struct http_request request;
+    int size;
+    switch (http_parse(data, pending, client_buffer->limit, &connection->scanned, &request, &size)) {
+      case HTTP_INCOMPLETE:
+        return;
+      case HTTP_BAD_REQUEST:
+        http_fail(connection, 400);
+        return;
+      case HTTP_HEAD_TOO_LARGE:
+        http_fail(connection, 431);
+        return;
+      case HTTP_BODY_TOO_LARGE:
+        http_fail(connection, 413);
+        return;
+      case HTTP_UNSUPPORTED:
+        http_fail(connection, 501);
+        return;
+      case HTTP_PARSED:
+        break;
+    }
+    request.route = http_route(router, &request);
+    // tell the client to take its next request elsewhere, rather than close under it
+    if (connection_draining(connection))
+      request.keep_alive = false;
+    if (request.route->handle != NULL) {
+      request.route->handle(connection, &request);
+    } else {
+      int which = request.keep_alive ? 0 : 1;
+      connection_write_reference
+        ( connection, request.route->responses[which]
+        , http_is_head(&request) ? request.route->head_lengths[which] : request.route->response_lengths[which]
+        , NULL, NULL);
+      if (!request.keep_alive)
+        connection_close(connection);
+    }
+    consume_client_buffer(client_buffer, size);
+  }
+}
+
+// a handler serving HTTP/1.1 from the routes of router, which must outlive it
+struct handler make_http_handler(struct http_router* router) {
+  router->not_found.method = "";
+  router->not_found.path = "";
+  router->not_found.status = 404;
+  router->not_found.content_type = "text/plain";
+  router->not_found.body = "not found\n";
+  router->not_found.handle = NULL;
+  http_serialize_route(&router->not_found);
+  int i;
+  for (i = 0; i < router->nroutes; i++)
+    http_serialize_route(&router->routes[i]);
+  struct handler handler = { NULL, http_on_data, NULL, NULL, router, FRAMING_NONE, NULL, NULL };
+  return handler;
+}
+
+// answer a POST with its own body
+void http_echo(struct connection* connection, struct http_request* request) {
+  http_respond(connection, request, request->body, request->body_length);
+}
+
+// the demo routes of the http mode
+struct http_route demo_routes[] =
+  { { "GET", "/", 200, "text/plain", "hello\n", NULL, NULL, 0, { NULL, NULL }, { 0, 0 }, { 0, 0 } }
+  , { "GET", "/health", 200, "text/plain", "ok\n", NULL, NULL, 0, { NULL, NULL }, { 0, 0 }, { 0, 0 } }
+  , { "POST", "/echo", 200, "application/octet-stream", NULL, http_echo, NULL, 0, { NULL, NULL }, { 0, 0 }, { 0, 0 } }
+  };
+
+// not_found is filled in by make_http_handler
+struct http_router demo_router =
+  { demo_routes, sizeof(demo_routes) / sizeof(demo_routes[0])
+  , { NULL, NULL, 0, NULL, NULL, NULL, NULL, 0, { NULL, NULL }, { 0, 0 }, { 0, 0 } } };
+
+// the built-in cache, a memcached-style store of keys and values in a fixed budget of
+// memory shared by every worker, answering GET, SET and DEL over length-prefixed frames
+
+// the operation a request frame starts with
+enum kv_operation {
+  // keys follow, each a length byte and that many bytes, and each is answered with a frame
+  // of its own holding its value, in order
+  KV_GET = 'G',
+  // a length byte and a key follow, then the value, the rest of the frame
+  KV_SET = 'S',
+  // keys follow as for KV_GET, each answered with a frame of its own, in order
+  KV_DELETE = 'D'
+};
+
+// what the cache answers with, the first byte of every response frame
+enum kv_status {
+  // found, with the value after this byte, stored or deleted
+  KV_OK,
+  // no such key
+  KV_NOT_FOUND,
+  // the key and value do not fit in the largest item
+  KV_TOO_LARGE,
+  // the frame was not a request, the connection closes after this
+  KV_BAD_REQUEST
+};
+
+// where an item is, in KV_ITEM_UNITs from the start of the memory of its stripe, counted
+// from 1 so a zeroed table is an empty one and a 0 ends a free list
+typedef uint32_t kv_reference;
+
+// no item
+#define KV_NONE 0
+
+// the item references in a page
+#define KV_PAGE_UNITS (KV_PAGE_SIZE / KV_ITEM_UNIT)
+
+// a key and its value, at the start of a slot of its size class
+struct kv_item {
+  // the next free item of the class, while this one is free
+  kv_reference next_free;
+  // the number of bytes of value after the key
+  uint32_t value_length;
+  // the number of bytes of key, 0 while the item is free
+  uint8_t key_length;
+  // set by hits and cleared by the CLOCK hand passing, which evicts the item if it was
+  // already clear
+  uint8_t referenced;
+  // the key then the value
+  char data[];
+};
+
+// a slot of the table of a stripe
+struct kv_entry {
+  // the low bits of the hash of the key, which also say where its probe starts
+  uint32_t hash;
+  // the item holding the key, KV_NONE if the slot is empty
+  kv_reference item;
+};
+
+// the items of one size in a stripe
+struct kv_class {
+  // the pages holding the items, as indices into the memory of the stripe
+  uint32_t* pages;
+  // the number of pages
+  uint32_t npages;
+  // the first free item, KV_NONE when every item holds a key
+  kv_reference free;
+  // the item the CLOCK hand points at, counted across pages
+  uint32_t hand;
+};
+
+// a share of the keys, with everything needed to serve them behind its lock
+struct kv_stripe {
+  _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+  // open addressing with linear probing, sized so that even with every item as small as
+  // they come it is at most half full
+  struct kv_entry* entries;
+  // the number of entries - 1, fixed once the store is made
+  uint32_t mask;
+  // the memory of the stripe, npages pages handed to the classes as they need them
+  char* memory;
+  uint32_t npages;
+  // the number of pages handed to a class so far
+  uint32_t used_pages;
+  // the class each page handed out holds
+  uint8_t* page_classes;
+  struct kv_class classes[KV_CLASSES];
+};
+
+// the cache, the context of the kv handler
+struct kv_store {
+  struct kv_stripe stripes[KV_STRIPES];
+};
+
+// the size of the items of a class
+static inline size_t kv_class_size(int class) {
+  return (size_t) KV_ITEM_UNIT << class;
+}
+
+// the smallest class holding an item of size bytes
+int kv_class_of(size_t size) {
+  int class = 0;
+  while (kv_class_size(class) < size)
+    class++;
+  return class;
+}
+
+// a 64 bit hash of a key, a multiply and a shift per 8 bytes
+uint64_t kv_hash(const char* key, int length) {
+  uint64_t hash = 0x9e3779b97f4a7c15ull ^ (uint64_t) length;
+  while (length >= 8) {
+    uint64_t chunk;
+    memcpy(&chunk, key, 8);
+    hash = (hash ^ chunk) * 0xff51afd7ed558ccdull;
+    hash ^= hash >> 32;
+    key += 8;
+    length -= 8;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, key, length);
+  hash = (hash ^ tail) * 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 29;
+  hash *= 0xff51afd7ed558ccdull;
+  return hash ^ (hash >> 32);
+}
+
+// the stripe of a hash, by its top bits, leaving the low ones for the table
+static inline struct kv_stripe* kv_stripe_of(struct kv_store* store, uint64_t hash) {
+  return &store->stripes[hash >> (64 - KV_STRIPE_BITS)];
+}
+
+static inline struct kv_item* kv_item_at(struct kv_stripe* stripe, kv_reference reference) {
+  return (struct kv_item*) (stripe->memory + (size_t) (reference - 1) * KV_ITEM_UNIT);
+}
+
+// the page an item is on
+static inline uint32_t kv_page_of(kv_reference reference) {
+  return (reference - 1) / KV_PAGE_UNITS;
+}
+
+// the entry holding key, or the empty entry it would go in
+struct kv_entry* kv_find(struct kv_stripe* stripe, uint64_t hash, const char* key, int key_length) {
+  uint32_t index = (uint32_t) hash & stripe->mask;
+  while (true) {
+    struct kv_entry* entry = &stripe->entries[index];
+    if (entry->item == KV_NONE)
+      return entry;
+    if (entry->hash == (uint32_t) hash) {
+      struct kv_item* item = kv_item_at(stripe, entry->item);
+      if (item->key_length == key_length && memcmp(item->data, key, key_length) == 0)
+        return entry;
+    }
+    index = (index + 1) & stripe->mask;
+  }
+}
+
+// empty an entry, moving the entries after it back into the hole wherever that keeps them
+// on their probes, so no probe meets an empty entry before the key it is looking for
+void kv_remove_entry(struct kv_stripe* stripe, struct kv_entry* entry) {
+  uint32_t hole = (uint32_t) (entry - stripe->entries);
+  uint32_t index = hole;
+  while (true) {
+    index = (index + 1) & stripe->mask;
+    struct kv_entry* next = &stripe->entries[index];
+    if (next->item == KV_NONE)
+      break;
+    // it may move unless its probe starts after the hole
+    uint32_t home = next->hash & stripe->mask;
+    if (((index - home) & stripe->mask) >= ((index - hole) & stripe->mask)) {
+      stripe->entries[hole] = *next;
+      hole = index;
+    }
+  }
+  stripe->entries[hole].item = KV_NONE;
+}
+
+// drop the entry of an item holding a key
+void kv_unlink(struct kv_stripe* stripe, struct kv_item* item) {
+  uint64_t hash = kv_hash(item->data, item->key_length);
+  kv_remove_entry(stripe, kv_find(stripe, hash, item->data, item->key_length));
+}
+
+// put an item on the free list of its class
+void kv_free_item(struct kv_stripe* stripe, struct kv_class* class, kv_reference reference) {
+  struct kv_item* item = kv_item_at(stripe, reference);
+  item->key_length = 0;
+  item->next_free = class->free;
+  class->free = reference;
+}
+
+// hand a page to a class, all of its items free
+void kv_give_page(struct kv_stripe* stripe, int class_index, uint32_t page) {
+  struct kv_class* class = &stripe->classes[class_index];
+  stripe->page_classes[page] = (uint8_t) class_index;
+  class->pages[class->npages++] = page;
+  uint32_t step = (uint32_t) (kv_class_size(class_index) / KV_ITEM_UNIT);
+  kv_reference first = page * KV_PAGE_UNITS + 1;
+  uint32_t count = KV_PAGE_UNITS / step;
+  // freed last to first, so the list hands them out in address order
+  while (count-- > 0)
+    kv_free_item(stripe, class, first + count * step);
+}
+
+// take the last page of the class holding the most, other than the one that wants it,
+// forgetting the keys of its items
+uint32_t kv_take_page(struct kv_stripe* stripe, int wanted) {
+  int victim = -1, i;
+  for (i = 0; i < KV_CLASSES; i++)
+    if (i != wanted && (victim == -1 || stripe->classes[i].npages > stripe->classes[victim].npages))
+      victim = i;
+  struct kv_class* class = &stripe->classes[victim];
+  uint32_t page = class->pages[--class->npages];
+  uint32_t step = (uint32_t) (kv_class_size(victim) / KV_ITEM_UNIT);
+  kv_reference first = page * KV_PAGE_UNITS + 1, end = first + KV_PAGE_UNITS;
+  kv_reference reference;
+  for (reference = first; reference < end; reference += step) {
+    struct kv_item* item = kv_item_at(stripe, reference);
+    if (item->key_length != 0)
+      kv_unlink(stripe, item);
+  }
+  // the free list runs through every page of the class, so the page's own are picked out
+  kv_reference* link = &class->free;
+  while (*link != KV_NONE) {
+    if (*link >= first && *link < end)
+      *link = kv_item_at(stripe, *link)->next_free;
+    else
+      link = &kv_item_at(stripe, *link)->next_free;
+  }
+  return page;
+}
+
+// evict the first item of a class the hand finds unreferenced since it last came by,
+// clearing the references it passes on the way, only called once every item holds a key
+void kv_clock(struct kv_stripe* stripe, int class_index) {
+  struct kv_class* class = &stripe->classes[class_index];
+  uint32_t per_page = (uint32_t) (KV_PAGE_SIZE / kv_class_size(class_index));
+  uint32_t step = KV_PAGE_UNITS / per_page;
+  while (true) {
+    if (class->hand >= class->npages * per_page)
+      class->hand = 0;
+    kv_reference reference = class->pages[class->hand / per_page] * KV_PAGE_UNITS + 1
+      + class->hand % per_page * step;
+    class->hand++;
+    struct kv_item* item = kv_item_at(stripe, reference);
+    if (item->referenced) {
+      item->referenced = 0;
+      continue;
+    }
+    kv_unlink(stripe, item);
+    kv_free_item(stripe, class, reference);
+    return;
+  }
+}
+
+// a free item of a class: from its free list, a page nobody has had yet, a page of the
+// class with the most when it has none of its own, or evicted by its CLOCK
+kv_reference kv_allocate(struct kv_stripe* stripe, int class_index) {
+  struct kv_class* class = &stripe->classes[class_index];
+  if (class->free == KV_NONE) {
+    if (stripe->used_pages < stripe->npages)
+      kv_give_page(stripe, class_index, stripe->used_pages++);
+    else if (class->npages == 0)
+      kv_give_page(stripe, class_index, kv_take_page(stripe, class_index));
+    else
+      kv_clock(stripe, class_index);
+  }
+  kv_reference reference = class->free;
+  class->free = kv_item_at(stripe, reference)->next_free;
+  return reference;
+}
+
+// called with the status of a key and, when found, its value, which only stays put until
+// this returns
+typedef void (*kv_deliver)(void* argument, enum kv_status status, const char* value, uint32_t length);
+
+// look up key, handing deliver its value under the lock of its stripe
+void kv_get(struct kv_store* store, uint64_t hash, const char* key, int key_length, kv_deliver deliver, void* argument) {
+  struct kv_stripe* stripe = kv_stripe_of(store, hash);
+  pthread_mutex_lock(&stripe->lock);
+  struct kv_entry* entry = kv_find(stripe, hash, key, key_length);
+  if (entry->item == KV_NONE) {
+    pthread_mutex_unlock(&stripe->lock);
+    deliver(argument, KV_NOT_FOUND, NULL, 0);
+    return;
+  }
+  struct kv_item* item = kv_item_at(stripe, entry->item);
+  // hot items are hit over and over, only the first hit since the hand passed writes
+  if (!item->referenced)
+    item->referenced = 1;
+  deliver(argument, KV_OK, item->data + item->key_length, item->value_length);
+  pthread_mutex_unlock(&stripe->lock);
+}
+
+// store value under key, replacing whatever it held
+enum kv_status kv_set
+  ( struct kv_store* store, uint64_t hash, const char* key, int key_length
+  , const char* value, uint32_t value_length)
+{
+  size_t size = offsetof(struct kv_item, data) + key_length + (size_t) value_length;
+  if (size > KV_PAGE_SIZE)
+    return KV_TOO_LARGE;
+  int class_index = kv_class_of(size);
+  struct kv_stripe* stripe = kv_stripe_of(store, hash);
+  pthread_mutex_lock(&stripe->lock);
+  struct kv_entry* entry = kv_find(stripe, hash, key, key_length);
+  kv_reference reference = entry->item;
+  // a value of another size moves to an item of its class
+  if (reference != KV_NONE && stripe->page_classes[kv_page_of(reference)] != class_index) {
+    kv_remove_entry(stripe, entry);
+    kv_free_item(stripe, &stripe->classes[stripe->page_classes[kv_page_of(reference)]], reference);
+    reference = KV_NONE;
+  }
+  struct kv_item* item;
+  if (reference == KV_NONE) {
+    reference = kv_allocate(stripe, class_index);
+    item = kv_item_at(stripe, reference);
+    item->key_length = (uint8_t) key_length;
+    item->referenced = 0;
+    memcpy(item->data, key, key_length);
+    // allocating may have evicted, moving entries about, so the empty one is found again
+    entry = kv_find(stripe, hash, key, key_length);
+    entry->hash = (uint32_t) hash;
+    entry->item = reference;
+  } else {
+    item = kv_item_at(stripe, reference);
+  }
+  item->value_length = value_length;
+  memcpy(item->data + key_length, value, value_length);
+  pthread_mutex_unlock(&stripe->lock);
+  return KV_OK;
+}
+
+// forget key
+enum kv_status kv_delete(struct kv_store* store, uint64_t hash, const char* key, int key_length) {
+  struct kv_stripe* stripe = kv_stripe_of(store, hash);
+  pthread_mutex_lock(&stripe->lock);
+  struct kv_entry* entry = kv_find(stripe, hash, key, key_length);
+  kv_reference reference = entry->item;
+  if (reference != KV_NONE) {
+    kv_remove_entry(stripe, entry);
+    kv_free_item(stripe, &stripe->classes[stripe->page_classes[kv_page_of(reference)]], reference);
+  }
+  pthread_mutex_unlock(&stripe->lock);
+  return reference == KV_NONE ? KV_NOT_FOUND : KV_OK;
+}
+
+// whether keys, each a length byte and that many bytes, fill length exactly
+bool kv_valid_keys(const unsigned char* keys, int length) {
+  int offset = 0;
+  while (offset < length) {
+    if (keys[offset] == 0)
+      return false;
+    offset += 1 + keys[offset];
+  }
+  return length > 0 && offset == length;
+}
+
+// get or delete each of keys, as kv_valid_keys has them, delivering their statuses in
+// order, KV_BATCH at a time: the keys of a batch are all hashed and the entries their probes
+// start at prefetched before the first is looked up, so their cache misses overlap rather
+// than each waiting for the one before
+void kv_each_key
+  ( struct kv_store* store, enum kv_operation operation, const unsigned char* keys, int length
+  , kv_deliver deliver, void* argument)
+{
+  const char* batch[KV_BATCH];
+  int lengths[KV_BATCH];
+  uint64_t hashes[KV_BATCH];
+  int offset = 0;
+  while (offset < length) {
+    int count, i;
+    for (count = 0; count < KV_BATCH && offset < length; count++) {
+      lengths[count] = keys[offset];
+      batch[count] = (const char*) keys + offset + 1;
+      offset += 1 + lengths[count];
+      hashes[count] = kv_hash(batch[count], lengths[count]);
+      // entries and mask are fixed once the store is made, so this needs no lock
+      struct kv_stripe* stripe = kv_stripe_of(store, hashes[count]);
+      __builtin_prefetch(&stripe->entries[(uint32_t) hashes[count] & stripe->mask]);
+    }
+    for (i = 0; i < count; i++) {
+      if (operation == KV_GET)
+        kv_get(store, hashes[i], batch[i], lengths[i], deliver, argument);
+      else
+        deliver(argument, kv_delete(store, hashes[i], batch[i], lengths[i]), NULL, 0);
+    }
+  }
+}
+
+// answer a connection with a frame of a status and, for a hit, the value
+void kv_respond(void* argument, enum kv_status status, const char* value, uint32_t length) {
+  struct connection* connection = (struct connection*) argument;
+  uint32_t body = length + 1;
+  unsigned char head[FRAME_PREFIX_SIZE + 1] =
+    { (unsigned char) (body >> 24), (unsigned char) (body >> 16), (unsigned char) (body >> 8)
+    , (unsigned char) body, (unsigned char) status };
+  connection_write(connection, head, sizeof(head));
+  connection_write(connection, value, length);
+}
+
+// answer every request frame, in order, closing the connection at the first that is not one
+void kv_on_frames(struct connection* connection, const struct frame* frames, int count) {
+  struct kv_store* store = (struct kv_store*) connection->worker->handler->context;
+  int i;
+  for (i = 0; i < count && !connection->closing; i++) {
+    const unsigned char* data = (const unsigned char*) frames[i].data;
+    int length = frames[i].length;
+    if (length >= 2 && data[0] == KV_SET && data[1] > 0 && 2 + data[1] <= length) {
+      const char* key = (const char*) data + 2;
+      uint64_t hash = kv_hash(key, data[1]);
+      kv_respond(connection, kv_set(store, hash, key, data[1], key + data[1], length - 2 - data[1]), NULL, 0);
+    } else if (length >= 1 && (data[0] == KV_GET || data[0] == KV_DELETE)
+               && kv_valid_keys(data + 1, length - 1)) {
+      kv_each_key(store, (enum kv_operation) data[0], data + 1, length - 1, kv_respond, connection);
+    } else {
+      kv_respond(connection, KV_BAD_REQUEST, NULL, 0);
+      connection_close(connection);
+    }
+  }
+}
+
+// a cache keeping its items in memory bytes, split evenly between its stripes, and mapped
+// up front but only touched as items come
+struct kv_store* make_kv_store(size_t memory, bool huge_pages) {
+  struct kv_store* store = (struct kv_store*) aligned_alloc(CACHE_LINE_SIZE, sizeof(struct kv_store));
+  if (store == NULL)
+    panic("failed to allocate cache")
+  uint32_t npages = (uint32_t) (memory / KV_STRIPES / KV_PAGE_SIZE);
+  size_t stripe_memory = (size_t) npages * KV_PAGE_SIZE;
+  char* pages = mmap
+    ( NULL, stripe_memory * KV_STRIPES, PROT_READ | PROT_WRITE
+    , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (pages == MAP_FAILED)
+    panic("failed to map cache memory")
+  // only a hint, without THP the items sit on ordinary pages
+  if (huge_pages)
+    madvise(pages, stripe_memory * KV_STRIPES, MADV_HUGEPAGE);
+  size_t nentries = 1;
+  while (nentries < 2 * stripe_memory / KV_ITEM_UNIT)
+    nentries <<= 1;
+  int i, j;
+  for (i = 0; i < KV_STRIPES; i++) {
+    struct kv_stripe* stripe = &store->stripes[i];
+    pthread_mutex_init(&stripe->lock, NULL);
+    // calloc of this much maps fresh zeroed pages, so the table costs only what probes touch
+    stripe->entries = (struct kv_entry*) calloc(nentries, sizeof(struct kv_entry));
+    stripe->page_classes = (uint8_t*) malloc(npages);
+    if (stripe->entries == NULL || stripe->page_classes == NULL)
+      panic("failed to allocate cache table")
+    stripe->mask = (uint32_t) (nentries - 1);
+    stripe->memory = pages + i * stripe_memory;
+    stripe->npages = npages;
+    stripe->used_pages = 0;
+    for (j = 0; j < KV_CLASSES; j++) {
+      struct kv_class* class = &stripe->classes[j];
+      class->pages = (uint32_t*) malloc(npages * sizeof(uint32_t));
+      if (class->pages == NULL)
+        panic("failed to allocate cache classes")
+      class->npages = 0;
+      class->free = KV_NONE;
+      class->hand = 0;
+    }
+  }
+  return store;
+}
+
+// a handler serving the cache in store, which must outlive it
+struct handler make_kv_handler(struct kv_store* store) {
+  struct handler handler = { NULL, NULL, NULL, NULL, store, FRAMING_LENGTH_PREFIXED, kv_on_frames, NULL };
+  return handler;
+}
+
+// microbench.c includes this file for the primitives above and brings its own main
+#ifndef SERVER_NO_MAIN
+int main(int argc, char** argv) {
+  unsigned int ncpus = available_cpus();
+  struct config config = make_config
+    ( 8080
     , INADDR_ANY
     , 500
-    , PROCESSOR_COUNT
-    , PROCESSOR_COUNT * 100
+    , ncpus
+    , ncpus * 100
+    , true
+    , SERVER_MODE_REACTOR
+    , IO_BACKEND_EPOLL
     );
+  struct configure_result options = configure(&config, argc, argv);
   struct server server = initialize_server(config);
-  run_server(handle_client, server);
+  // --kv serves the built-in cache and --http the demo routes over HTTP/1.1, rather than
+  // echoing
+  if (options.kv) {
+    struct handler kv_handler = make_kv_handler(make_kv_store(options.kv_memory, config.huge_pages));
+    run_server(&kv_handler, server);
+  } else if (options.http) {
+    struct handler http_handler = make_http_handler(&demo_router);
+    run_server(&http_handler, server);
+  } else {
+    run_server(&echo_handler, server);
+  }
 }
+#endif